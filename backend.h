@@ -0,0 +1,29 @@
+/*
+ * How libusbdevs finds its controllers and the calls it makes on them.
+ * It uses /dev and the system calls itself, and the front end may
+ * wrap them for tracing, recording and replay by pointing
+ * usbdevs_backend at a backend of its own; the benchmark build
+ * (-DUSBDEVS_MOCK) links mock.c, which answers them from a generated
+ * device tree instead.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+typedef void (*scan_fn)(const char *, void *);
+
+struct usb_backend {
+	const char	*name;
+	int		(*scan)(scan_fn, void *);	/* each controller path */
+	int		(*open)(const char *, int);
+	int		(*ioctl)(int, unsigned long, void *);
+	int		(*close)(int);
+};
+
+extern const struct usb_backend *usbdevs_backend;
+
+#ifdef USBDEVS_MOCK
+extern const struct usb_backend mock_backend;
+#endif
+
+#endif /* BACKEND_H */
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Run every dump mode of the benchmark build against mock trees of
+# 1, 16 and 127 devices per controller on 1, 10 and 32 controllers,
+# and report the ioctls issued, wall time and bytes of output of each.
+# "open" is how many of the controllers the tool actually looked at.
+#
+# Each tree is first recorded into a capture file (-W), and every mode
+# is then run a second time replaying it (-R); "replay" is the wall time
+# of that run, or "differs" if its output is not the same.  Diffing the
+# live tree against its own capture (-x) must find nothing, or the
+# script fails.
+
+bench=${1:-./usbdevs-bench}
+out=${TMPDIR:-/tmp}/usbdevs-bench.$$
+trap 'rm -f $out.out $out.err $out.cache $out.cap $out.rout' EXIT
+
+set -- \
+	"" "-v" "-e" "-c" "-f" "-f all" "-evf" "-s" "-A -v" "-p -v" \
+	"-p -evf" "-o json -evf" "-o bin -evf" "-o tree" "-B" "-S" \
+	"-D uhub1" "-x $out.cap -evf" \
+	"-C $out.cache -f" "-C $out.cache -f"
+
+now() {
+	perl -MTime::HiRes=time -e 'printf "%.6f", time'
+}
+
+status=0
+printf "%-5s %-5s %-5s %-14s %8s %10s %10s %10s\n" ctlrs open devs mode \
+    ioctls seconds replay bytes
+for ctlrs in 1 10 32; do
+	for devs in 1 16 127; do
+		rm -f $out.cap
+		for mode in "-evf" "-c" "-c all" "-f all" "-s"; do
+			USBDEVS_MOCK=$ctlrs:$devs $bench -W $out.cap $mode \
+			    >/dev/null 2>&1
+		done
+		rm -f $out.cache
+		for mode in "$@"; do
+			label=$(echo "$mode" |
+			    sed "s|$out.cache|cache|;s|$out.cap|cap|")
+			start=$(now)
+			USBDEVS_MOCK=$ctlrs:$devs $bench $mode \
+			    >$out.out 2>$out.err
+			rv=$?
+			end=$(now)
+			case $mode in
+			-x*)
+				if [ $rv -ne 0 ]; then
+					echo "$ctlrs:$devs: '$label':" \
+					    "exit $rv" >&2
+					status=1
+				fi
+				;;
+			esac
+			opened=$(sed -n 's/^mock: controllers \([0-9]*\).*/\1/p' \
+			    $out.err)
+			ioctls=$(sed -n 's/^mock: .* ioctls //p' $out.err)
+			seconds=$(awk "BEGIN { print $end - $start }")
+
+			start=$(now)
+			$bench -R $out.cap $mode >$out.rout 2>/dev/null
+			end=$(now)
+			if cmp -s $out.out $out.rout; then
+				replay=$(awk "BEGIN { printf \"%.6f\", \
+				    $end - $start }")
+			else
+				replay=differs
+			fi
+			printf "%-5s %-5s %-5s %-14s %8s %10.6f %10s %10s\n" \
+			    $ctlrs "$opened" $devs "'$label'" "$ioctls" \
+			    $seconds $replay $(wc -c <$out.out)
+		done
+	done
+done
+
+# Devices that take 200us to answer each request that reaches them,
+# serially, with per-controller workers, against a -t deadline and
+# probed with -P, which paces its requests on each bus.
+printf "\n%-5s %-5s %-5s %-20s %8s %10s\n" ctlrs usec devs mode ioctls \
+    seconds
+for ctlrs in 1 4; do
+	for mode in "-evf" "-j 4 -evf" "-j 16 -evf" "-p -j 16 -evf" \
+	    "-j 4 -t 100:1 -evf" "-P 3:1"; do
+		start=$(now)
+		USBDEVS_MOCK=$ctlrs:127:200 $bench $mode >$out.out 2>$out.err
+		end=$(now)
+		ioctls=$(sed -n 's/^mock: .* ioctls //p' $out.err)
+		printf "%-5s %-5s %-5s %-20s %8s %10.6f\n" $ctlrs 200 127 \
+		    "'$mode'" "$ioctls" $(awk "BEGIN { print $end - $start }")
+	done
+done
+
+exit $status
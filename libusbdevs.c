@@ -0,0 +1,499 @@
+/*
+ * libusbdevs: the part of myusbdevs that talks to usb(4).  It finds the
+ * controllers, walks their devices, fetches descriptors and counters
+ * into the caller's buffers and decodes descriptor sets, by way of
+ * usbdevs_backend, which the front end may wrap for tracing, recording
+ * and replay.  Nothing here prints or exits; errors go back as -1 and
+ * errno.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <dev/usb/usb.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "libusbdevs.h"
+
+#ifndef nitems
+#define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+#define MINIMUM(a, b) (((a) < (b)) ? (a) : (b))
+
+#define USBDEV "/dev/usb"
+#define USBDEV_DIR "/dev"
+#define USBDEV_NAME "usb"
+
+#define C_DESC 2
+#define S_DESC 3
+#define I_DESC 4
+#define E_DESC 5
+#define IAD_DESC 0x0b
+#define BOS_DESC 0x0f
+#define DEVCAP_DESC 0x10
+#define HID_DESC 0x21
+#define CS_IFACE_DESC 0x24
+#define CS_ENDPT_DESC 0x25
+#define SSCOMP_DESC 0x30
+
+#define DK_ANY (-1)
+
+/*
+ * How to recognise one kind of descriptor.  A class-specific descriptor
+ * is told apart by the class and subclass of the interface it follows
+ * and by its subtype byte; DK_ANY matches anything.
+ */
+struct desc_kind {
+	int		 kind;		/* USBDEVS_DESC_* */
+	uint8_t		 type;		/* bDescriptorType */
+	int		 ifclass;
+	int		 ifsubclass;
+	int		 subtype;
+	uint8_t		 minlen;
+	const char	*name;
+	const char	**subnames;	/* by subtype */
+	size_t		 nsubnames;
+};
+
+static const struct desc_kind *desc_kind(const unsigned char *,
+    const struct usbdevs_desc *);
+
+#ifdef USBDEVS_MOCK
+const struct usb_backend *usbdevs_backend = &mock_backend;
+#else
+static int unit_cmp(const void *, const void *);
+static int sys_scan(scan_fn, void *);
+static int sys_open(const char *, int);
+static int sys_ioctl(int, unsigned long, void *);
+
+static const struct usb_backend sys_backend = {
+	"sys", sys_scan, sys_open, sys_ioctl, close
+};
+const struct usb_backend *usbdevs_backend = &sys_backend;
+
+static int
+unit_cmp(const void *a, const void *b)
+{
+	int ua = *(const int *)a, ub = *(const int *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Find the controllers by their device nodes, in unit order: whatever
+ * /dev holds is what gets opened, however many there are.
+ */
+static int
+sys_scan(scan_fn fn, void *arg)
+{
+	char path[PATH_MAX];
+	const char *errstr;
+	struct dirent *dp;
+	DIR *dir;
+	int *units = NULL, *u, unit;
+	size_t n = 0, i;
+
+	if ((dir = opendir(USBDEV_DIR)) == NULL)
+		return -1;
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, USBDEV_NAME,
+		    sizeof(USBDEV_NAME) - 1) != 0)
+			continue;
+		unit = strtonum(dp->d_name + sizeof(USBDEV_NAME) - 1, 0,
+		    INT_MAX, &errstr);
+		if (errstr)
+			continue;
+		if ((u = reallocarray(units, n + 1, sizeof(*u))) == NULL) {
+			closedir(dir);
+			free(units);
+			return -1;
+		}
+		units = u;
+		units[n++] = unit;
+	}
+	closedir(dir);
+
+	qsort(units, n, sizeof(*units), unit_cmp);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s%d", USBDEV, units[i]);
+		fn(path, arg);
+	}
+	free(units);
+	return 0;
+}
+
+static int
+sys_open(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+static int
+sys_ioctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+#endif /* !USBDEVS_MOCK */
+
+int
+usbdevs_scan(usbdevs_scan_fn fn, void *arg)
+{
+	return usbdevs_backend->scan(fn, arg);
+}
+
+int
+usbdevs_open(const char *path, int flags)
+{
+	return usbdevs_backend->open(path, flags);
+}
+
+int
+usbdevs_close(int fd)
+{
+	return usbdevs_backend->close(fd);
+}
+
+int
+usbdevs_info(int fd, int addr, struct usb_device_info *di)
+{
+	di->udi_addr = addr;
+	return usbdevs_backend->ioctl(fd, USB_DEVICEINFO, di);
+}
+
+int
+usbdevs_ddesc(int fd, int addr, struct usb_device_ddesc *dd)
+{
+	dd->udd_addr = addr;
+	return usbdevs_backend->ioctl(fd, USB_DEVICE_GET_DDESC, dd);
+}
+
+int
+usbdevs_cdesc(int fd, int addr, int index, struct usb_device_cdesc *cd)
+{
+	cd->udc_addr = addr;
+	cd->udc_config_index = index;
+	return usbdevs_backend->ioctl(fd, USB_DEVICE_GET_CDESC, cd);
+}
+
+int
+usbdevs_fdesc(int fd, int addr, int index, void *buf, size_t len)
+{
+	struct usb_device_fdesc dfd;
+
+	if (len < sizeof(usb_config_descriptor_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	dfd.udf_addr = addr;
+	dfd.udf_config_index = index;
+	dfd.udf_data = buf;
+	dfd.udf_size = MINIMUM(len, UINT_MAX);
+	if (usbdevs_backend->ioctl(fd, USB_DEVICE_GET_FDESC, &dfd) == -1)
+		return -1;
+	return UGETW((u_char *)buf + 2);
+}
+
+int
+usbdevs_stats(int fd, struct usb_device_stats *ds)
+{
+	return usbdevs_backend->ioctl(fd, USB_DEVICESTATS, ds);
+}
+
+int
+usbdevs_request(int fd, int addr, usb_device_request_t *req, void *buf,
+    int flags)
+{
+	struct usb_ctl_request ucr;
+
+	memset(&ucr, 0, sizeof(ucr));
+	ucr.ucr_addr = addr;
+	ucr.ucr_request = *req;
+	ucr.ucr_data = buf;
+	ucr.ucr_flags = flags;
+	if (usbdevs_backend->ioctl(fd, USB_REQUEST, &ucr) == -1)
+		return -1;
+	return ucr.ucr_actlen;
+}
+
+int
+usbdevs_status(int fd, int addr, uint16_t *status)
+{
+	usb_device_request_t req;
+	u_char buf[2];
+
+	req.bmRequestType = UT_READ_DEVICE;
+	req.bRequest = UR_GET_STATUS;
+	USETW(req.wValue, 0);
+	USETW(req.wIndex, 0);
+	USETW(req.wLength, sizeof(buf));
+	if (usbdevs_request(fd, addr, &req, buf, 0) == -1)
+		return -1;
+	*status = UGETW(buf);
+	return 0;
+}
+
+/*
+ * Count the devices hanging off a hub: every port reporting a
+ * connection accounts for one device with an address of its own.
+ */
+int
+usbdevs_connected(const struct usb_device_info *di)
+{
+	int port, nports, n = 0;
+
+	nports = MINIMUM(UGETDW(&di->udi_nports), nitems(di->udi_ports));
+	for (port = 0; port < nports; port++)
+		if (UGETDW(&di->udi_ports[port]) & UPS_CURRENT_CONNECT_STATUS)
+			n++;
+	return n;
+}
+
+/*
+ * The walk starts at the root hub and adds the connected ports of each
+ * hub it finds to the number of devices still expected, so probing
+ * stops as soon as the whole tree has answered instead of trying every
+ * address.  A port that is connected but never got an address keeps
+ * the count short, in which case this is the plain sweep.
+ */
+int
+usbdevs_walk(int fd, int flags, usbdevs_walk_fn fn, void *arg)
+{
+	struct usb_device_info di;
+	int addr, expected = 1, found = 0;
+
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (!(flags & USBDEVS_SWEEP) && found >= expected)
+			break;
+		if (usbdevs_info(fd, addr, &di) == -1) {
+			if (errno != ENXIO)
+				fn(fd, addr, NULL, arg);
+			continue;
+		}
+		found++;
+		expected += usbdevs_connected(&di);
+		fn(fd, addr, &di, arg);
+	}
+	return found;
+}
+
+struct snapshot {
+	struct usb_device_info *devs;
+	size_t		 ndevs;
+	size_t		 n;
+};
+
+static void
+snapshot_put(int fd, int addr, struct usb_device_info *di, void *arg)
+{
+	struct snapshot *ss = arg;
+
+	if (di != NULL && ss->n++ < ss->ndevs)
+		ss->devs[ss->n - 1] = *di;
+}
+
+int
+usbdevs_snapshot(int fd, struct usb_device_info *devs, size_t ndevs,
+    int flags)
+{
+	struct snapshot ss = { devs, ndevs, 0 };
+
+	usbdevs_walk(fd, flags, snapshot_put, &ss);
+	return ss.n;
+}
+
+const unsigned char *
+usbdevs_desc_next(const unsigned char *buf, size_t len, size_t *off)
+{
+	const unsigned char *cur;
+
+	if (*off + 2 > len)
+		return NULL;
+	cur = buf + *off;
+	if (cur[0] < 2 || *off + cur[0] > len) {
+		errno = EINVAL;
+		return NULL;
+	}
+	*off += cur[0];
+	return cur;
+}
+
+/*
+ * The descriptor decoder.  A set is walked once, each descriptor named
+ * by the table entry that knows its layout and tagged with the
+ * interface it belongs to, so that whoever renders it need not walk
+ * the set again.  Walking stops at the first descriptor that is
+ * shorter than two bytes or runs past the set.
+ */
+static const char *audio_ac_names[] = {
+	[1] = "header", [2] = "input terminal", [3] = "output terminal",
+	[4] = "mixer unit", [5] = "selector unit", [6] = "feature unit",
+	[7] = "processing unit", [8] = "extension unit",
+	[10] = "clock source", [11] = "clock selector",
+	[12] = "clock multiplier", [13] = "sample rate converter",
+};
+static const char *audio_as_names[] = {
+	[1] = "general", [2] = "format type", [3] = "format specific",
+};
+static const char *audio_midi_names[] = {
+	[1] = "header", [2] = "in jack", [3] = "out jack", [4] = "element",
+};
+static const char *video_vc_names[] = {
+	[1] = "header", [2] = "input terminal", [3] = "output terminal",
+	[4] = "selector unit", [5] = "processing unit",
+	[6] = "extension unit", [7] = "encoding unit",
+};
+static const char *video_vs_names[] = {
+	[1] = "input header", [2] = "output header",
+	[3] = "still image frame", [4] = "format uncompressed",
+	[5] = "frame uncompressed", [6] = "format mjpeg",
+	[7] = "frame mjpeg", [10] = "format mpeg2ts", [12] = "format dv",
+	[13] = "color format", [16] = "format frame based",
+	[17] = "frame frame based", [18] = "format stream based",
+	[19] = "format h264", [20] = "frame h264",
+};
+static const char *cdc_names[] = {
+	[0] = "header", [1] = "call management",
+	[2] = "abstract control management", [3] = "direct line management",
+	[4] = "telephone ringer", [5] = "telephone call",
+	[6] = "union", [7] = "country selection",
+	[8] = "telephone operational modes", [10] = "usb terminal",
+	[11] = "network channel terminal", [12] = "protocol unit",
+	[13] = "extension unit", [14] = "multi-channel management",
+	[15] = "ethernet networking", [18] = "wireless handset control",
+	[19] = "mobile direct line", [20] = "mdlm detail",
+	[21] = "device management", [22] = "obex", [26] = "ncm",
+	[27] = "mbim", [28] = "mbim extended",
+};
+static const char *audio_ep_names[] = {
+	[1] = "general",
+};
+static const char *video_ep_names[] = {
+	[1] = "general", [2] = "endpoint", [3] = "interrupt",
+};
+static const char *devcap_names[] = {
+	[1] = "wireless usb", [2] = "usb 2.0 extension",
+	[3] = "superspeed", [4] = "container id", [5] = "platform",
+	[6] = "power delivery", [7] = "battery info",
+	[10] = "superspeed plus", [11] = "precision time measurement",
+	[12] = "wireless usb ext", [13] = "billboard",
+	[14] = "authentication", [15] = "billboard ex",
+	[16] = "configuration summary",
+};
+
+static const struct desc_kind desc_kinds[] = {
+	{ USBDEVS_DESC_CONFIG, C_DESC, DK_ANY, DK_ANY, DK_ANY, 9, "config",
+	    NULL, 0 },
+	{ USBDEVS_DESC_STRING, S_DESC, DK_ANY, DK_ANY, DK_ANY, 2, "string",
+	    NULL, 0 },
+	{ USBDEVS_DESC_IFACE, I_DESC, DK_ANY, DK_ANY, DK_ANY, 9, "interface",
+	    NULL, 0 },
+	{ USBDEVS_DESC_ENDPT, E_DESC, DK_ANY, DK_ANY, DK_ANY, 7, "endpoint",
+	    NULL, 0 },
+	{ USBDEVS_DESC_IAD, IAD_DESC, DK_ANY, DK_ANY, DK_ANY, 8, "iad",
+	    NULL, 0 },
+	{ USBDEVS_DESC_HID, HID_DESC, UICLASS_HID, DK_ANY, DK_ANY, 6, "hid",
+	    NULL, 0 },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_AUDIO, 1, DK_ANY, 3,
+	    "audio control", audio_ac_names, nitems(audio_ac_names) },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_AUDIO, 2, DK_ANY, 3,
+	    "audio streaming", audio_as_names, nitems(audio_as_names) },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_AUDIO, 3, DK_ANY, 3,
+	    "midi streaming", audio_midi_names, nitems(audio_midi_names) },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_VIDEO, 1, DK_ANY, 3,
+	    "video control", video_vc_names, nitems(video_vc_names) },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_VIDEO, 2, DK_ANY, 3,
+	    "video streaming", video_vs_names, nitems(video_vs_names) },
+	{ USBDEVS_DESC_CDC_HEADER, CS_IFACE_DESC, UICLASS_CDC, DK_ANY, 0, 5,
+	    "cdc", cdc_names, nitems(cdc_names) },
+	{ USBDEVS_DESC_CDC_UNION, CS_IFACE_DESC, UICLASS_CDC, DK_ANY, 6, 5,
+	    "cdc", cdc_names, nitems(cdc_names) },
+	{ USBDEVS_DESC_CLASS, CS_IFACE_DESC, UICLASS_CDC, DK_ANY, DK_ANY, 3,
+	    "cdc", cdc_names, nitems(cdc_names) },
+	{ USBDEVS_DESC_CLASS, CS_ENDPT_DESC, UICLASS_AUDIO, DK_ANY, DK_ANY, 3,
+	    "audio endpoint", audio_ep_names, nitems(audio_ep_names) },
+	{ USBDEVS_DESC_CLASS, CS_ENDPT_DESC, UICLASS_VIDEO, DK_ANY, DK_ANY, 3,
+	    "video endpoint", video_ep_names, nitems(video_ep_names) },
+	{ USBDEVS_DESC_SSCOMP, SSCOMP_DESC, DK_ANY, DK_ANY, DK_ANY, 6,
+	    "ss_companion", NULL, 0 },
+	{ USBDEVS_DESC_BOS, BOS_DESC, DK_ANY, DK_ANY, DK_ANY, 5, "bos",
+	    NULL, 0 },
+	{ USBDEVS_DESC_DEVCAP, DEVCAP_DESC, DK_ANY, DK_ANY, DK_ANY, 3,
+	    "capability", devcap_names, nitems(devcap_names) },
+};
+
+static const struct desc_kind desc_unknown = {
+	USBDEVS_DESC_UNKNOWN, 0, DK_ANY, DK_ANY, DK_ANY, 2, "descriptor",
+	NULL, 0
+};
+
+static const struct desc_kind *
+desc_kind(const unsigned char *cur, const struct usbdevs_desc *ud)
+{
+	const struct desc_kind *dk;
+	size_t i;
+
+	for (i = 0; i < nitems(desc_kinds); i++) {
+		dk = &desc_kinds[i];
+		if (dk->type != cur[1] || cur[0] < dk->minlen)
+			continue;
+		if (dk->ifclass != DK_ANY && dk->ifclass != ud->ifclass)
+			continue;
+		if (dk->ifsubclass != DK_ANY &&
+		    dk->ifsubclass != ud->ifsubclass)
+			continue;
+		if (dk->subtype != DK_ANY && dk->subtype != cur[2])
+			continue;
+		return dk;
+	}
+	return &desc_unknown;
+}
+
+int
+usbdevs_decode(const unsigned char *buf, size_t len,
+    struct usbdevs_desc *descs, size_t ndescs, size_t *end)
+{
+	const struct desc_kind *dk;
+	struct usbdevs_desc ctx, *ud;
+	const unsigned char *cur;
+	size_t off = 0, n = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	while ((cur = usbdevs_desc_next(buf, len, &off)) != NULL) {
+		if (cur[1] == C_DESC && cur[0] >= 9)
+			ctx.config = cur[5];
+		else if (cur[1] == I_DESC && cur[0] >= 9) {
+			ctx.iface = cur[2];
+			ctx.altset = cur[3];
+			ctx.ifclass = cur[5];
+			ctx.ifsubclass = cur[6];
+			ctx.nested = 1;
+		}
+		if (n++ >= ndescs)
+			continue;
+
+		ud = &descs[n - 1];
+		*ud = ctx;
+		dk = desc_kind(cur, &ctx);
+		ud->kind = dk->kind;
+		ud->name = dk->name;
+		if (dk->subnames != NULL && cur[2] < dk->nsubnames &&
+		    dk->subnames[cur[2]] != NULL)
+			ud->subname = dk->subnames[cur[2]];
+		else if (dk->subnames != NULL)
+			ud->subname = "unknown";
+		ud->off = cur - buf;
+		ud->len = cur[0];
+	}
+	if (end != NULL)
+		*end = off;
+	return n;
+}
@@ -0,0 +1,108 @@
+/*
+ * libusbdevs: enumeration of USB controllers and devices through usb(4),
+ * for programs that want what myusbdevs knows without running it.
+ *
+ * Everything works on controller descriptors from usbdevs_open() and
+ * fills buffers the caller provides; nothing is allocated for the caller
+ * and nothing is printed.  Descriptor sets are decoded here as well, so
+ * a caller need not know their layout to walk interfaces and endpoints.
+ * What to fetch for a device, and whether to cache it, is left to the
+ * caller: the library makes one call per ioctl and keeps no state.
+ * Failures return -1 with errno set, ENXIO for an address that holds
+ * no device.  The structures are usb(4)'s own, so <dev/usb/usb.h> must
+ * be included first.  Calls on different descriptors may be made from
+ * different threads.
+ */
+
+#ifndef LIBUSBDEVS_H
+#define LIBUSBDEVS_H
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define USBDEVS_SWEEP	0x01	/* try every address, not just the tree */
+
+/* What usbdevs_decode() makes of a descriptor. */
+#define USBDEVS_DESC_UNKNOWN	0
+#define USBDEVS_DESC_CONFIG	1
+#define USBDEVS_DESC_STRING	2
+#define USBDEVS_DESC_IFACE	3
+#define USBDEVS_DESC_ENDPT	4
+#define USBDEVS_DESC_IAD	5
+#define USBDEVS_DESC_HID	6
+#define USBDEVS_DESC_CLASS	7	/* class-specific, by interface */
+#define USBDEVS_DESC_CDC_HEADER	8
+#define USBDEVS_DESC_CDC_UNION	9
+#define USBDEVS_DESC_SSCOMP	10
+#define USBDEVS_DESC_BOS	11
+#define USBDEVS_DESC_DEVCAP	12
+#define USBDEVS_DESC_NKINDS	13
+
+/*
+ * One descriptor of a set, kept as an offset into it, along with the
+ * interface it belongs to.  The names are static strings; subname is
+ * that of the subtype of a class-specific or capability descriptor,
+ * "unknown" if it has none, and NULL for any other kind.
+ */
+struct usbdevs_desc {
+	int		 kind;		/* USBDEVS_DESC_* */
+	const char	*name;
+	const char	*subname;
+	uint16_t	 off;
+	uint8_t		 len;
+	uint8_t		 config;	/* bConfigurationValue */
+	uint8_t		 iface;		/* of the interface it is in */
+	uint8_t		 altset;
+	uint8_t		 ifclass;
+	uint8_t		 ifsubclass;
+	uint8_t		 nested;	/* inside an interface */
+};
+
+typedef void (*usbdevs_scan_fn)(const char *, void *);
+typedef void (*usbdevs_walk_fn)(int, int, struct usb_device_info *, void *);
+
+__BEGIN_DECLS
+/* Each controller path, in unit order. */
+int	usbdevs_scan(usbdevs_scan_fn, void *);
+int	usbdevs_open(const char *, int);
+int	usbdevs_close(int);
+
+int	usbdevs_info(int, int, struct usb_device_info *);
+int	usbdevs_ddesc(int, int, struct usb_device_ddesc *);
+int	usbdevs_cdesc(int, int, int, struct usb_device_cdesc *);
+/* The config's wTotalLength, which may be more than was room for. */
+int	usbdevs_fdesc(int, int, int, void *, size_t);
+int	usbdevs_stats(int, struct usb_device_stats *);
+/* A control request, O_RDWR only; the length received. */
+int	usbdevs_request(int, int, usb_device_request_t *, void *, int);
+/* GET_STATUS of the device, which changes nothing on it. */
+int	usbdevs_status(int, int, uint16_t *);
+
+/*
+ * Walk the devices from the root hub down, calling fn with each one's
+ * address and USB_DEVICEINFO, or with NULL and errno for an address
+ * that failed otherwise than by being empty.  Returns the number found.
+ */
+int	usbdevs_walk(int, int, usbdevs_walk_fn, void *);
+/* The same into an array; returns the number found, as snprintf. */
+int	usbdevs_snapshot(int, struct usb_device_info *, size_t, int);
+int	usbdevs_connected(const struct usb_device_info *);
+
+/*
+ * Step through a descriptor set: the one at *off, which is moved past
+ * it, or NULL at the end and, with EINVAL, at a bad length.
+ */
+const unsigned char *usbdevs_desc_next(const unsigned char *, size_t,
+	    size_t *);
+/*
+ * Decode a descriptor set, as from usbdevs_fdesc(), into as many of the
+ * array as there is room for; returns the number found, as snprintf.
+ * *end is left where decoding stopped: two or more bytes short of the
+ * end of the set if a descriptor had a bad length.
+ */
+int	usbdevs_decode(const unsigned char *, size_t, struct usbdevs_desc *,
+	    size_t, size_t *);
+__END_DECLS
+
+#endif /* LIBUSBDEVS_H */
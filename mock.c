@@ -0,0 +1,389 @@
+/*
+ * Mock controller backend for the benchmark build.
+ *
+ * USBDEVS_MOCK=controllers:devices[:usec] in the environment describes
+ * the tree: every controller /dev/usbN below the given count holds the
+ * same number of devices, 1 to 127, at addresses 1 and up.  They form
+ * a tree of 8-port hubs filled breadth first, so address a hangs off
+ * hub (a - 2) / 8 + 1, and every device that has no children is one of
+ * a few leaf kinds whose full descriptors exercise the decoder.  The
+ * requests that reach the device itself, for its device, configuration
+ * and full descriptors and a GET_STATUS, the one control request that
+ * is answered, take usec microseconds each, 0 by default.  The
+ * transfer counters move on with every USB_DEVICESTATS as if a
+ * millisecond had passed, the bulk ones twenty times out of every
+ * thousand by forty times as much, for -r to find bursts in.  At
+ * exit the number of controllers opened and ioctls answered go to
+ * stderr, for bench.sh to pick up.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <dev/usb/usb.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "backend.h"
+
+#define MOCK_FD_BASE	512	/* well clear of real descriptors */
+#define MOCK_MAX_CTLRS	64
+#define MOCK_HUB_PORTS	8
+
+#define MINIMUM(a, b) (((a) < (b)) ? (a) : (b))
+
+static const u_char hub_fdesc[] = {
+	9, 2, 25, 0, 1, 1, 0, 0xe0, 0,
+	9, 4, 0, 0, 1, 9, 0, 0, 0,
+	7, 5, 0x81, 3, 2, 0, 12,
+};
+
+static const u_char storage_fdesc[] = {
+	9, 2, 44, 0, 1, 1, 0, 0x80, 250,
+	9, 4, 0, 0, 2, 8, 6, 80, 0,
+	7, 5, 0x81, 2, 0, 4, 0,
+	6, 0x30, 15, 0, 0, 0,
+	7, 5, 0x02, 2, 0, 4, 0,
+	6, 0x30, 15, 0, 0, 0,
+};
+
+static const u_char hid_fdesc[] = {
+	9, 2, 34, 0, 1, 1, 0, 0xa0, 50,
+	9, 4, 0, 0, 1, 3, 1, 1, 0,
+	9, 0x21, 0x11, 1, 0, 1, 0x22, 63, 0,
+	7, 5, 0x81, 3, 8, 0, 10,
+};
+
+static const u_char audio_fdesc[] = {
+	9, 2, 95, 0, 2, 1, 0, 0x80, 50,
+	8, 11, 0, 2, 1, 0, 0, 0,
+	9, 4, 0, 0, 0, 1, 1, 0, 0,
+	9, 0x24, 1, 0, 1, 30, 0, 1, 1,
+	12, 0x24, 2, 1, 1, 1, 0, 2, 3, 0, 0, 0,
+	9, 0x24, 3, 2, 1, 3, 0, 1, 0,
+	9, 4, 1, 0, 0, 1, 2, 0, 0,
+	9, 4, 1, 1, 1, 1, 2, 0, 0,
+	7, 0x24, 1, 1, 1, 1, 0,
+	7, 5, 0x01, 0x09, 0xc0, 0, 1,
+	7, 0x25, 1, 0, 0, 0, 0,
+};
+
+static const u_char serial_fdesc[] = {
+	9, 2, 67, 0, 2, 1, 0, 0x80, 50,
+	9, 4, 0, 0, 1, 2, 2, 1, 0,
+	5, 0x24, 0, 0x10, 1,
+	5, 0x24, 1, 0, 1,
+	4, 0x24, 2, 2,
+	5, 0x24, 6, 0, 1,
+	7, 5, 0x83, 3, 8, 0, 16,
+	9, 4, 1, 0, 2, 10, 0, 0, 0,
+	7, 5, 0x81, 2, 64, 0, 0,
+	7, 5, 0x02, 2, 64, 0, 0,
+};
+
+struct mock_kind {
+	const char	*driver;
+	const char	*product;
+	uint16_t	 vendor;
+	uint16_t	 productNo;
+	uint8_t		 class;
+	uint8_t		 speed;
+	int		 power;
+	const u_char	*fdesc;
+	size_t		 fdlen;
+};
+
+static const struct mock_kind mock_hub = {
+	"uhub", "Mock hub", 0x05e3, 0x0610, UDCLASS_HUB, USB_SPEED_HIGH,
+	100, hub_fdesc, sizeof(hub_fdesc)
+};
+
+static const struct mock_kind mock_leaves[] = {
+	{ "umass", "Mock storage", 0x0781, 0x5581, 0, USB_SPEED_SUPER,
+	    224, storage_fdesc, sizeof(storage_fdesc) },
+	{ "uhidev", "Mock keyboard", 0x046d, 0xc31c, 0, USB_SPEED_LOW,
+	    100, hid_fdesc, sizeof(hid_fdesc) },
+	{ "uaudio", "Mock audio", 0x0d8c, 0x0014, 0, USB_SPEED_FULL,
+	    100, audio_fdesc, sizeof(audio_fdesc) },
+	{ "umodem", "Mock modem", 0x1546, 0x01a7, 2, USB_SPEED_FULL,
+	    100, serial_fdesc, sizeof(serial_fdesc) },
+};
+
+static int mock_nctlrs = -1;
+static int mock_ndevs;
+static int mock_usec;
+static int mock_open_ctlrs[MOCK_MAX_CTLRS];
+static u_long mock_nstats[MOCK_MAX_CTLRS];	/* samples of each bus */
+static int mock_nopened;
+static atomic_ulong mock_nioctls;
+
+static void
+mock_report(void)
+{
+	fprintf(stderr, "mock: controllers %d ioctls %lu\n", mock_nopened,
+	    (unsigned long)atomic_load(&mock_nioctls));
+}
+
+static void
+mock_init(void)
+{
+	const char *tree, *errstr;
+	char buf[32], *devs, *usec;
+
+	if (mock_nctlrs != -1)
+		return;
+	if ((tree = getenv("USBDEVS_MOCK")) == NULL)
+		tree = "1:16";
+	if (strlcpy(buf, tree, sizeof(buf)) >= sizeof(buf) ||
+	    (devs = strchr(buf, ':')) == NULL)
+		errx(1, "USBDEVS_MOCK=%s: want controllers:devices[:usec]",
+		    tree);
+	*devs++ = '\0';
+	if ((usec = strchr(devs, ':')) != NULL) {
+		*usec++ = '\0';
+		mock_usec = strtonum(usec, 0, 999999, &errstr);
+		if (errstr)
+			errx(1, "USBDEVS_MOCK usec %s", errstr);
+	}
+	mock_nctlrs = strtonum(buf, 0, MOCK_MAX_CTLRS, &errstr);
+	if (errstr)
+		errx(1, "USBDEVS_MOCK controllers %s", errstr);
+	mock_ndevs = strtonum(devs, 1, USB_MAX_DEVICES - 1, &errstr);
+	if (errstr)
+		errx(1, "USBDEVS_MOCK devices %s", errstr);
+	atexit(mock_report);
+}
+
+/*
+ * Devices hanging off the hub at addr; 0 for a leaf.
+ */
+static int
+mock_children(int addr)
+{
+	int first = (addr - 1) * MOCK_HUB_PORTS + 2;
+
+	if (first > mock_ndevs)
+		return 0;
+	if (mock_ndevs - first + 1 < MOCK_HUB_PORTS)
+		return mock_ndevs - first + 1;
+	return MOCK_HUB_PORTS;
+}
+
+static const struct mock_kind *
+mock_kind(int addr)
+{
+	if (addr == 1 || mock_children(addr) != 0)
+		return &mock_hub;
+	return &mock_leaves[addr % (sizeof(mock_leaves) /
+	    sizeof(mock_leaves[0]))];
+}
+
+static int
+mock_bus(int fd)
+{
+	int bus = fd - MOCK_FD_BASE;
+
+	if (bus < 0 || bus >= mock_nctlrs || !mock_open_ctlrs[bus])
+		return -1;
+	return bus;
+}
+
+static int
+mock_scan(scan_fn fn, void *arg)
+{
+	char path[32];
+	int bus;
+
+	mock_init();
+	for (bus = 0; bus < mock_nctlrs; bus++) {
+		snprintf(path, sizeof(path), "/dev/usb%d", bus);
+		fn(path, arg);
+	}
+	return 0;
+}
+
+static int
+mock_open(const char *path, int flags)
+{
+	const char *errstr;
+	int bus;
+
+	mock_init();
+	if (strncmp(path, "/dev/usb", 8) != 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	bus = strtonum(path + 8, 0, MOCK_MAX_CTLRS - 1, &errstr);
+	if (errstr || bus >= mock_nctlrs) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (!mock_open_ctlrs[bus]) {
+		mock_open_ctlrs[bus] = 1;
+		mock_nopened++;
+	}
+	return MOCK_FD_BASE + bus;
+}
+
+static int
+mock_close(int fd)
+{
+	if (mock_bus(fd) == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+mock_info(int bus, int addr, struct usb_device_info *di)
+{
+	const struct mock_kind *mk = mock_kind(addr);
+	int port, nchild;
+
+	memset(di, 0, sizeof(*di));
+	di->udi_bus = bus;
+	di->udi_addr = addr;
+	strlcpy(di->udi_vendor, "Mock", sizeof(di->udi_vendor));
+	strlcpy(di->udi_product, addr == 1 ? "Mock root hub" : mk->product,
+	    sizeof(di->udi_product));
+	strlcpy(di->udi_release, "1.00", sizeof(di->udi_release));
+	di->udi_vendorNo = addr == 1 ? 0 : mk->vendor;
+	di->udi_productNo = addr == 1 ? 0 : mk->productNo;
+	di->udi_releaseNo = 0x100;
+	di->udi_class = mk->class;
+	di->udi_config = 1;
+	di->udi_speed = mk->speed;
+	di->udi_power = addr == 1 ? 0 : mk->power;
+	snprintf(di->udi_devnames[0], sizeof(di->udi_devnames[0]), "%s%d",
+	    mk->driver, bus * USB_MAX_DEVICES + addr);
+	snprintf(di->udi_serial, sizeof(di->udi_serial), "MOCK%02d%03d",
+	    bus, addr);
+
+	if (mk == &mock_hub) {
+		nchild = mock_children(addr);
+		di->udi_nports = MOCK_HUB_PORTS;
+		for (port = 0; port < MOCK_HUB_PORTS; port++)
+			di->udi_ports[port] = UPS_PORT_POWER | (port < nchild ?
+			    UPS_CURRENT_CONNECT_STATUS | UPS_PORT_ENABLED : 0);
+	}
+}
+
+static int
+mock_ioctl(int fd, unsigned long req, void *arg)
+{
+	struct usb_device_info *di = arg;
+	struct usb_device_ddesc *dd = arg;
+	struct usb_device_cdesc *cd = arg;
+	struct usb_device_fdesc *fdd = arg;
+	struct usb_device_stats *ds = arg;
+	struct usb_ctl_request *ucr = arg;
+	const struct mock_kind *mk;
+	usb_device_descriptor_t *d;
+	u_long n;
+	int bus, addr, index = 0;
+
+	atomic_fetch_add(&mock_nioctls, 1);
+	if ((bus = mock_bus(fd)) == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (req) {
+	case USB_DEVICEINFO:
+		addr = di->udi_addr;
+		break;
+	case USB_DEVICE_GET_DDESC:
+		addr = dd->udd_addr;
+		break;
+	case USB_DEVICE_GET_CDESC:
+		addr = cd->udc_addr;
+		index = cd->udc_config_index;
+		break;
+	case USB_DEVICE_GET_FDESC:
+		addr = fdd->udf_addr;
+		index = fdd->udf_config_index;
+		break;
+	case USB_REQUEST:
+		addr = ucr->ucr_addr;
+		if (ucr->ucr_request.bRequest != UR_GET_STATUS ||
+		    UGETW(ucr->ucr_request.wLength) < 2) {
+			errno = EIO;
+			return -1;
+		}
+		break;
+	case USB_DEVICESTATS:
+		n = mock_nstats[bus]++;
+		memset(ds, 0, sizeof(*ds));
+		ds->uds_requests[0] = 1000 * (bus + 1) + n;
+		ds->uds_requests[2] = 50000 * (bus + 1) + 50 * n;
+		ds->uds_requests[3] = 20000 * (bus + 1) + 20 * n;
+		/* Every burst so far, whole or begun. */
+		ds->uds_requests[2] += 1950 * (20 * (n / 1000) +
+		    MINIMUM(n % 1000 > 500 ? n % 1000 - 500 : 0, 20));
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+
+	if (addr < 1 || addr > mock_ndevs) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (index != USB_CURRENT_CONFIG_INDEX && index != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	mk = mock_kind(addr);
+
+	if (mock_usec && req != USB_DEVICEINFO) {
+		struct timespec ts = { 0, mock_usec * 1000L };
+
+		nanosleep(&ts, NULL);
+	}
+
+	switch (req) {
+	case USB_DEVICEINFO:
+		mock_info(bus, addr, di);
+		break;
+	case USB_DEVICE_GET_DDESC:
+		d = &dd->udd_desc;
+		memset(d, 0, sizeof(*d));
+		d->bLength = sizeof(*d);
+		d->bDescriptorType = 1;
+		USETW(d->bcdUSB, mk->speed == USB_SPEED_SUPER ? 0x300 : 0x200);
+		d->bDeviceClass = mk->class;
+		d->bMaxPacketSize = mk->speed == USB_SPEED_LOW ? 8 : 64;
+		USETW(d->idVendor, mk->vendor);
+		USETW(d->idProduct, mk->productNo);
+		USETW(d->bcdDevice, 0x100);
+		d->iManufacturer = 1;
+		d->iProduct = 2;
+		d->bNumConfigurations = 1;
+		break;
+	case USB_DEVICE_GET_CDESC:
+		memcpy(&cd->udc_desc, mk->fdesc, sizeof(cd->udc_desc));
+		break;
+	case USB_DEVICE_GET_FDESC:
+		memcpy(fdd->udf_data, mk->fdesc,
+		    fdd->udf_size < mk->fdlen ? fdd->udf_size : mk->fdlen);
+		break;
+	case USB_REQUEST:
+		/* Self powered unless it draws from the bus. */
+		USETW((u_char *)ucr->ucr_data, mk->power ? 0 : 1);
+		ucr->ucr_actlen = 2;
+		break;
+	}
+	return 0;
+}
+
+const struct usb_backend mock_backend = {
+	"mock", mock_scan, mock_open, mock_ioctl, mock_close
+};
@@ -0,0 +1,56 @@
+/*
+ * Capture file written by "myusbdevs -W" and replayed by "-R".
+ *
+ * The file holds the raw answers the kernel gave: a struct usbcap_file,
+ * the table of controllers, the answers themselves and, at the end, an
+ * index of struct usbcap_entry sorted by controller, type, address and
+ * configuration index, so that a reader can mmap the file and look an
+ * answer up in place.  Answers are the kernel's structures as they were,
+ * FDESC blobs cut to wTotalLength; the header records the size of each
+ * structure so that a capture from an incompatible build is refused.
+ * Everything is in host byte order and starts on an 8-byte boundary.
+ */
+
+#ifndef USBCAP_H
+#define USBCAP_H
+
+#include <stdint.h>
+
+#define USBCAP_MAGIC		0x43425355	/* "USBC" */
+#define USBCAP_VERSION		1
+
+#define USBCAP_DEVICEINFO	0	/* struct usb_device_info */
+#define USBCAP_DDESC		1	/* struct usb_device_ddesc */
+#define USBCAP_CDESC		2	/* struct usb_device_cdesc */
+#define USBCAP_FDESC		3	/* the blob udf_data points at */
+#define USBCAP_STATS		4	/* struct usb_device_stats */
+#define USBCAP_NTYPES		5
+
+#define USBCAP_PATHLEN		64
+
+struct usbcap_file {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	size;		/* of this header */
+	uint16_t	sizes[8];	/* of each structure, by type */
+	uint32_t	nctlrs;
+	uint32_t	nentries;
+	uint64_t	ctlrs;		/* offset of the controller table */
+	uint64_t	index;		/* offset of the index */
+};
+
+struct usbcap_ctlr {
+	char		path[USBCAP_PATHLEN];
+};
+
+struct usbcap_entry {
+	uint16_t	type;
+	uint16_t	ctlr;		/* into the controller table */
+	uint8_t		addr;		/* 0 for USBCAP_STATS */
+	uint8_t		pad[3];
+	int32_t		index;		/* configuration index, or 0 */
+	uint32_t	len;
+	uint64_t	off;		/* of the answer, from the start */
+};
+
+#endif /* USBCAP_H */
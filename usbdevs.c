@@ -31,50 +31,775 @@
  */
 
 #include <sys/types.h>
+#include <sys/device.h>
+#include <sys/event.h>
+#include <sys/hotplug.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <dev/usb/usb.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <vis.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "backend.h"
+#include "libusbdevs.h"
+#include "usbcap.h"
+#include "usbrec.h"
+
 #ifndef nitems
 #define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
 #endif
 
 #define MINIMUM(a, b) (((a) < (b)) ? (a) : (b))
+#define MAXIMUM(a, b) (((a) > (b)) ? (a) : (b))
 
 #define USBDEV "/dev/usb"
+#define USBDEV_DIR "/dev"
+#define _PATH_HOTPLUG "/dev/hotplug"
 #define USB_MAX_CONFIGS 255
+#define CONFIG_ALL (-2)		/* -c all, -f all; -1 is the current one */
+
+#define USB_MAX_FDESC 65535
+
+#define NSEC_PER_SEC 1000000000LL
+
+#define OBUF_CHUNK 4096
+#define OBUF_FLUSH (64 * 1024)
 
-#define COMM_INFO 0
-#define COMM_STAT 1
-#define COMM_DDSC 2
-#define COMM_CDSC 3
-#define COMM_FDSC 4
+#define COMM_INFO 0x01
+#define COMM_STAT 0x02
+#define COMM_DDSC 0x04
+#define COMM_CDSC 0x08
+#define COMM_FDSC 0x10
+
+#define OFMT_TEXT 0
+#define OFMT_JSON 1
+#define OFMT_BIN 2
+#define OFMT_TREE 3
 
 #define C_DESC 2
 #define S_DESC 3
 #define I_DESC 4
 #define E_DESC 5
+#define IAD_DESC 0x0b
+#define BOS_DESC 0x0f
+#define DEVCAP_DESC 0x10
+#define HID_DESC 0x21
+#define HID_REPORT_DESC 0x22
+#define CS_IFACE_DESC 0x24
+#define CS_ENDPT_DESC 0x25
+#define SSCOMP_DESC 0x30
+
+#define DEVCAP_USB2EXT 2
+#define DEVCAP_SS 3
+#define DEVCAP_SSPLUS 10
+#define DEVCAP_CONTAINER 4
+
+/*
+ * What makes a hub port dirty for -H -w: status bits that flipped since
+ * the last pass, or change bits the hub still has pending.
+ */
+#define PORT_STATUS (UPS_CURRENT_CONNECT_STATUS | UPS_PORT_ENABLED)
+#define PORT_CHANGES (UPS_C_CONNECT_STATUS | UPS_C_PORT_ENABLED | \
+	    UPS_C_OVERCURRENT_INDICATOR | UPS_C_PORT_LINK_STATE)
+
+#define SNAP_INFO 0x01
+#define SNAP_DDESC 0x02
+#define SNAP_CDESC 0x04
+#define SNAP_FDESC 0x08
+#define SNAP_REVALIDATE 0x10	/* fetch even if the cache has it */
+#define SNAP_DECODED 0x20	/* descs is filled in */
+#define SNAP_SKIP 0x40		/* filtered out, INFO only */
+#define SNAP_TIMEDOUT 0x80	/* -t: ran out of time, may be partial */
+#define SNAP_UNREADABLE 0x100	/* USB_DEVICEINFO failed, not ENXIO */
+
+/*
+ * Everything the kernel told us about one device.  Each dump mode
+ * renders from here, so combining several of them costs one set of
+ * ioctls per device.
+ */
+struct usb_snap_config {
+	int			 index;
+	int			 flags;
+	struct usb_device_cdesc	 cd;
+	u_char			*data;		/* USB_DEVICE_GET_FDESC blob */
+	uint16_t		 len;
+	struct usbdevs_desc	*descs;		/* data, decoded */
+	size_t			 ndescs;
+};
+
+struct usb_snap {
+	uint8_t			 addr;
+	uint8_t			 parent;	/* hub it appeared behind, or 0 */
+	uint8_t			 port;		/* and which port, from 1 */
+	int			 flags;
+	int64_t			 deadline;	/* -t: no ioctl after, or 0 */
+	struct usb_device_info	 di;
+	struct usb_device_ddesc	 ddd;
+	int			 nconfigs;
+	struct usb_snap_config	*configs;
+};
+
+struct cache_ent {
+	uint8_t			 bus;
+	uint8_t			 addr;
+	uint8_t			 config;	/* udi_config when cached */
+	int			 index;
+	uint16_t		 vendorNo;
+	uint16_t		 productNo;
+	uint16_t		 releaseNo;
+	char			 serial[USB_MAX_STRING_LEN];
+	usb_config_descriptor_t	 cd;
+	uint16_t		 len;
+	u_char			*data;		/* NULL if only cd is known */
+};
+
+struct desc_cache {
+	const char		*path;
+	struct cache_ent	*ents;
+	size_t			 nents;
+	int			 dirty;
+	pthread_mutex_t		 mtx;
+};
+
+#define CACHE_MAGIC 0x43434455		/* "UDCC" */
+#define CACHE_VERSION 1
+
+struct cache_file {
+	uint32_t		 magic;
+	uint32_t		 version;
+};
+
+struct cache_rec {
+	int32_t			 index;
+	uint16_t		 vendorNo;
+	uint16_t		 productNo;
+	uint16_t		 releaseNo;
+	uint16_t		 len;
+	uint8_t			 bus;
+	uint8_t			 addr;
+	uint8_t			 config;
+	uint8_t			 cdesc[9];
+	char			 serial[USB_MAX_STRING_LEN];
+	uint8_t			 pad;
+};
+
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t		 used;
+	u_char		 data[ARENA_CHUNK];
+};
+
+struct arena {
+	struct arena_chunk *head;	/* newest, the one being filled */
+	size_t		 used;		/* bytes handed out */
+	size_t		 live;		/* of those, still referenced */
+	size_t		 maxfetch;	/* largest wTotalLength seen */
+};
+
+/*
+ * Device filters (-b, -i, -k, -n); -1 or NULL matches anything.
+ */
+struct filter {
+	int		 bus;
+	int		 vendor;
+	int		 product;
+	int		 class;
+	const char	*driver;
+};
+
+#define TRACE_DEVICEINFO 0
+#define TRACE_DDESC 1
+#define TRACE_CDESC 2
+#define TRACE_FDESC 3
+#define TRACE_STATS 4
+#define TRACE_REQUEST 5
+#define TRACE_OTHER 6
+#define TRACE_NTYPES 7
+
+#define TRACE_SUB 16		/* histogram buckets per power of two */
+#define TRACE_BUCKETS (40 * TRACE_SUB)
+#define TRACE_TOP 10		/* slowest (controller, addr, ioctl) shown */
+
+struct trace_op {
+	uint64_t	 count;
+	uint64_t	 total;		/* ns */
+	uint32_t	 hist[TRACE_BUCKETS];
+};
+
+struct trace_dev {
+	uint32_t	 count;
+	uint64_t	 total;		/* ns */
+	uint64_t	 max;
+};
+
+struct trace {
+	char		 path[PATH_MAX];
+	int		 fd;		/* -1 once closed */
+	pthread_mutex_t	 mtx;		/* for the -j workers */
+	struct trace_op	 ops[TRACE_NTYPES];
+	struct trace_dev dev[USB_MAX_DEVICES][TRACE_NTYPES];
+};
+
+struct trace_slow {
+	struct trace	*tr;
+	int		 addr;
+	int		 type;
+	struct trace_dev *dev;
+};
+
+#define REPLAY_FD_BASE 768	/* -R descriptors, clear of real ones */
+#define CAPTURE_SLOTS 1024	/* -W entry hash to start with, a power of 2 */
+
+struct capture_out {
+	const char	*path;
+	pthread_mutex_t	 mtx;
+	struct usbcap_ctlr *ctlrs;
+	uint32_t	 nctlrs;
+	uint16_t	 fdctlr[1024];	/* controller + 1, by descriptor */
+	struct usbcap_entry *ents;
+	size_t		 nents;
+	size_t		 maxents;
+	size_t		*slots;		/* hash of ents, index + 1 or 0 */
+	size_t		 nslots;
+	u_char		*data;		/* the answers */
+	size_t		 len;
+	size_t		 size;
+	int		 written;	/* nothing more goes in */
+};
+
+struct capture_map {
+	u_char		*map;
+	size_t		 size;
+	const struct usbcap_file *hdr;
+	const struct usbcap_ctlr *ctlrs;
+	const struct usbcap_entry *ents;
+};
+
+#define SERVE_CLIENTS 64
+#define SERVE_BACKLOG 16
+#define SERVE_TIMEOUT 1		/* seconds a client has to read its answer */
+#define SERVE_TIMER 1		/* kevent ident of the -w sampling timer */
+
+/*
+ * One item of -a: addresses lo to hi, on one bus or on all of them.
+ */
+struct addr_range {
+	int	 bus;			/* -1 for any */
+	uint8_t	 lo;
+	uint8_t	 hi;
+};
+
+struct dump_args {
+	int	 command;
+	int	 config;
+	struct addr_range *addrs;	/* -a; every device if none */
+	size_t	 naddrs;
+	int64_t	 interval;		/* -w, in nanoseconds */
+	int	 quiet;			/* -x, -o tree, -M: render nothing yet */
+};
+
+struct obuf {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+	int	 fd;		/* -1 to hold output until flushed */
+};
+
+struct serve_client {
+	int		 fd;		/* -1 if the slot is free */
+	size_t		 len;
+	char		 buf[256];	/* the request line so far */
+	struct obuf	 out;		/* the answer */
+	size_t		 off;		/* of it written so far */
+	int		 writing;	/* waiting on EVFILT_WRITE */
+};
+
+#define DEVNAME_BUCKETS 64	/* per controller, of driver names */
+
+struct devname {
+	struct devname	*next;
+	uint8_t		 addr;
+	char		 name[USB_MAX_DEVNAMELEN];
+};
+
+#define XFER_TYPES 4		/* of uds_requests */
+#define STATS_RING 4096		/* -r samples per controller, 4 s at 1 kHz */
+#define BURST_LEAD 64		/* samples shown from before a burst */
+
+struct stats_sample {
+	int64_t		 ns;
+	struct usb_device_stats ds;
+};
+
+struct stats_ring {
+	struct stats_sample s[STATS_RING];
+	uint64_t	 n;		/* samples taken, the next one's slot */
+	uint64_t	 from[XFER_TYPES];	/* first over, 0 if none */
+	int64_t		 since[XFER_TYPES];	/* the sample before it */
+	double		 peak[XFER_TYPES];
+};
+
+struct controller {
+	char		 path[PATH_MAX];
+	int		 fd;
+	int		 unit;		/* index, for USBREC records */
+	int		 bus;		/* N of /dev/usbN, -1 if not one */
+	struct dump_args *da;
+	struct obuf	 ob;
+	struct usb_snap	*devs[USB_MAX_DEVICES];
+	struct arena	 ar;		/* descriptors the snapshots point at */
+	struct devname	*names[DEVNAME_BUCKETS];	/* of the snapshots */
+	pthread_t	 thread;
+	struct usb_device_stats stats;	/* last -w sample */
+	int64_t		 stats_ns;
+	struct stats_ring *ring;	/* -r */
+	int		 timedout;	/* -t deadline cut the walk short */
+};
+
+struct fetch_pool {
+	struct controller *uc;
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cond;
+	int		 next;		/* next address to hand out */
+	int		 inflight;	/* handed out, USB_DEVICEINFO pending */
+	int		 found;
+	int		 expected;
+	int		 blind;		/* a hub may have gone uncounted */
+	int		 stop;		/* -t deadline reached */
+	int		 running;	/* workers neither done nor abandoned */
+	int		 refs;		/* fetch_controller and abandoned ones */
+	struct fetch_worker *pool;	/* the others, to join */
+	struct usb_snap	*snaps[USB_MAX_DEVICES];
+};
+
+struct fetch_worker {
+	struct fetch_pool *fp;
+	struct fetch_worker *next;
+	pthread_t	 thread;
+	struct arena	 ar;
+	int		 addr;		/* being fetched, or -1 */
+	int64_t		 until;		/* its -t budget, or 0 */
+	int		 abandoned;	/* by the -t watchdog */
+	int		 info;		/* di holds its USB_DEVICEINFO */
+	struct usb_device_info di;
+};
+
+#define TREE_PORTS 16		/* of udi_ports */
+
+struct tree {
+	struct controller *uc;
+	uint8_t		 child[USB_MAX_DEVICES][TREE_PORTS];	/* or 0 */
+	uint8_t		 placed[USB_MAX_DEVICES];
+	int8_t		 keep[USB_MAX_DEVICES];	/* -1 until known */
+};
+
+#define PROBE_TIERS 8		/* the root hub is 1, USB allows 7 */
+
+/*
+ * GET_STATUS latencies of -P, in the histograms of -T.
+ */
+struct probe_stat {
+	struct trace_op	 op;
+	uint64_t	 min;
+	uint64_t	 max;
+	uint32_t	 failed;
+};
+
+/*
+ * Periodic payload a link can carry, in bytes per second: its signalling
+ * rate less line coding, times the share USB 2.0 and 3.x set aside for
+ * periodic transfers.  Protocol overhead is not counted, so what really
+ * fits is somewhat less.
+ */
+#define BW_SUPER 0		/* 5 Gb/s, 90% */
+#define BW_HIGH 1		/* 480 Mb/s, 80% of a microframe */
+#define BW_FULL 2		/* 12 Mb/s, 90% of a frame; a hub's TT */
+#define BW_NLINKS 3
+#define BW_NEAR 80		/* percent of a limit flagged as close */
+
+struct controller_scan {
+	struct controller **ctlp;
+	int		*ncont;
+};
+
+/*
+ * How to show one kind of descriptor, as usbdevs_decode() tells them
+ * apart.
+ */
+struct desc_show {
+	void		(*text)(struct obuf *, const u_char *,
+			    const struct usbdevs_desc *);
+	void		(*json)(struct controller *, struct usb_snap *,
+			    const u_char *, const struct usbdevs_desc *);
+};
+
+const char *xfer_names[] = { "control", "isochronous", "bulk", "interrupt" };
+const char *sync_names[] = { "none", "async", "adaptive", "sync" };
+
+const char *speed_names[] = {
+	[USB_SPEED_LOW] = "low",
+	[USB_SPEED_FULL] = "full",
+	[USB_SPEED_HIGH] = "high",
+	[USB_SPEED_SUPER] = "super",
+};
+
+const char *bw_link_names[] = { "super", "high", "full" };
+const uint64_t bw_limits[] = {
+	500000000ULL * 90 / 100, 60000000ULL * 80 / 100, 1500000ULL * 90 / 100
+};
+
+const char *link_state_names[] = {
+	[UPS_PORT_LS_U0] = "U0",
+	[UPS_PORT_LS_U1] = "U1",
+	[UPS_PORT_LS_U2] = "U2",
+	[UPS_PORT_LS_U3] = "U3",
+	[UPS_PORT_LS_SS_DISABLED] = "SS.disabled",
+	[UPS_PORT_LS_RX_DETECT] = "Rx.detect",
+	[UPS_PORT_LS_SS_INACTIVE] = "ss.inactive",
+	[UPS_PORT_LS_POLLING] = "polling",
+	[UPS_PORT_LS_RECOVERY] = "recovery",
+	[UPS_PORT_LS_HOT_RESET] = "hot.reset",
+	[UPS_PORT_LS_COMP_MOD] = "comp.mod",
+	[UPS_PORT_LS_LOOPBACK] = "loopback",
+};
+
+int trace_scan(scan_fn, void *);
+int trace_open(const char *, int);
+int trace_ioctl(int, unsigned long, void *);
+int trace_close(int);
+
+const struct usb_backend trace_backend = {
+	"trace", trace_scan, trace_open, trace_ioctl, trace_close
+};
+const struct usb_backend *traced;	/* what trace_backend times */
+struct trace **traces;
+size_t ntraces;
+
+const char *trace_names[] = {
+	[TRACE_DEVICEINFO] = "DEVICEINFO",
+	[TRACE_DDESC] = "GET_DDESC",
+	[TRACE_CDESC] = "GET_CDESC",
+	[TRACE_FDESC] = "GET_FDESC",
+	[TRACE_STATS] = "DEVICESTATS",
+	[TRACE_REQUEST] = "REQUEST",
+	[TRACE_OTHER] = "other",
+};
+
+int record_scan(scan_fn, void *);
+int record_open(const char *, int);
+int record_ioctl(int, unsigned long, void *);
+int record_close(int);
+int replay_scan(scan_fn, void *);
+int replay_open(const char *, int);
+int replay_ioctl(int, unsigned long, void *);
+int replay_close(int);
+
+const struct usb_backend record_backend = {
+	"record", record_scan, record_open, record_ioctl, record_close
+};
+const struct usb_backend replay_backend = {
+	"replay", replay_scan, replay_open, replay_ioctl, replay_close
+};
+const struct usb_backend *recorded;	/* what record_backend saves */
+struct capture_out *capout;
+struct capture_map *capin;
+struct capture_map *capbase;		/* -x */
+
+int oformat = OFMT_TEXT;
+struct desc_cache *cache = NULL;
+__thread struct fetch_worker *fetch_self;	/* in a -j worker, itself */
+struct filter filter = { -1, -1, -1, -1, NULL };
+int filtering = 0;
 
 int verbose = 0;
-char done[USB_MAX_DEVICES];
+int sweep = 0;
+int parallel = 0;
+int workers = 1;		/* -j, per controller */
+int64_t deadline = 0;		/* -t, CLOCK_MONOTONIC ns, or 0 */
+int64_t budget = 0;		/* -t, ns per device */
+int hotplug = 0;
+int serving = 0;
+int bandwidth = 0;		/* -B */
+int audit = 0;			/* -S */
+int bursts = 0;			/* -r */
+long long burst_rates[XFER_TYPES];	/* -r, per second, 0 if none */
+int openmode = O_RDONLY;	/* O_RDWR for USB_REQUEST */
+int probes = 0;			/* -P, GET_STATUS per device */
+int64_t probe_gap = 0;		/* -P, ns between two on a bus */
+const char *metrics = NULL;	/* -M textfile */
+const char *lookup = NULL;	/* -D driver */
+int trouble = 1;		/* exit status on error, 2 under -x */
+int unread = 0;			/* -x: what could not be read */
+int unlisted = 0;		/* -x: the controllers could not be found */
+char **unopened = NULL;		/* -x: controllers that failed to open */
+size_t nunopened = 0;
 
 void usage(void);
-void dump_device(int, uint8_t);
-void dump_config(char *, int, uint8_t, int);
-void dump_controller(char *, int, uint8_t);
-void full_dump(char *, int, uint8_t, int);
-uint16_t print_config(int, uint8_t, int, bool);
-void print_device(int, uint8_t);
-void dump_device_desc(char *, int, uint8_t);
+void ob_reserve(struct obuf *, size_t);
+void ob_write(struct obuf *, const void *, size_t);
+void ob_str(struct obuf *, const char *);
+void ob_strn(struct obuf *, const char *, size_t);
+void ob_char(struct obuf *, char);
+void ob_dec(struct obuf *, unsigned long long, int);
+void ob_hex(struct obuf *, unsigned long long, int);
+void ob_printf(struct obuf *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+void ob_flush(struct obuf *);
+void ob_check(struct obuf *);
+const char *speed_name(int);
+const char *link_state_name(int);
+int get_device_info(int, uint8_t, struct usb_device_info *);
+void dump_device(struct obuf *, struct usb_device_info *);
+struct usb_snap_config *snap_config(struct usb_snap *, int);
+struct usb_snap_config *snap_find(struct usb_snap *, int);
+struct arena_chunk *arena_grow(struct arena *);
+u_char *arena_room(struct arena *, size_t, size_t *);
+void arena_commit(struct arena *, size_t);
+u_char *arena_alloc(struct arena *, size_t);
+void arena_release(struct arena *, size_t);
+void arena_free(struct arena *);
+void arena_merge(struct arena *, struct arena *);
+int snap_fdesc(int, struct arena *, struct usb_snap *,
+    struct usb_snap_config *);
+int cache_match(struct cache_ent *, struct usb_device_info *, int);
+int cache_get(struct arena *, struct usb_snap *, struct usb_snap_config *,
+    int);
+void cache_put(struct usb_snap *, struct usb_snap_config *);
+void cache_load(const char *);
+void cache_save(void);
+void cache_write(void);
+void snap_fill(int, struct arena *, struct usb_snap *, int, int);
+void snap_fill_config(int, struct arena *, struct usb_snap *, int, int);
+void snap_free(struct arena *, struct usb_snap *);
+int snap_late(struct usb_snap *);
+int snap_info(int, struct usb_snap *);
+void json_string(struct obuf *, const char *, size_t);
+void json_key(struct obuf *, const char *);
+void json_uint(struct obuf *, const char *, unsigned long long);
+void json_bool(struct obuf *, const char *, int);
+void json_str(struct obuf *, const char *, const char *, size_t);
+void json_begin(struct controller *, const char *, uint8_t);
+void json_end(struct controller *);
+void json_device(struct controller *, struct usb_device_info *);
+void json_ddesc(struct controller *, struct usb_snap *);
+void json_config(struct controller *, struct usb_snap *,
+    usb_config_descriptor_t *);
+void json_desc_begin(struct controller *, struct usb_snap *,
+    const struct usbdevs_desc *, const char *);
+void json_bytes(struct obuf *, const char *, const u_char *, size_t);
+void json_bcd(struct obuf *, const char *, uint16_t);
+void json_fconfig(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_string_desc(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_iface(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_endpt(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_iad(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_hid(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_class(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_sscomp(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_bos(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_devcap(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_unknown(struct controller *, struct usb_snap *, const u_char *,
+    const struct usbdevs_desc *);
+void json_full(struct controller *, struct usb_snap *,
+    struct usb_snap_config *);
+void json_stats(struct controller *, struct usb_device_stats *,
+    struct usb_device_stats *, double);
+void bin_hdr(struct controller *, void *, size_t, int, uint8_t);
+void bin_file(struct obuf *);
+void bin_device(struct controller *, struct usb_device_info *);
+void bin_full(struct controller *, struct usb_snap *,
+    struct usb_snap_config *);
+void bin_stats(struct controller *, struct usb_device_stats *, int64_t);
+void render_controller(struct controller *);
+void render_event(struct controller *, int, struct usb_snap *);
+void render_info(struct controller *, struct usb_device_info *);
+void render_timeout(struct controller *, uint8_t);
+void render_change(struct controller *, uint8_t, const char *, const char *,
+    const char *);
+void snap_render(struct controller *, struct usb_snap *);
+void snap_render_config(struct controller *, struct usb_snap *,
+    struct usb_snap_config *);
+struct usb_snap *snap_new(uint8_t);
+void snap_store(struct controller *, struct usb_snap *);
+void snap_drop(struct controller *, uint8_t);
+void snap_reinfo(struct controller *, struct usb_snap *,
+    struct usb_device_info *);
+u_int devname_hash(const char *);
+void devname_add(struct controller *, struct usb_snap *);
+void devname_del(struct controller *, struct usb_snap *);
+void snap_compact(struct controller *);
+void walk_snap(int, int, struct usb_device_info *, void *);
+void print_device(struct obuf *, struct usb_snap *);
+void print_config(struct obuf *, struct usb_snap *, struct usb_snap_config *);
+void desc_string(const u_char *, char *, size_t);
+void snap_decode(struct usb_snap *, struct usb_snap_config *);
+void print_fconfig(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_iface(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_endpt(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_string(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_iad(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_hid(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_class(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_sscomp(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_bos(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_devcap(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_unknown(struct obuf *, const u_char *, const struct usbdevs_desc *);
+void print_bcd(struct obuf *, uint16_t);
+void print_bytes(struct obuf *, const u_char *);
+void print_full(struct obuf *, struct usb_snap *, struct usb_snap_config *);
+int get_stats(char *, int, struct usb_device_stats *);
+void print_stats(struct controller *);
+void render_stats(struct controller *, struct usb_device_stats *, int64_t);
+int64_t mono_ns(void);
+struct trace *trace_find(int);
+int trace_bucket(uint64_t);
+uint64_t trace_bucket_ns(int);
+uint64_t trace_percentile(struct trace_op *, int);
+int trace_slow_cmp(const void *, const void *);
+void trace_report(void);
+int capture_key(unsigned long, void *, int, struct usbcap_entry *,
+    const void **);
+int capture_cmp(const void *, const void *);
+int capture_ctlr(const char *);
+size_t capture_slot(const struct usbcap_entry *);
+void capture_rehash(void);
+void capture_put(int, struct usbcap_entry *, const void *);
+struct capture_map *capture_map(const char *);
+int capture_path(struct capture_map *, const char *);
+const void *capture_find(struct capture_map *, int, int, int, int, size_t *);
+void capture_unmap(struct capture_map *);
+void capture_start(const char *);
+void capture_write(void);
+int parse_config(const char *);
+int parse_addrs(const char *, struct dump_args *);
+int addr_selected(struct dump_args *, int, int);
+int controller_bus(const char *);
+int parse_id(const char *, const char *);
+void parse_ids(const char *);
+int filter_driver(struct usb_device_info *, const char *);
+int filter_match(struct usb_device_info *);
+int64_t parse_interval(const char *);
+void parse_deadline(const char *);
+void parse_probe(const char *);
+void parse_bursts(const char *);
+void watch_sample(struct controller *);
+void watch_stats(struct controller *, int);
+double ring_rate(struct stats_ring *, uint64_t, size_t);
+uint64_t ring_oldest(struct stats_ring *);
+int rate_cmp(const void *, const void *);
+void burst_sample(struct controller *);
+void burst_dump(struct controller *);
+void burst_begin(struct controller *, size_t, double);
+void burst_render(struct controller *, size_t, uint64_t, int);
+void window_render(struct controller *, uint64_t, uint64_t);
+int fetch_next(struct fetch_worker *);
+int fetch_done(struct fetch_worker *, struct usb_device_info *);
+int fetch_put(struct fetch_worker *, struct usb_snap *, struct arena *);
+void *fetch_worker(void *);
+void fetch_spawn(struct fetch_pool *);
+void fetch_abandon(struct fetch_pool *, struct fetch_worker *);
+void fetch_watch(struct fetch_pool *);
+void fetch_exit(struct fetch_worker *);
+int fetch_gone(void);
+void fetch_release(struct fetch_pool *);
+void fetch_controller(struct controller *);
+void dump_controller(struct controller *);
+void *dump_worker(void *);
+void dump_controllers(struct controller *, int);
+void render_tree(struct controller *);
+int tree_has(struct controller *, int);
+void tree_link(struct tree *, int);
+int tree_keep(struct tree *, int);
+void tree_render(struct tree *, int, char *, size_t, int);
+void tree_node(struct obuf *, struct usb_snap *);
+void render_bandwidth(struct controller *);
+uint64_t bw_endpt(int, const u_char *, const u_char *);
+uint64_t bw_device(struct usb_snap *);
+void bw_sum(struct tree *, const uint64_t *, int, uint64_t *);
+int bw_links(int);
+void bw_render(struct controller *, struct usb_snap *, int, uint64_t,
+    uint64_t);
+void render_audit(struct controller *);
+int audit_request(struct controller *, int, int, u_char *, size_t);
+int audit_capable(struct controller *, struct usb_snap *, const char **);
+void audit_render(struct controller *, struct usb_snap *, int,
+    const char *, struct usb_snap *, int);
+void render_probe(struct controller *);
+void probe_add(struct probe_stat *, int64_t);
+void probe_render(struct controller *, int, int, int, struct probe_stat *);
+int diff_controllers(struct dump_args *, struct controller *, int);
+int diff_controller(struct controller *, int);
+int diff_same(struct usb_device_info *, struct usb_device_info *);
+int diff_device(struct controller *, int, struct usb_snap *,
+    struct usb_device_info *);
+int diff_str(struct controller *, uint8_t, const char *, const char *,
+    const char *, size_t);
+int diff_num(struct controller *, uint8_t, const char *, unsigned int,
+    unsigned int);
+void diff_append(char *, size_t, const char *, size_t);
+void diff_config(char *, size_t, const char *, int);
+void port_words(struct usb_device_info *, uint16_t, char *, size_t);
+struct usb_snap *find_devname(struct controller *, int, const char *,
+    struct controller **);
+int dump_driver(struct dump_args *, struct controller *, int);
+int hotplug_probe(struct controller *, uint8_t);
+void hotplug_gone(struct controller *, uint8_t);
+void hotplug_rescan(struct controller *);
+int snap_same(struct usb_snap *, struct usb_device_info *);
+void refresh_controller(struct controller *);
+void watch_refresh(struct dump_args *, struct controller *, int);
+struct controller *controller_open(struct controller **, int *, const char *);
+int controller_fd(const char *);
+void controller_unopened(const char *);
+int controller_unread(const char *);
+void controller_found(const char *, void *);
+void controller_close(struct controller *);
+void hotplug_attach(struct dump_args *, struct controller **, int *,
+    const char *);
+void hotplug_detach(struct controller *, int, const char *);
+void watch_hotplug(struct dump_args *, struct controller **, int *);
+int serve_listen(const char *);
+int serve_request(char *, struct dump_args *, int *, int *, const char **);
+int serve_send(struct serve_client *);
+void serve_answer(struct obuf *, char *, struct controller *, int);
+void serve_sample(struct controller *, int);
+void serve_discard(struct controller *, int);
+void serve_refresh(struct controller *, int);
+void serve_drop(int, struct serve_client *, int);
+void serve(const char *, struct dump_args *, struct controller **, int *);
+void metrics_label(struct obuf *, const char *);
+void metrics_write(const char *, struct controller *, int);
+void watch_metrics(struct dump_args *, struct controller *, int);
 int main(int, char **);
 
 extern char *__progname;
@@ -82,442 +807,6393 @@ extern char *__progname;
 void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-v] [-a addr] [-d usbdev]\n", __progname);
-	exit(1);
+	fprintf(stderr, "usage: %s [-ABHpSTv] [-a addrs] [-b bus] "
+	    "[-C cachefile]\n\t[-c [config|all]] [-D driver] [-d usbdev] "
+	    "[-e] [-f [config|all]]\n\t[-i vendor[:product]] [-j workers] "
+	    "[-k class] [-L socket]\n\t[-M textfile] [-n driver] [-o format] "
+	    "[-P count[:gap]] [-R capture]\n\t[-r type:rate[,...]] [-s] "
+	    "[-t deadline[:budget]] [-w wait]\n\t[-W capture] [-x baseline]\n",
+	    __progname);
+	exit(trouble);
 }
 
-void
-dump_device(int fd, uint8_t addr)
+/*
+ * Tracing backend (-T).  It sits in front of the real backend, times
+ * every ioctl and files the time by controller, ioctl and address.
+ * Latencies go into log-linear histograms, sixteen buckets to each
+ * power of two, so p50 and p99 are known to within about 6% while
+ * memory stays fixed however long the tool runs.  Every controller has
+ * its own trace, shared only by its -j workers; traces are only added
+ * by open, before any worker starts.
+ */
+int
+trace_scan(scan_fn fn, void *arg)
 {
-	struct usb_device_info di;
-	int i;
-	char vv[sizeof(di.udi_vendor)*4], vp[sizeof(di.udi_product)*4];
-	char vr[sizeof(di.udi_release)*4], vs[sizeof(di.udi_serial)*4];
+	return traced->scan(fn, arg);
+}
 
-	di.udi_addr = addr;
-	if (ioctl(fd, USB_DEVICEINFO, &di) == -1) {
-		if (errno != ENXIO)
-			warn("addr %u", addr);
-		return;
+int
+trace_open(const char *path, int flags)
+{
+	struct trace *tr, **trs;
+	int fd;
+
+	if ((fd = traced->open(path, flags)) == -1)
+		return fd;
+	if ((tr = calloc(1, sizeof(*tr))) == NULL ||
+	    (trs = reallocarray(traces, ntraces + 1, sizeof(*trs))) == NULL)
+		err(trouble, NULL);
+	traces = trs;
+	strlcpy(tr->path, path, sizeof(tr->path));
+	tr->fd = fd;
+	pthread_mutex_init(&tr->mtx, NULL);
+	traces[ntraces++] = tr;
+	return fd;
+}
+
+int
+trace_close(int fd)
+{
+	struct trace *tr;
+
+	if ((tr = trace_find(fd)) != NULL) {
+		pthread_mutex_lock(&tr->mtx);
+		tr->fd = -1;
+		pthread_mutex_unlock(&tr->mtx);
+	}
+	return traced->close(fd);
+}
+
+/*
+ * The descriptor is read under the mutex, as a worker abandoned under
+ * -t may still be tracing when its controller is closed.
+ */
+struct trace *
+trace_find(int fd)
+{
+	size_t i;
+	int match;
+
+	for (i = ntraces; i-- > 0; ) {
+		pthread_mutex_lock(&traces[i]->mtx);
+		match = traces[i]->fd == fd;
+		pthread_mutex_unlock(&traces[i]->mtx);
+		if (match)
+			return traces[i];
 	}
+	return NULL;
+}
 
-	done[addr] = 1;
+int
+trace_bucket(uint64_t ns)
+{
+	int e;
 
-	strvis(vv, di.udi_vendor, VIS_CSTYLE);
-	strvis(vp, di.udi_product, VIS_CSTYLE);
-	printf("addr %02u: %04x:%04x %s, %s, usb_bus: %hhu",
-	    addr, UGETW(&di.udi_vendorNo), UGETW(&di.udi_productNo),
-	    vv, vp, di.udi_bus);
+	if (ns < TRACE_SUB)
+		return ns;
+	for (e = 4; e < 63 && ns >> (e + 1) != 0; e++)
+		;
+	return MINIMUM((e - 3) * TRACE_SUB + ((ns >> (e - 4)) & 0xf),
+	    TRACE_BUCKETS - 1);
+}
 
-	if (verbose) {
-		printf("\n\t ");
-		switch (di.udi_speed) {
-		case USB_SPEED_LOW:
-			printf("low speed");
-			break;
-		case USB_SPEED_FULL:
-			printf("full speed");
-			break;
-		case USB_SPEED_HIGH:
-			printf("high speed");
-			break;
-		case USB_SPEED_SUPER:
-			printf("super speed");
-			break;
-		default:
-			break;
+uint64_t
+trace_bucket_ns(int bucket)
+{
+	if (bucket < TRACE_SUB)
+		return bucket;
+	return (uint64_t)(TRACE_SUB + bucket % TRACE_SUB) <<
+	    (bucket / TRACE_SUB - 1);
+}
+
+int
+trace_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct trace *tr;
+	struct trace_op *op;
+	int64_t start, ns;
+	int rv, type, addr = 0, saved;
+
+	switch (request) {
+	case USB_DEVICEINFO:
+		type = TRACE_DEVICEINFO;
+		addr = ((struct usb_device_info *)arg)->udi_addr;
+		break;
+	case USB_DEVICE_GET_DDESC:
+		type = TRACE_DDESC;
+		addr = ((struct usb_device_ddesc *)arg)->udd_addr;
+		break;
+	case USB_DEVICE_GET_CDESC:
+		type = TRACE_CDESC;
+		addr = ((struct usb_device_cdesc *)arg)->udc_addr;
+		break;
+	case USB_DEVICE_GET_FDESC:
+		type = TRACE_FDESC;
+		addr = ((struct usb_device_fdesc *)arg)->udf_addr;
+		break;
+	case USB_DEVICESTATS:
+		type = TRACE_STATS;
+		break;
+	case USB_REQUEST:
+		type = TRACE_REQUEST;
+		addr = ((struct usb_ctl_request *)arg)->ucr_addr;
+		break;
+	default:
+		type = TRACE_OTHER;
+		break;
+	}
+
+	start = mono_ns();
+	rv = traced->ioctl(fd, request, arg);
+	saved = errno;
+	ns = mono_ns() - start;
+
+	if ((tr = trace_find(fd)) != NULL) {
+		pthread_mutex_lock(&tr->mtx);
+		op = &tr->ops[type];
+		op->count++;
+		op->total += ns;
+		op->hist[trace_bucket(ns)]++;
+		if (addr >= 0 && addr < USB_MAX_DEVICES) {
+			tr->dev[addr][type].count++;
+			tr->dev[addr][type].total += ns;
+			if (ns > tr->dev[addr][type].max)
+				tr->dev[addr][type].max = ns;
 		}
+		pthread_mutex_unlock(&tr->mtx);
+	}
+	errno = saved;
+	return rv;
+}
 
-		if (di.udi_power)
-			printf(", power %d mA", UGETDW(&di.udi_power));
-		else
-			printf(", self powered");
+uint64_t
+trace_percentile(struct trace_op *op, int pct)
+{
+	uint64_t want, seen = 0;
+	int i;
 
-		if (di.udi_config)
-			printf(", config %d", di.udi_config);
-		else
-			printf(", unconfigured");
+	want = (op->count * pct + 99) / 100;
+	for (i = 0; i < TRACE_BUCKETS; i++) {
+		seen += op->hist[i];
+		if (seen >= want)
+			return trace_bucket_ns(i);
+	}
+	return 0;
+}
+
+int
+trace_slow_cmp(const void *a, const void *b)
+{
+	const struct trace_slow *sa = a, *sb = b;
 
-		strvis(vr, di.udi_release, VIS_CSTYLE);
-		printf(", rev %s (0x%hx)", vr, UGETW(&di.udi_releaseNo));
+	if (sa->dev->max != sb->dev->max)
+		return sa->dev->max < sb->dev->max ? 1 : -1;
+	return 0;
+}
 
-		printf("\n\t class: %hhu, subclass: %hhu, protocol: %hhu",
-		    di.udi_class, di.udi_subclass, di.udi_protocol);
+/*
+ * Print the summary on stderr, out of the way of any -o format.
+ */
+void
+trace_report(void)
+{
+	struct trace_slow *slow = NULL, *ts;
+	struct trace_op *op;
+	struct trace *tr;
+	size_t i, nslow = 0;
+	int type, addr;
 
-		if (di.udi_serial[0] != '\0') {
-			strvis(vs, di.udi_serial, VIS_CSTYLE);
-			printf(", iSerial %s", vs);
+	/*
+	 * Workers abandoned under -t may still be counting; the figures
+	 * are held still until all of them are out.
+	 */
+	for (i = 0; i < ntraces; i++)
+		pthread_mutex_lock(&traces[i]->mtx);
+	for (i = 0; i < ntraces; i++) {
+		tr = traces[i];
+		fprintf(stderr, "trace %s:\n", tr->path);
+		fprintf(stderr, "\t%-12s %8s %12s %10s %10s\n", "ioctl",
+		    "count", "total_ms", "p50_us", "p99_us");
+		for (type = 0; type < TRACE_NTYPES; type++) {
+			op = &tr->ops[type];
+			if (op->count == 0)
+				continue;
+			fprintf(stderr, "\t%-12s %8llu %12.3f %10.1f %10.1f\n",
+			    trace_names[type], (unsigned long long)op->count,
+			    op->total / 1e6, trace_percentile(op, 50) / 1e3,
+			    trace_percentile(op, 99) / 1e3);
 		}
+
+		for (addr = 0; addr < USB_MAX_DEVICES; addr++)
+			for (type = 0; type < TRACE_NTYPES; type++) {
+				if (tr->dev[addr][type].count == 0)
+					continue;
+				slow = reallocarray(slow, nslow + 1,
+				    sizeof(*slow));
+				if (slow == NULL)
+					err(trouble, NULL);
+				ts = &slow[nslow++];
+				ts->tr = tr;
+				ts->addr = addr;
+				ts->type = type;
+				ts->dev = &tr->dev[addr][type];
+			}
 	}
-	printf("\n");
+	if (nslow == 0)
+		goto done;
 
-	if (verbose)
-		for (i = 0; i < USB_MAX_DEVNAMES; i++)
-			if (di.udi_devnames[i][0] != '\0')
-				printf("\t driver: %s\n", di.udi_devnames[i]);
+	qsort(slow, nslow, sizeof(*slow), trace_slow_cmp);
+	fprintf(stderr, "slowest:\n");
+	for (i = 0; i < nslow && i < TRACE_TOP; i++) {
+		ts = &slow[i];
+		fprintf(stderr, "\t%s addr %02d %-10s max %.3f ms, "
+		    "%llu calls, %.3f ms total\n", ts->tr->path, ts->addr,
+		    trace_names[ts->type], ts->dev->max / 1e6,
+		    (unsigned long long)ts->dev->count,
+		    ts->dev->total / 1e6);
+	}
+	free(slow);
+ done:
+	for (i = 0; i < ntraces; i++)
+		pthread_mutex_unlock(&traces[i]->mtx);
+}
 
-	if (verbose > 1) {
-		int port, nports;
+/*
+ * Capture files (-W, -R).  Recording sits in front of the real backend
+ * and keeps a copy of every answer that succeeded; the file is written
+ * at exit, merged over what an existing capture already held.  Replay
+ * maps a capture and answers from its index without opening a device.
+ * See usbcap.h for the layout.
+ */
+int
+capture_key(unsigned long request, void *arg, int answered,
+    struct usbcap_entry *ce, const void **data)
+{
+	memset(ce, 0, sizeof(*ce));
+	*data = arg;
+	switch (request) {
+	case USB_DEVICEINFO:
+		ce->type = USBCAP_DEVICEINFO;
+		ce->addr = ((struct usb_device_info *)arg)->udi_addr;
+		ce->len = sizeof(struct usb_device_info);
+		break;
+	case USB_DEVICE_GET_DDESC:
+		ce->type = USBCAP_DDESC;
+		ce->addr = ((struct usb_device_ddesc *)arg)->udd_addr;
+		ce->len = sizeof(struct usb_device_ddesc);
+		break;
+	case USB_DEVICE_GET_CDESC:
+		ce->type = USBCAP_CDESC;
+		ce->addr = ((struct usb_device_cdesc *)arg)->udc_addr;
+		ce->index = ((struct usb_device_cdesc *)arg)->udc_config_index;
+		ce->len = sizeof(struct usb_device_cdesc);
+		break;
+	case USB_DEVICE_GET_FDESC: {
+		struct usb_device_fdesc *dfd = arg;
 
-		nports = MINIMUM(UGETDW(&di.udi_nports), nitems(di.udi_ports));
-		for (port = 0; port < nports; port++) {
-			uint16_t status, change;
+		ce->type = USBCAP_FDESC;
+		ce->addr = dfd->udf_addr;
+		ce->index = dfd->udf_config_index;
+		*data = dfd->udf_data;
+		ce->len = dfd->udf_size;
+		if (answered && ce->len >= 4 &&
+		    UGETW(dfd->udf_data + 2) < ce->len)
+			ce->len = UGETW(dfd->udf_data + 2);
+		break;
+	}
+	case USB_DEVICESTATS:
+		ce->type = USBCAP_STATS;
+		ce->len = sizeof(struct usb_device_stats);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
 
-			status = UGETDW(&di.udi_ports[port]) & 0xffff;
-			change = UGETDW(&di.udi_ports[port]) >> 16;
+int
+capture_cmp(const void *a, const void *b)
+{
+	const struct usbcap_entry *ea = a, *eb = b;
 
-			printf("\t port %02u: %04x.%04x", port+1, change,
-			    status);
+	if (ea->ctlr != eb->ctlr)
+		return ea->ctlr < eb->ctlr ? -1 : 1;
+	if (ea->type != eb->type)
+		return ea->type < eb->type ? -1 : 1;
+	if (ea->addr != eb->addr)
+		return ea->addr < eb->addr ? -1 : 1;
+	if (ea->index != eb->index)
+		return ea->index < eb->index ? -1 : 1;
+	return 0;
+}
 
-			if (status & UPS_CURRENT_CONNECT_STATUS)
-				printf(" connect");
+/*
+ * Controller table index for path, added if new.
+ */
+int
+capture_ctlr(const char *path)
+{
+	struct usbcap_ctlr *uc;
+	uint32_t i;
 
-			if (status & UPS_PORT_ENABLED)
-				printf(" enabled");
+	for (i = 0; i < capout->nctlrs; i++)
+		if (strcmp(capout->ctlrs[i].path, path) == 0)
+			return i;
+	if ((uc = reallocarray(capout->ctlrs, capout->nctlrs + 1,
+	    sizeof(*uc))) == NULL)
+		err(trouble, NULL);
+	capout->ctlrs = uc;
+	uc = &capout->ctlrs[capout->nctlrs];
+	if (strlcpy(uc->path, path, sizeof(uc->path)) >= sizeof(uc->path)) {
+		warnc(ENAMETOOLONG, "%s not recorded", path);
+		return -1;
+	}
+	return capout->nctlrs++;
+}
 
-			if (status & UPS_SUSPEND)
-				printf(" supsend");
+/*
+ * The entries are hashed by question, so that a long -w recording,
+ * which asks the same few again and again, finds each in constant
+ * time: the slot key is in, or the empty one it would go to.
+ */
+size_t
+capture_slot(const struct usbcap_entry *key)
+{
+	uint64_t h;
+	size_t i, mask = capout->nslots - 1;
 
-			if (status & UPS_OVERCURRENT_INDICATOR)
-				printf(" overcurrent");
+	h = (uint64_t)key->ctlr << 48 | (uint64_t)key->type << 40 |
+	    (uint64_t)key->addr << 32 | (uint32_t)key->index;
+	h *= 0x9e3779b97f4a7c15ULL;
+	for (i = (h >> 32) & mask; capout->slots[i] != 0 &&
+	    capture_cmp(&capout->ents[capout->slots[i] - 1], key) != 0;
+	    i = (i + 1) & mask)
+		;
+	return i;
+}
 
-			if (di.udi_speed < USB_SPEED_SUPER) {
-				if (status & UPS_PORT_L1)
-					printf(" l1");
+void
+capture_rehash(void)
+{
+	size_t i;
 
-				if (status & UPS_PORT_POWER)
-					printf(" power");
-			} else {
-				if (status & UPS_PORT_POWER_SS)
-					printf(" power");
+	free(capout->slots);
+	capout->nslots = capout->nslots ? capout->nslots * 2 : CAPTURE_SLOTS;
+	if ((capout->slots = calloc(capout->nslots,
+	    sizeof(*capout->slots))) == NULL)
+		err(trouble, NULL);
+	for (i = 0; i < capout->nents; i++)
+		capout->slots[capture_slot(&capout->ents[i])] = i + 1;
+}
 
-				switch (UPS_PORT_LS_GET(status)) {
-				case UPS_PORT_LS_U0:
-					printf(" U0");
-					break;
-				case UPS_PORT_LS_U1:
-					printf(" U1");
-					break;
-				case UPS_PORT_LS_U2:
-					printf(" U2");
-					break;
-				case UPS_PORT_LS_U3:
-					printf(" U3");
-					break;
-				case UPS_PORT_LS_SS_DISABLED:
-					printf(" SS.disabled");
-					break;
-				case UPS_PORT_LS_RX_DETECT:
-					printf(" Rx.detect");
-					break;
-				case UPS_PORT_LS_SS_INACTIVE:
-					printf(" ss.inactive");
-					break;
-				case UPS_PORT_LS_POLLING:
-					printf(" polling");
-					break;
-				case UPS_PORT_LS_RECOVERY:
-					printf(" recovery");
-					break;
-				case UPS_PORT_LS_HOT_RESET:
-					printf(" hot.reset");
-					break;
-				case UPS_PORT_LS_COMP_MOD:
-					printf(" comp.mod");
-					break;
-				case UPS_PORT_LS_LOOPBACK:
-					printf(" loopback");
-					break;
-				}
-			}
+void
+capture_put(int ctlr, struct usbcap_entry *key, const void *data)
+{
+	struct usbcap_entry *ce = NULL;
+	size_t slot, n;
 
-			printf("\n");
+	key->ctlr = ctlr;
+	if (capout->nents >= capout->nslots / 2)
+		capture_rehash();
+	slot = capture_slot(key);
+	if (capout->slots[slot] != 0)
+		ce = &capout->ents[capout->slots[slot] - 1];
+	if (ce != NULL && ce->len == key->len) {
+		/* Asked again, as -w does; keep the latest answer. */
+		memcpy(capout->data + ce->off, data, key->len);
+		return;
+	}
+	if (ce == NULL) {
+		if (capout->nents == capout->maxents) {
+			n = capout->maxents ? capout->maxents * 2 :
+			    CAPTURE_SLOTS / 2;
+			if ((ce = reallocarray(capout->ents, n,
+			    sizeof(*ce))) == NULL)
+				err(trouble, NULL);
+			capout->ents = ce;
+			capout->maxents = n;
 		}
+		ce = &capout->ents[capout->nents++];
+		capout->slots[slot] = capout->nents;
+	}
+	*ce = *key;
+	ce->off = capout->len;
+	capout->len += (key->len + 7) & ~7;
+	if (capout->len > capout->size) {
+		u_char *p;
+		size_t size = MAXIMUM(capout->size * 2, capout->len);
+
+		if ((p = realloc(capout->data, size)) == NULL)
+			err(trouble, NULL);
+		memset(p + capout->size, 0, size - capout->size);
+		capout->data = p;
+		capout->size = size;
+	}
+	memcpy(capout->data + ce->off, data, key->len);
+}
+
+int
+record_scan(scan_fn fn, void *arg)
+{
+	return recorded->scan(fn, arg);
+}
+
+int
+record_open(const char *path, int flags)
+{
+	int fd, ctlr;
+
+	if ((fd = recorded->open(path, flags)) == -1)
+		return fd;
+	pthread_mutex_lock(&capout->mtx);
+	if (!capout->written && (ctlr = capture_ctlr(path)) != -1) {
+		if (fd < (int)nitems(capout->fdctlr))
+			capout->fdctlr[fd] = ctlr + 1;
 	}
+	pthread_mutex_unlock(&capout->mtx);
+	return fd;
+}
+
+int
+record_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct usbcap_entry key;
+	const void *data;
+	int rv, saved;
+
+	rv = recorded->ioctl(fd, request, arg);
+	if (rv == -1 || fd < 0 || fd >= (int)nitems(capout->fdctlr) ||
+	    capture_key(request, arg, 1, &key, &data) == -1)
+		return rv;
+
+	saved = errno;
+	if (!fetch_gone()) {
+		pthread_mutex_lock(&capout->mtx);
+		if (!capout->written && capout->fdctlr[fd] != 0)
+			capture_put(capout->fdctlr[fd] - 1, &key, data);
+		pthread_mutex_unlock(&capout->mtx);
+	}
+	errno = saved;
+	return rv;
+}
+
+int
+record_close(int fd)
+{
+	if (fd >= 0 && fd < (int)nitems(capout->fdctlr)) {
+		pthread_mutex_lock(&capout->mtx);
+		capout->fdctlr[fd] = 0;
+		pthread_mutex_unlock(&capout->mtx);
+	}
+	return recorded->close(fd);
+}
+
+/*
+ * Map a capture and check that it was written by a compatible build.
+ */
+struct capture_map *
+capture_map(const char *path)
+{
+	struct capture_map *cm;
+	const struct usbcap_file *cf;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+	if ((cm = calloc(1, sizeof(*cm))) == NULL)
+		err(trouble, NULL);
+	cm->size = st.st_size;
+	if (cm->size < sizeof(*cf) || (cm->map = mmap(NULL, cm->size,
+	    PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		warnx("%s: not a capture", path);
+		close(fd);
+		free(cm);
+		return NULL;
+	}
+	close(fd);
+
+	cf = cm->hdr = (const struct usbcap_file *)cm->map;
+	if (cf->magic != USBCAP_MAGIC || cf->version != USBCAP_VERSION ||
+	    cf->size != sizeof(*cf) ||
+	    cf->sizes[USBCAP_DEVICEINFO] != sizeof(struct usb_device_info) ||
+	    cf->sizes[USBCAP_DDESC] != sizeof(struct usb_device_ddesc) ||
+	    cf->sizes[USBCAP_CDESC] != sizeof(struct usb_device_cdesc) ||
+	    cf->sizes[USBCAP_STATS] != sizeof(struct usb_device_stats) ||
+	    cf->ctlrs > cm->size || cf->nctlrs > (cm->size - cf->ctlrs) /
+	    sizeof(struct usbcap_ctlr) ||
+	    cf->index > cm->size || cf->nentries > (cm->size - cf->index) /
+	    sizeof(struct usbcap_entry)) {
+		warnx("%s: not a capture from this version", path);
+		capture_unmap(cm);
+		return NULL;
+	}
+	cm->ctlrs = (const struct usbcap_ctlr *)(cm->map + cf->ctlrs);
+	cm->ents = (const struct usbcap_entry *)(cm->map + cf->index);
+	return cm;
+}
+
+void
+capture_unmap(struct capture_map *cm)
+{
+	munmap(cm->map, cm->size);
+	free(cm);
+}
+
+/*
+ * Controller table index of path in a capture, or -1.
+ */
+int
+capture_path(struct capture_map *cm, const char *path)
+{
+	uint32_t i;
+
+	for (i = 0; i < cm->hdr->nctlrs; i++)
+		if (strncmp(cm->ctlrs[i].path, path, USBCAP_PATHLEN) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * The answer a capture holds for one question, or NULL.
+ */
+const void *
+capture_find(struct capture_map *cm, int ctlr, int type, int addr, int index,
+    size_t *len)
+{
+	const struct usbcap_entry *ce;
+	struct usbcap_entry key;
+
+	memset(&key, 0, sizeof(key));
+	key.ctlr = ctlr;
+	key.type = type;
+	key.addr = addr;
+	key.index = index;
+	ce = bsearch(&key, cm->ents, cm->hdr->nentries, sizeof(*ce),
+	    capture_cmp);
+	if (ce == NULL || ce->off > cm->size || ce->len > cm->size - ce->off)
+		return NULL;
+	if (len != NULL)
+		*len = ce->len;
+	return cm->map + ce->off;
+}
+
+/*
+ * Set up recording into path, starting from what it already holds.
+ * Whatever is there must be a capture: anything else is not ours to
+ * replace.
+ */
+void
+capture_start(const char *path)
+{
+	struct capture_map *cm;
+	struct usbcap_entry key;
+	struct stat st;
+	uint32_t i;
+
+	if ((capout = calloc(1, sizeof(*capout))) == NULL)
+		err(trouble, NULL);
+	capout->path = path;
+	pthread_mutex_init(&capout->mtx, NULL);
+
+	if ((cm = capture_map(path)) == NULL) {
+		if (stat(path, &st) == 0)
+			errx(trouble, "%s: not overwriting", path);
+		return;
+	}
+	for (i = 0; i < cm->hdr->nctlrs; i++)
+		capture_ctlr(cm->ctlrs[i].path);
+	for (i = 0; i < cm->hdr->nentries; i++) {
+		key = cm->ents[i];
+		if (key.ctlr >= capout->nctlrs || key.off > cm->size ||
+		    key.len > cm->size - key.off)
+			continue;
+		capture_put(key.ctlr, &key, cm->map + key.off);
+	}
+	capture_unmap(cm);
+}
+
+/*
+ * Write the capture out through a temporary file renamed over the
+ * old one, so that a capture is never found half written.
+ */
+void
+capture_write(void)
+{
+	struct usbcap_file cf;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	if (capout == NULL)
+		return;
+	/* A worker abandoned under -t may still come back with an answer. */
+	pthread_mutex_lock(&capout->mtx);
+	capout->written = 1;
+	pthread_mutex_unlock(&capout->mtx);
+	qsort(capout->ents, capout->nents, sizeof(*capout->ents),
+	    capture_cmp);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.magic = USBCAP_MAGIC;
+	cf.version = USBCAP_VERSION;
+	cf.size = sizeof(cf);
+	cf.sizes[USBCAP_DEVICEINFO] = sizeof(struct usb_device_info);
+	cf.sizes[USBCAP_DDESC] = sizeof(struct usb_device_ddesc);
+	cf.sizes[USBCAP_CDESC] = sizeof(struct usb_device_cdesc);
+	cf.sizes[USBCAP_FDESC] = 1;
+	cf.sizes[USBCAP_STATS] = sizeof(struct usb_device_stats);
+	cf.nctlrs = capout->nctlrs;
+	cf.nentries = capout->nents;
+	cf.ctlrs = sizeof(cf);
+	cf.index = cf.ctlrs + capout->nctlrs * sizeof(struct usbcap_ctlr) +
+	    capout->len;
+	for (i = 0; i < capout->nents; i++)
+		capout->ents[i].off += cf.ctlrs +
+		    capout->nctlrs * sizeof(struct usbcap_ctlr);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", capout->path) >=
+	    (int)sizeof(tmp)) {
+		warnc(ENAMETOOLONG, "%s", capout->path);
+		return;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		return;
+	}
+	if (fchmod(fd, 0644) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	if (fwrite(&cf, sizeof(cf), 1, fp) != 1 ||
+	    fwrite(capout->ctlrs, sizeof(struct usbcap_ctlr), capout->nctlrs,
+	    fp) != capout->nctlrs ||
+	    fwrite(capout->data, 1, capout->len, fp) != capout->len ||
+	    fwrite(capout->ents, sizeof(*capout->ents), capout->nents, fp) !=
+	    capout->nents) {
+		warn("%s", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	if (fclose(fp) == EOF) {
+		warn("%s", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, capout->path) == -1) {
+		warn("rename %s", capout->path);
+		unlink(tmp);
+	}
+}
+
+/*
+ * The controllers of a replay are those in the capture, in the order
+ * they were recorded.
+ */
+int
+replay_scan(scan_fn fn, void *arg)
+{
+	char path[USBCAP_PATHLEN + 1];
+	uint32_t i;
+
+	for (i = 0; i < capin->hdr->nctlrs; i++) {
+		strlcpy(path, capin->ctlrs[i].path, sizeof(path));
+		fn(path, arg);
+	}
+	return 0;
+}
+
+int
+replay_open(const char *path, int flags)
+{
+	int ctlr;
+
+	if ((ctlr = capture_path(capin, path)) != -1)
+		return REPLAY_FD_BASE + ctlr;
+	errno = ENXIO;
+	return -1;
+}
+
+int
+replay_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct usbcap_entry key;
+	const void *data, *p;
+	size_t len;
+	int ctlr = fd - REPLAY_FD_BASE;
+
+	if (ctlr < 0 || ctlr >= (int)capin->hdr->nctlrs) {
+		errno = EBADF;
+		return -1;
+	}
+	if (capture_key(request, arg, 0, &key, &data) == -1) {
+		errno = ENOTTY;
+		return -1;
+	}
+	if ((p = capture_find(capin, ctlr, key.type, key.addr, key.index,
+	    &len)) == NULL) {
+		if (key.type == USBCAP_DEVICEINFO || key.type == USBCAP_STATS)
+			errno = ENXIO;
+		else {
+			/* The device was there, the question was not. */
+			errno = capture_find(capin, ctlr, USBCAP_DEVICEINFO,
+			    key.addr, 0, NULL) ? EINVAL : ENXIO;
+		}
+		return -1;
+	}
+
+	if (key.type == USBCAP_FDESC) {
+		struct usb_device_fdesc *dfd = arg;
+
+		memcpy(dfd->udf_data, p, MINIMUM(len, dfd->udf_size));
+	} else
+		memcpy(arg, p, key.len);
+	return 0;
+}
+
+int
+replay_close(int fd)
+{
+	return 0;
+}
+
+/*
+ * Parse the address list of -a: comma separated addresses or ranges
+ * of them, each optionally limited to one bus, as in "3,5,9-14,1:2".
+ */
+int
+parse_addrs(const char *s, struct dump_args *da)
+{
+	struct addr_range *ar;
+	const char *errstr;
+	char *list, *p, *item, *sep;
+	int bus, lo, hi;
+
+	if ((list = strdup(s)) == NULL)
+		err(trouble, NULL);
+	for (p = list; (item = strsep(&p, ",")) != NULL; ) {
+		bus = -1;
+		if ((sep = strchr(item, ':')) != NULL) {
+			*sep = '\0';
+			bus = strtonum(item, 0, INT_MAX, &errstr);
+			if (errstr)
+				goto bad;
+			item = sep + 1;
+		}
+		if ((sep = strchr(item, '-')) != NULL)
+			*sep++ = '\0';
+		lo = strtonum(item, 1, USB_MAX_DEVICES - 1, &errstr);
+		if (errstr)
+			goto bad;
+		hi = lo;
+		if (sep != NULL) {
+			hi = strtonum(sep, lo, USB_MAX_DEVICES - 1, &errstr);
+			if (errstr)
+				goto bad;
+		}
+
+		if ((ar = reallocarray(da->addrs, da->naddrs + 1,
+		    sizeof(*ar))) == NULL)
+			err(trouble, NULL);
+		da->addrs = ar;
+		ar = &da->addrs[da->naddrs++];
+		ar->bus = bus;
+		ar->lo = lo;
+		ar->hi = hi;
+	}
+	free(list);
+	return 0;
+ bad:
+	free(list);
+	return -1;
+}
+
+int
+addr_selected(struct dump_args *da, int bus, int addr)
+{
+	struct addr_range *ar;
+	size_t i;
+
+	if (da->naddrs == 0)
+		return 1;
+	for (i = 0; i < da->naddrs; i++) {
+		ar = &da->addrs[i];
+		if ((ar->bus == -1 || ar->bus == bus) &&
+		    addr >= ar->lo && addr <= ar->hi)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * A controller's bus number is its unit, which is what udi_bus says.
+ */
+int
+controller_bus(const char *path)
+{
+	const char *errstr;
+	int bus;
+
+	if (strncmp(path, USBDEV, sizeof(USBDEV) - 1) != 0)
+		return -1;
+	bus = strtonum(path + sizeof(USBDEV) - 1, 0, INT_MAX, &errstr);
+	return errstr ? -1 : bus;
+}
+
+/*
+ * Parse the configuration number of -c or -f, counted from 1, or "all"
+ * for every configuration the device descriptor announces.
+ */
+int
+parse_config(const char *s)
+{
+	const char *errstr;
+	int config;
+
+	if (strcmp(s, "all") == 0)
+		return CONFIG_ALL;
+	config = strtonum(s, 1, USB_MAX_CONFIGS, &errstr);
+	if (errstr)
+		errx(trouble, "config %s", errstr);
+	return config - 1;
+}
+
+/*
+ * A vendor or product id for -i, in hex, or "*" for any.
+ */
+int
+parse_id(const char *s, const char *what)
+{
+	char *ep;
+	long id;
+
+	if (strcmp(s, "*") == 0)
+		return -1;
+	errno = 0;
+	id = strtol(s, &ep, 16);
+	if (*s == '\0' || *ep != '\0' || errno != 0 || id < 0 || id > 0xffff)
+		errx(trouble, "%s id %s invalid", what, s);
+	return id;
+}
+
+void
+parse_ids(const char *s)
+{
+	char buf[16], *product;
+
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		errx(trouble, "id %s invalid", s);
+	if ((product = strchr(buf, ':')) != NULL)
+		*product++ = '\0';
+	filter.vendor = parse_id(buf, "vendor");
+	filter.product = product ? parse_id(product, "product") : -1;
+}
+
+/*
+ * "umass" matches any umass, "umass0" only that one.
+ */
+int
+filter_driver(struct usb_device_info *di, const char *driver)
+{
+	size_t i, len = strlen(driver);
+	const char *name;
+
+	for (i = 0; i < USB_MAX_DEVNAMES; i++) {
+		name = di->udi_devnames[i];
+		if (strncmp(name, driver, len) != 0)
+			continue;
+		if (strspn(name + len, "0123456789") == strlen(name + len))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Everything checked here comes with USB_DEVICEINFO, so a device that
+ * does not match costs no more ioctls.
+ */
+int
+filter_match(struct usb_device_info *di)
+{
+	if (filter.bus != -1 && di->udi_bus != filter.bus)
+		return 0;
+	if (filter.vendor != -1 && UGETW(&di->udi_vendorNo) != filter.vendor)
+		return 0;
+	if (filter.product != -1 &&
+	    UGETW(&di->udi_productNo) != filter.product)
+		return 0;
+	if (filter.class != -1 && di->udi_class != filter.class)
+		return 0;
+	if (filter.driver != NULL && !filter_driver(di, filter.driver))
+		return 0;
+	return 1;
+}
+
+/*
+ * Parse a -w interval given in seconds, fractions down to a
+ * millisecond allowed.
+ */
+int64_t
+parse_interval(const char *s)
+{
+	char *ep;
+	double d;
+
+	errno = 0;
+	d = strtod(s, &ep);
+	if (s[0] == '\0' || *ep != '\0' || errno == ERANGE)
+		errx(trouble, "wait %s: invalid", s);
+	if (d < 0.001)
+		errx(trouble, "wait %s: too small", s);
+	if (d > 86400)
+		errx(trouble, "wait %s: too large", s);
+	return d * NSEC_PER_SEC;
+}
+
+/*
+ * Parse -t deadline[:budget], both in milliseconds.  The deadline runs
+ * from now; a device gets a tenth of it unless told otherwise.
+ */
+void
+parse_deadline(const char *s)
+{
+	char buf[32], *p;
+	const char *errstr;
+	long long ms;
+
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		errx(trouble, "deadline %s: invalid", s);
+	if ((p = strchr(buf, ':')) != NULL)
+		*p++ = '\0';
+	ms = strtonum(buf, 1, 3600 * 1000, &errstr);
+	if (errstr)
+		errx(trouble, "deadline %s: %s", buf, errstr);
+	budget = ms * 1000000 / 10;
+	if (p != NULL) {
+		budget = strtonum(p, 1, ms, &errstr) * 1000000;
+		if (errstr)
+			errx(trouble, "budget %s: %s", p, errstr);
+	}
+	deadline = mono_ns() + ms * 1000000;
+}
+
+/*
+ * Parse -P count[:gap], the gap between two requests on a bus in
+ * milliseconds, 10 unless given.
+ */
+void
+parse_probe(const char *s)
+{
+	char buf[32], *p;
+	const char *errstr;
+
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		errx(trouble, "probe %s: invalid", s);
+	if ((p = strchr(buf, ':')) != NULL)
+		*p++ = '\0';
+	probes = strtonum(buf, 1, 10000, &errstr);
+	if (errstr)
+		errx(trouble, "probe count %s: %s", buf, errstr);
+	probe_gap = 10 * 1000000LL;
+	if (p != NULL) {
+		probe_gap = strtonum(p, 1, 60 * 1000, &errstr) * 1000000LL;
+		if (errstr)
+			errx(trouble, "probe gap %s: %s", p, errstr);
+	}
+}
+
+/*
+ * Parse -r type:rate[,type:rate...], transfers per second for the
+ * types as -s names them.
+ */
+void
+parse_bursts(const char *s)
+{
+	char buf[128], *p = buf, *word, *rate;
+	const char *errstr;
+	size_t i;
+
+	if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf))
+		errx(trouble, "rates %s: invalid", s);
+	while ((word = strsep(&p, ",")) != NULL) {
+		if ((rate = strchr(word, ':')) == NULL)
+			errx(trouble, "rate %s: invalid", word);
+		*rate++ = '\0';
+		for (i = 0; i < nitems(xfer_names); i++)
+			if (strcmp(word, xfer_names[i]) == 0)
+				break;
+		if (i == nitems(xfer_names))
+			errx(trouble, "rate %s: unknown type", word);
+		burst_rates[i] = strtonum(rate, 1, 1000000000, &errstr);
+		if (errstr)
+			errx(trouble, "rate %s: %s", rate, errstr);
+	}
+	bursts = 1;
+}
+
+/*
+ * Output is collected per controller and written out in large chunks
+ * instead of going through stdio a few bytes at a time.  The buffer
+ * is kept for reuse once flushed.
+ */
+void
+ob_reserve(struct obuf *ob, size_t n)
+{
+	size_t size;
+	char *buf;
+
+	if (ob->len + n <= ob->size)
+		return;
+	size = ob->size ? ob->size : OBUF_CHUNK;
+	while (size < ob->len + n)
+		size *= 2;
+	if ((buf = realloc(ob->buf, size)) == NULL)
+		err(trouble, NULL);
+	ob->buf = buf;
+	ob->size = size;
+}
+
+void
+ob_write(struct obuf *ob, const void *p, size_t n)
+{
+	ob_reserve(ob, n);
+	memcpy(ob->buf + ob->len, p, n);
+	ob->len += n;
+}
+
+void
+ob_str(struct obuf *ob, const char *s)
+{
+	ob_write(ob, s, strlen(s));
+}
+
+void
+ob_strn(struct obuf *ob, const char *s, size_t max)
+{
+	ob_write(ob, s, strnlen(s, max));
+}
+
+void
+ob_char(struct obuf *ob, char c)
+{
+	ob_reserve(ob, 1);
+	ob->buf[ob->len++] = c;
+}
+
+/*
+ * Append v in decimal, zero-padded to width digits.
+ */
+void
+ob_dec(struct obuf *ob, unsigned long long v, int width)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+
+	ob_reserve(ob, n > width ? n : width);
+	while (width-- > n)
+		ob->buf[ob->len++] = '0';
+	while (n > 0)
+		ob->buf[ob->len++] = tmp[--n];
+}
+
+/*
+ * Append v in lower case hex, zero-padded to width digits.
+ */
+void
+ob_hex(struct obuf *ob, unsigned long long v, int width)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[16];
+	int n = 0;
+
+	do {
+		tmp[n++] = digits[v & 0xf];
+		v >>= 4;
+	} while (v != 0);
+
+	ob_reserve(ob, n > width ? n : width);
+	while (width-- > n)
+		ob->buf[ob->len++] = '0';
+	while (n > 0)
+		ob->buf[ob->len++] = tmp[--n];
+}
+
+void
+ob_printf(struct obuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		err(trouble, "vsnprintf");
+	if ((size_t)n >= ob->size - ob->len) {
+		ob_reserve(ob, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+		va_end(ap);
+	}
+	ob->len += n;
+}
+
+/*
+ * Write out what has been collected.  A buffer without a descriptor
+ * (a parallel worker's) holds on to its contents until main gives it
+ * one.
+ */
+void
+ob_flush(struct obuf *ob)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	if (ob->fd == -1)
+		return;
+	while (off < ob->len) {
+		if ((n = write(ob->fd, ob->buf + off, ob->len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "write");
+		}
+		off += n;
+	}
+	ob->len = 0;
+}
+
+/*
+ * Called between devices: flush once enough has piled up to make it
+ * one large write.
+ */
+void
+ob_check(struct obuf *ob)
+{
+	if (ob->len >= OBUF_FLUSH)
+		ob_flush(ob);
+}
+
+const char *
+speed_name(int speed)
+{
+	if (speed < 0 || (size_t)speed >= nitems(speed_names))
+		return NULL;
+	return speed_names[speed];
+}
+
+const char *
+link_state_name(int state)
+{
+	if (state < 0 || (size_t)state >= nitems(link_state_names))
+		return NULL;
+	return link_state_names[state];
+}
+
+int
+get_device_info(int fd, uint8_t addr, struct usb_device_info *di)
+{
+	di->udi_addr = addr;
+	if (usbdevs_info(fd, addr, di) == -1) {
+		if (errno != ENXIO)
+			warn("addr %u", addr);
+		return -1;
+	}
+	return 0;
+}
+
+void
+dump_device(struct obuf *ob, struct usb_device_info *di)
+{
+	int i;
+	char vv[sizeof(di->udi_vendor)*4], vp[sizeof(di->udi_product)*4];
+	char vr[sizeof(di->udi_release)*4], vs[sizeof(di->udi_serial)*4];
+
+	strvis(vv, di->udi_vendor, VIS_CSTYLE);
+	strvis(vp, di->udi_product, VIS_CSTYLE);
+	ob_str(ob, "addr ");
+	ob_dec(ob, di->udi_addr, 2);
+	ob_str(ob, ": ");
+	ob_hex(ob, UGETW(&di->udi_vendorNo), 4);
+	ob_char(ob, ':');
+	ob_hex(ob, UGETW(&di->udi_productNo), 4);
+	ob_char(ob, ' ');
+	ob_str(ob, vv);
+	ob_str(ob, ", ");
+	ob_str(ob, vp);
+	ob_str(ob, ", usb_bus: ");
+	ob_dec(ob, di->udi_bus, 0);
+
+	if (verbose) {
+		ob_str(ob, "\n\t ");
+		if (speed_name(di->udi_speed) != NULL) {
+			ob_str(ob, speed_name(di->udi_speed));
+			ob_str(ob, " speed");
+		}
+
+		if (di->udi_power)
+			ob_printf(ob, ", power %d mA", UGETDW(&di->udi_power));
+		else
+			ob_str(ob, ", self powered");
+
+		if (di->udi_config)
+			ob_printf(ob, ", config %d", di->udi_config);
+		else
+			ob_str(ob, ", unconfigured");
+
+		strvis(vr, di->udi_release, VIS_CSTYLE);
+		ob_printf(ob, ", rev %s (0x%hx)", vr, UGETW(&di->udi_releaseNo));
+
+		ob_printf(ob, "\n\t class: %hhu, subclass: %hhu, protocol: %hhu",
+		    di->udi_class, di->udi_subclass, di->udi_protocol);
+
+		if (di->udi_serial[0] != '\0') {
+			strvis(vs, di->udi_serial, VIS_CSTYLE);
+			ob_str(ob, ", iSerial ");
+			ob_str(ob, vs);
+		}
+	}
+	ob_str(ob, "\n");
+
+	if (verbose)
+		for (i = 0; i < USB_MAX_DEVNAMES; i++)
+			if (di->udi_devnames[i][0] != '\0') {
+				ob_str(ob, "\t driver: ");
+				ob_strn(ob, di->udi_devnames[i],
+				    sizeof(di->udi_devnames[i]));
+				ob_char(ob, '\n');
+			}
+
+	if (verbose > 1) {
+		int port, nports;
+
+		nports = MINIMUM(UGETDW(&di->udi_nports), nitems(di->udi_ports));
+		for (port = 0; port < nports; port++) {
+			uint16_t status, change;
+
+			status = UGETDW(&di->udi_ports[port]) & 0xffff;
+			change = UGETDW(&di->udi_ports[port]) >> 16;
+
+			ob_str(ob, "\t port ");
+			ob_dec(ob, port+1, 2);
+			ob_str(ob, ": ");
+			ob_hex(ob, change, 4);
+			ob_char(ob, '.');
+			ob_hex(ob, status, 4);
+
+			if (status & UPS_CURRENT_CONNECT_STATUS)
+				ob_str(ob, " connect");
+
+			if (status & UPS_PORT_ENABLED)
+				ob_str(ob, " enabled");
+
+			if (status & UPS_SUSPEND)
+				ob_str(ob, " supsend");
+
+			if (status & UPS_OVERCURRENT_INDICATOR)
+				ob_str(ob, " overcurrent");
+
+			if (di->udi_speed < USB_SPEED_SUPER) {
+				if (status & UPS_PORT_L1)
+					ob_str(ob, " l1");
+
+				if (status & UPS_PORT_POWER)
+					ob_str(ob, " power");
+			} else {
+				if (status & UPS_PORT_POWER_SS)
+					ob_str(ob, " power");
+
+				if (link_state_name(UPS_PORT_LS_GET(status))) {
+					ob_char(ob, ' ');
+					ob_str(ob, link_state_name(
+					    UPS_PORT_LS_GET(status)));
+				}
+			}
+
+			ob_str(ob, "\n");
+		}
+	}
+}
+
+struct usb_snap_config *
+snap_config(struct usb_snap *us, int index)
+{
+	struct usb_snap_config *uc;
+	int i;
+
+	for (i = 0; i < us->nconfigs; i++)
+		if (us->configs[i].index == index)
+			return &us->configs[i];
+
+	uc = reallocarray(us->configs, us->nconfigs + 1, sizeof(*uc));
+	if (uc == NULL)
+		err(trouble, NULL);
+	us->configs = uc;
+	uc = &us->configs[us->nconfigs++];
+	memset(uc, 0, sizeof(*uc));
+	uc->index = index;
+	return uc;
+}
+
+/*
+ * Look a configuration up without adding it.  The daemon only fetches
+ * configurations by index, so the current one is found by its value.
+ */
+struct usb_snap_config *
+snap_find(struct usb_snap *us, int index)
+{
+	int i;
+
+	for (i = 0; i < us->nconfigs; i++)
+		if (us->configs[i].index == index)
+			return &us->configs[i];
+	if (index != USB_CURRENT_CONFIG_INDEX)
+		return NULL;
+	for (i = 0; i < us->nconfigs; i++)
+		if ((us->configs[i].flags & SNAP_CDESC) &&
+		    us->configs[i].cd.udc_desc.bConfigurationValue ==
+		    us->di.udi_config)
+			return &us->configs[i];
+	return NULL;
+}
+
+/*
+ * Descriptor arena.  Full descriptors are fetched straight into 64 KiB
+ * chunks owned by the controller, and snapshots point into them.  Space
+ * is handed out from the newest chunk only; a chunk stays until every
+ * snapshot in it is gone or the arena is compacted, so the footprint is
+ * bounded by what the snapshot table holds plus a chunk or two.
+ */
+struct arena_chunk *
+arena_grow(struct arena *ar)
+{
+	struct arena_chunk *ac;
+
+	if ((ac = malloc(sizeof(*ac))) == NULL)
+		err(trouble, NULL);
+	ac->next = ar->head;
+	ac->used = 0;
+	ar->head = ac;
+	return ac;
+}
+
+/*
+ * Room for at least want bytes at the end of the newest chunk.
+ */
+u_char *
+arena_room(struct arena *ar, size_t want, size_t *room)
+{
+	struct arena_chunk *ac = ar->head;
+
+	if (ac == NULL || ARENA_CHUNK - ac->used < want)
+		ac = arena_grow(ar);
+	*room = ARENA_CHUNK - ac->used;
+	return ac->data + ac->used;
+}
+
+/*
+ * Keep len bytes of what arena_room() returned.
+ */
+void
+arena_commit(struct arena *ar, size_t len)
+{
+	ar->head->used += len;
+	ar->used += len;
+	ar->live += len;
+}
+
+u_char *
+arena_alloc(struct arena *ar, size_t len)
+{
+	size_t room;
+	u_char *p;
+
+	p = arena_room(ar, len, &room);
+	arena_commit(ar, len);
+	return p;
+}
+
+void
+arena_release(struct arena *ar, size_t len)
+{
+	struct arena_chunk *ac;
+
+	ar->live -= len;
+	if (ar->live != 0 || ar->head == NULL)
+		return;
+
+	/* Nothing points into the arena; keep one chunk to refill. */
+	while ((ac = ar->head->next) != NULL) {
+		ar->head->next = ac->next;
+		free(ac);
+	}
+	ar->head->used = 0;
+	ar->used = 0;
+}
+
+void
+arena_free(struct arena *ar)
+{
+	struct arena_chunk *ac;
+
+	while ((ac = ar->head) != NULL) {
+		ar->head = ac->next;
+		free(ac);
+	}
+	memset(ar, 0, sizeof(*ar));
+}
+
+/*
+ * Take over the chunks of another arena, behind the one being filled.
+ */
+void
+arena_merge(struct arena *ar, struct arena *from)
+{
+	struct arena_chunk *tail;
+
+	if (from->head == NULL)
+		return;
+	if (ar->head == NULL)
+		ar->head = from->head;
+	else {
+		for (tail = from->head; tail->next != NULL; tail = tail->next)
+			;
+		tail->next = ar->head->next;
+		ar->head->next = from->head;
+	}
+	ar->used += from->used;
+	ar->live += from->live;
+	ar->maxfetch = MAXIMUM(ar->maxfetch, from->maxfetch);
+	memset(from, 0, sizeof(*from));
+}
+
+/*
+ * Fetch the full descriptor set of a configuration into the arena.
+ * The window offered is whatever is left of the newest chunk, at least
+ * the largest wTotalLength seen so far; the configuration descriptor at
+ * its head tells whether that was enough, and if not the fetch is
+ * repeated into a fresh chunk, which always is.
+ */
+int
+snap_fdesc(int fd, struct arena *ar, struct usb_snap *us,
+    struct usb_snap_config *uc)
+{
+	u_char *data;
+	uint16_t wtotlen;
+	size_t room, size;
+	int n;
+
+	data = arena_room(ar, MAXIMUM(ar->maxfetch, sizeof(uc->cd.udc_desc)),
+	    &room);
+	for (;;) {
+		size = MINIMUM(room, USB_MAX_FDESC);
+		if ((n = usbdevs_fdesc(fd, us->addr, uc->index, data,
+		    size)) == -1) {
+			if (errno != ENXIO)
+				warn("addr %u", us->addr);
+			return -1;
+		}
+		wtotlen = n;
+		if (wtotlen <= size || room == ARENA_CHUNK)
+			break;
+		data = arena_grow(ar)->data;
+		room = ARENA_CHUNK;
+	}
+	if (wtotlen < sizeof(uc->cd.udc_desc)) {
+		warnx("addr %u: short configuration descriptor", us->addr);
+		return -1;
+	}
+	if (wtotlen > ar->maxfetch)
+		ar->maxfetch = wtotlen;
+	memcpy(&uc->cd.udc_desc, data, sizeof(uc->cd.udc_desc));
+	arena_commit(ar, wtotlen);
+	uc->data = data;
+	uc->len = wtotlen;
+	uc->flags |= SNAP_CDESC | SNAP_FDESC;
+	return 0;
+}
+
+/*
+ * Descriptor cache (-C file).  Configuration and full descriptors are
+ * kept on disk keyed by where a device sits and what it claims to be,
+ * so that -c and -f can be answered without asking the device again.
+ * An entry is only used while bus, address, vendor, product, release,
+ * serial and, for the current configuration, udi_config all match what
+ * USB_DEVICEINFO reports.
+ */
+int
+cache_match(struct cache_ent *ce, struct usb_device_info *di, int index)
+{
+	return ce->bus == di->udi_bus && ce->addr == di->udi_addr &&
+	    ce->index == index &&
+	    (index != USB_CURRENT_CONFIG_INDEX ||
+	    ce->config == di->udi_config) &&
+	    ce->vendorNo == UGETW(&di->udi_vendorNo) &&
+	    ce->productNo == UGETW(&di->udi_productNo) &&
+	    ce->releaseNo == UGETW(&di->udi_releaseNo) &&
+	    strncmp(ce->serial, di->udi_serial, sizeof(ce->serial)) == 0;
+}
+
+/*
+ * Fill a configuration of the snapshot from the cache.  Returns 0 if
+ * the cache had everything the requested views need.
+ */
+int
+cache_get(struct arena *ar, struct usb_snap *us, struct usb_snap_config *uc,
+    int command)
+{
+	struct cache_ent *ce;
+	size_t i;
+	int rv = -1;
+
+	if (cache == NULL || !(us->flags & SNAP_INFO) ||
+	    (us->flags & SNAP_REVALIDATE))
+		return -1;
+
+	pthread_mutex_lock(&cache->mtx);
+	for (i = 0; i < cache->nents; i++) {
+		ce = &cache->ents[i];
+		if (!cache_match(ce, &us->di, uc->index))
+			continue;
+		if ((command & COMM_FDSC) && ce->data == NULL)
+			break;
+		memcpy(&uc->cd.udc_desc, &ce->cd, sizeof(ce->cd));
+		uc->flags |= SNAP_CDESC;
+		if (ce->data != NULL) {
+			uc->data = arena_alloc(ar, ce->len);
+			memcpy(uc->data, ce->data, ce->len);
+			uc->len = ce->len;
+			uc->flags |= SNAP_FDESC;
+		}
+		rv = 0;
+		break;
+	}
+	pthread_mutex_unlock(&cache->mtx);
+	return rv;
+}
+
+/*
+ * Remember what was just fetched, replacing any entry for the same
+ * bus, address and configuration index.
+ */
+void
+cache_put(struct usb_snap *us, struct usb_snap_config *uc)
+{
+	struct cache_ent *ce = NULL;
+	size_t i;
+
+	if (cache == NULL || !(us->flags & SNAP_INFO) ||
+	    !(uc->flags & SNAP_CDESC) || fetch_gone())
+		return;
+
+	pthread_mutex_lock(&cache->mtx);
+	for (i = 0; i < cache->nents; i++) {
+		if (cache->ents[i].bus == us->di.udi_bus &&
+		    cache->ents[i].addr == us->addr &&
+		    cache->ents[i].index == uc->index) {
+			ce = &cache->ents[i];
+			free(ce->data);
+			break;
+		}
+	}
+	if (ce == NULL) {
+		ce = reallocarray(cache->ents, cache->nents + 1, sizeof(*ce));
+		if (ce == NULL)
+			err(trouble, NULL);
+		cache->ents = ce;
+		ce = &cache->ents[cache->nents++];
+	}
+
+	memset(ce, 0, sizeof(*ce));
+	ce->bus = us->di.udi_bus;
+	ce->addr = us->addr;
+	ce->index = uc->index;
+	ce->config = us->di.udi_config;
+	ce->vendorNo = UGETW(&us->di.udi_vendorNo);
+	ce->productNo = UGETW(&us->di.udi_productNo);
+	ce->releaseNo = UGETW(&us->di.udi_releaseNo);
+	strlcpy(ce->serial, us->di.udi_serial, sizeof(ce->serial));
+	memcpy(&ce->cd, &uc->cd.udc_desc, sizeof(ce->cd));
+	if (uc->flags & SNAP_FDESC) {
+		if ((ce->data = malloc(uc->len)) == NULL)
+			err(trouble, NULL);
+		memcpy(ce->data, uc->data, uc->len);
+		ce->len = uc->len;
+	}
+	cache->dirty = 1;
+	pthread_mutex_unlock(&cache->mtx);
+}
+
+/*
+ * On disk the cache is a struct cache_file followed by the entries,
+ * each a struct cache_rec and, if it has one, the full descriptor.
+ * A file that does not parse is ignored; it is rewritten on exit.
+ */
+void
+cache_load(const char *path)
+{
+	struct cache_file cf;
+	struct cache_rec cr;
+	struct cache_ent *ce;
+	FILE *fp;
+
+	if ((cache = calloc(1, sizeof(*cache))) == NULL)
+		err(trouble, NULL);
+	cache->path = path;
+	pthread_mutex_init(&cache->mtx, NULL);
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return;
+	}
+	if (fread(&cf, sizeof(cf), 1, fp) != 1 ||
+	    cf.magic != CACHE_MAGIC || cf.version != CACHE_VERSION) {
+		warnx("%s: not a descriptor cache, ignored", path);
+		goto done;
+	}
+	while (fread(&cr, sizeof(cr), 1, fp) == 1) {
+		ce = reallocarray(cache->ents, cache->nents + 1, sizeof(*ce));
+		if (ce == NULL)
+			err(trouble, NULL);
+		cache->ents = ce;
+		ce = &cache->ents[cache->nents];
+		memset(ce, 0, sizeof(*ce));
+		ce->bus = cr.bus;
+		ce->addr = cr.addr;
+		ce->index = cr.index;
+		ce->config = cr.config;
+		ce->vendorNo = cr.vendorNo;
+		ce->productNo = cr.productNo;
+		ce->releaseNo = cr.releaseNo;
+		memcpy(ce->serial, cr.serial, sizeof(ce->serial));
+		ce->serial[sizeof(ce->serial) - 1] = '\0';
+		memcpy(&ce->cd, cr.cdesc, sizeof(ce->cd));
+		if (cr.len != 0) {
+			if ((ce->data = malloc(cr.len)) == NULL)
+				err(trouble, NULL);
+			if (fread(ce->data, cr.len, 1, fp) != 1) {
+				free(ce->data);
+				warnx("%s: truncated", path);
+				break;
+			}
+			ce->len = cr.len;
+		}
+		cache->nents++;
+	}
+done:
+	fclose(fp);
+}
+
+/*
+ * Write the cache back if anything changed.  A worker abandoned under
+ * -t may still be adding entries meanwhile.
+ */
+void
+cache_save(void)
+{
+	if (cache == NULL)
+		return;
+	pthread_mutex_lock(&cache->mtx);
+	cache_write();
+	pthread_mutex_unlock(&cache->mtx);
+}
+
+/*
+ * Through a temporary file renamed over the old one, so that readers
+ * never see half of it; the cache's mutex is held.
+ */
+void
+cache_write(void)
+{
+	struct cache_file cf;
+	struct cache_rec cr;
+	struct cache_ent *ce;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	if (cache == NULL || !cache->dirty)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", cache->path) >=
+	    (int)sizeof(tmp)) {
+		warnc(ENAMETOOLONG, "%s", cache->path);
+		return;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		return;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	memset(&cf, 0, sizeof(cf));
+	cf.magic = CACHE_MAGIC;
+	cf.version = CACHE_VERSION;
+	if (fwrite(&cf, sizeof(cf), 1, fp) != 1)
+		goto bad;
+	for (i = 0; i < cache->nents; i++) {
+		ce = &cache->ents[i];
+		memset(&cr, 0, sizeof(cr));
+		cr.bus = ce->bus;
+		cr.addr = ce->addr;
+		cr.index = ce->index;
+		cr.config = ce->config;
+		cr.vendorNo = ce->vendorNo;
+		cr.productNo = ce->productNo;
+		cr.releaseNo = ce->releaseNo;
+		memcpy(cr.serial, ce->serial, sizeof(cr.serial));
+		memcpy(cr.cdesc, &ce->cd, sizeof(cr.cdesc));
+		cr.len = ce->len;
+		if (fwrite(&cr, sizeof(cr), 1, fp) != 1 ||
+		    (ce->len != 0 && fwrite(ce->data, ce->len, 1, fp) != 1))
+			goto bad;
+	}
+
+	if (fclose(fp) == EOF) {
+		warn("%s", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, cache->path) == -1) {
+		warn("rename %s", cache->path);
+		unlink(tmp);
+		return;
+	}
+	cache->dirty = 0;
+	return;
+
+bad:
+	/* A short write keeps the old cache, as a failed close does. */
+	warn("%s", tmp);
+	fclose(fp);
+	unlink(tmp);
+}
+
+/*
+ * Issue every ioctl the requested views need for one device, once.
+ * Whatever is already in the snapshot is not asked for again, and
+ * nothing more once its -t budget is spent.
+ */
+void
+snap_fill(int fd, struct arena *ar, struct usb_snap *us, int command,
+    int config)
+{
+	int i;
+
+	if (filtering) {
+		if (!(us->flags & SNAP_INFO))
+			snap_info(fd, us);
+		if (!(us->flags & SNAP_INFO) || !filter_match(&us->di)) {
+			us->flags |= SNAP_SKIP;
+			return;
+		}
+	}
+
+	if ((command & COMM_INFO) && !(us->flags & SNAP_INFO))
+		snap_info(fd, us);
+
+	if (snap_late(us))
+		return;
+	if ((command & COMM_DDSC) && !(us->flags & SNAP_DDESC)) {
+		if (usbdevs_ddesc(fd, us->addr, &us->ddd) == -1) {
+			if (errno != ENXIO)
+				warn("addr %u", us->addr);
+		} else
+			us->flags |= SNAP_DDESC;
+	}
+
+	if (!(command & (COMM_CDSC | COMM_FDSC)))
+		return;
+
+	/* Without the device's identity the cache cannot be trusted. */
+	if (cache != NULL && !(us->flags & SNAP_INFO))
+		snap_info(fd, us);
+
+	if (config != CONFIG_ALL) {
+		snap_fill_config(fd, ar, us, command, config);
+		return;
+	}
+
+	/* Every configuration, as many as the device descriptor says. */
+	if (snap_late(us))
+		return;
+	if (!(us->flags & SNAP_DDESC)) {
+		if (usbdevs_ddesc(fd, us->addr, &us->ddd) == -1) {
+			if (errno != ENXIO)
+				warn("addr %u", us->addr);
+			return;
+		}
+		us->flags |= SNAP_DDESC;
+	}
+	for (i = 0; i < us->ddd.udd_desc.bNumConfigurations; i++)
+		snap_fill_config(fd, ar, us, command, i);
+}
+
+void
+snap_fill_config(int fd, struct arena *ar, struct usb_snap *us, int command,
+    int config)
+{
+	struct usb_snap_config *uc;
+
+	if (snap_late(us))
+		return;
+	uc = snap_config(us, config);
+	if (command & COMM_FDSC) {
+		if (!(uc->flags & SNAP_FDESC) &&
+		    cache_get(ar, us, uc, command) == -1 &&
+		    snap_fdesc(fd, ar, us, uc) == 0)
+			cache_put(us, uc);
+	} else if (!(uc->flags & SNAP_CDESC) &&
+	    cache_get(ar, us, uc, command) == -1) {
+		if (usbdevs_cdesc(fd, us->addr, config, &uc->cd) == -1) {
+			if (errno != ENXIO)
+				warn("addr %u", us->addr);
+		} else {
+			uc->flags |= SNAP_CDESC;
+			cache_put(us, uc);
+		}
+	}
+}
+
+/*
+ * USB_DEVICEINFO into the snapshot.  An address that fails otherwise
+ * than by being empty is marked, so that -x does not take what was
+ * there for gone.
+ */
+int
+snap_info(int fd, struct usb_snap *us)
+{
+	us->di.udi_addr = us->addr;
+	if (usbdevs_info(fd, us->addr, &us->di) == -1) {
+		if (errno != ENXIO) {
+			warn("addr %u", us->addr);
+			us->flags |= SNAP_UNREADABLE;
+		}
+		return -1;
+	}
+	us->flags = (us->flags & ~SNAP_UNREADABLE) | SNAP_INFO;
+	return 0;
+}
+
+/*
+ * Whether the device has run out of its -t budget, marking it if so.
+ */
+int
+snap_late(struct usb_snap *us)
+{
+	if (us->deadline == 0 || mono_ns() < us->deadline)
+		return 0;
+	us->flags |= SNAP_TIMEDOUT;
+	return 1;
+}
+
+void
+snap_free(struct arena *ar, struct usb_snap *us)
+{
+	int i;
+
+	for (i = 0; i < us->nconfigs; i++) {
+		if (us->configs[i].data != NULL)
+			arena_release(ar, us->configs[i].len);
+		free(us->configs[i].descs);
+	}
+	free(us->configs);
+	us->configs = NULL;
+	us->nconfigs = 0;
+	us->flags = 0;
+}
+
+void
+print_device(struct obuf *ob, struct usb_snap *us)
+{
+	ob_printf(ob, "addr %02u: max packet: %2u, num configs: %u, "
+	    "iManufacturer: %hhu\n",
+	    us->addr, us->ddd.udd_desc.bMaxPacketSize,
+	    us->ddd.udd_desc.bNumConfigurations,
+	    us->ddd.udd_desc.iManufacturer);
+}
+
+void
+print_config(struct obuf *ob, struct usb_snap *us, struct usb_snap_config *uc)
+{
+	usb_config_descriptor_t *cd = &uc->cd.udc_desc;
+
+	ob_printf(ob, "addr %02u, config %02u: interfaces: %u, "
+	    "max-power: %umA", us->addr, cd->bConfigurationValue,
+	    cd->bNumInterfaces, cd->bMaxPower * UC_POWER_FACTOR);
+	ob_str(ob, "\n\t attr 0x");
+	ob_hex(ob, cd->bmAttributes, 2);
+	ob_char(ob, ':');
+	if (cd->bmAttributes & UC_BUS_POWERED)
+		ob_str(ob, " bus-powered");
+	if (cd->bmAttributes & UC_SELF_POWERED)
+		ob_str(ob, " self-powered");
+	if (cd->bmAttributes & UC_REMOTE_WAKEUP)
+		ob_str(ob, " remote-wakeup");
+
+	ob_char(ob, '\n');
+}
+
+/*
+ * Full descriptor dumps.  The FDESC blob of a configuration is decoded
+ * once by usbdevs_decode() into an array of struct usbdevs_desc, kept
+ * with the snapshot; the text, JSON and binary renderers all work from
+ * that array, and this table says which of them shows each kind.
+ */
+const struct desc_show desc_shows[USBDEVS_DESC_NKINDS] = {
+	[USBDEVS_DESC_UNKNOWN] = { print_unknown, json_unknown },
+	[USBDEVS_DESC_CONFIG] = { print_fconfig, json_fconfig },
+	[USBDEVS_DESC_STRING] = { print_string, json_string_desc },
+	[USBDEVS_DESC_IFACE] = { print_iface, json_iface },
+	[USBDEVS_DESC_ENDPT] = { print_endpt, json_endpt },
+	[USBDEVS_DESC_IAD] = { print_iad, json_iad },
+	[USBDEVS_DESC_HID] = { print_hid, json_hid },
+	[USBDEVS_DESC_CLASS] = { print_class, json_class },
+	[USBDEVS_DESC_CDC_HEADER] = { print_class, json_class },
+	[USBDEVS_DESC_CDC_UNION] = { print_class, json_class },
+	[USBDEVS_DESC_SSCOMP] = { print_sscomp, json_sscomp },
+	[USBDEVS_DESC_BOS] = { print_bos, json_bos },
+	[USBDEVS_DESC_DEVCAP] = { print_devcap, json_devcap },
+};
+
+void
+snap_decode(struct usb_snap *us, struct usb_snap_config *sc)
+{
+	size_t n, end;
+
+	if (sc->flags & SNAP_DECODED)
+		return;
+	sc->flags |= SNAP_DECODED;
+
+	n = usbdevs_decode(sc->data, sc->len, NULL, 0, &end);
+	if (n > 0 && (sc->descs = reallocarray(NULL, n,
+	    sizeof(*sc->descs))) == NULL)
+		err(trouble, NULL);
+	usbdevs_decode(sc->data, sc->len, sc->descs, n, NULL);
+	if (end + 2 <= sc->len)
+		warnx("addr %u: bad descriptor length %u at offset %zu",
+		    us->addr, sc->data[end], end);
+	sc->ndescs = n;
+}
+
+void
+print_fconfig(struct obuf *ob, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "config ");
+	ob_dec(ob, *(cur + 5), 2);
+	ob_str(ob, ":\n");
+}
+
+void
+print_iface(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t iface: ");
+	ob_dec(ob, *(cur + 2), 2);
+	ob_str(ob, ", altset: ");
+	ob_dec(ob, *(cur + 3), 2);
+	ob_str(ob, ", numendpts: ");
+	ob_dec(ob, *(cur + 4), 2);
+	ob_str(ob, ", class: ");
+	ob_dec(ob, *(cur + 5), 2);
+	ob_str(ob, ", subclass: ");
+	ob_dec(ob, *(cur + 6), 2);
+	ob_str(ob, ", protocol: ");
+	ob_dec(ob, *(cur + 7), 2);
+	ob_char(ob, '\n');
+}
+
+void
+print_endpt(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t \t endpt_addr: ");
+	ob_dec(ob, *(cur + 2) & 0x3, 2);
+	ob_str(ob, *(cur + 2) & 0x7 ? ", dir: in, " : ", dir: out, ");
+
+	switch (*(cur +3) & 0x3) {
+	case 0:
+		ob_str(ob, "control, ");
+		break;
+	case 1:
+		ob_str(ob, "isochronous, ");
+		ob_str(ob, "sync_type: ");
+		switch ((*(cur + 3) >> 2) & 0x3) {
+		case 0:
+			ob_str(ob, "none, ");
+			break;
+		case 1:
+			ob_str(ob, "async, ");
+			break;
+		case 2:
+			ob_str(ob, "adaptive, ");
+			break;
+		case 3:
+			ob_str(ob, "sync, ");
+			break;
+		}
+		break;
+	case 2:
+		ob_str(ob, "bulk, ");
+		break;
+	case 3:
+		ob_str(ob, "interrupt, ");
+		break;
+	}
+
+	ob_str(ob, "max_packet: ");
+	ob_dec(ob, UGETW(cur + 4), 0);
+	ob_str(ob, ", polling_interval: ");
+	ob_dec(ob, *(cur + 6), 2);
+	ob_char(ob, '\n');
+}
+
+/*
+ * String descriptors are UTF-16LE; anything outside ASCII becomes '?'.
+ */
+void
+desc_string(const u_char *cur, char *buf, size_t size)
+{
+	size_t i, n = 0;
+
+	for (i = 2; i + 1 < cur[0] && n + 1 < size; i += 2) {
+		if (cur[i + 1] == 0 && cur[i] >= 0x20 && cur[i] < 0x7f)
+			buf[n++] = cur[i];
+		else
+			buf[n++] = '?';
+	}
+	buf[n] = '\0';
+}
+
+void
+print_string(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	char buf[USB_MAX_STRING_LEN];
+
+	desc_string(cur, buf, sizeof(buf));
+	ob_str(ob, "\t string: \"");
+	ob_str(ob, buf);
+	ob_str(ob, "\"\n");
+}
+
+void
+print_iad(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t iad: first_iface: ");
+	ob_dec(ob, cur[2], 2);
+	ob_str(ob, ", iface_count: ");
+	ob_dec(ob, cur[3], 2);
+	ob_str(ob, ", class: ");
+	ob_dec(ob, cur[4], 2);
+	ob_str(ob, ", subclass: ");
+	ob_dec(ob, cur[5], 2);
+	ob_str(ob, ", protocol: ");
+	ob_dec(ob, cur[6], 2);
+	ob_char(ob, '\n');
+}
+
+void
+print_bcd(struct obuf *ob, uint16_t bcd)
+{
+	ob_hex(ob, bcd >> 8, 0);
+	ob_char(ob, '.');
+	ob_hex(ob, bcd & 0xff, 2);
+}
+
+void
+print_hid(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	size_t i;
+
+	ob_str(ob, "\t hid: version: ");
+	print_bcd(ob, UGETW(cur + 2));
+	ob_str(ob, ", country: ");
+	ob_dec(ob, cur[4], 2);
+	for (i = 6; i < 6 + 3 * (size_t)cur[5] && i + 3 <= cur[0]; i += 3) {
+		if (cur[i] == HID_REPORT_DESC)
+			ob_str(ob, ", report_len: ");
+		else {
+			ob_str(ob, ", type 0x");
+			ob_hex(ob, cur[i], 2);
+			ob_str(ob, " len: ");
+		}
+		ob_dec(ob, UGETW(cur + i + 1), 0);
+	}
+	ob_char(ob, '\n');
+}
+
+/*
+ * The bytes of a descriptor ten to a line, as "unknown" always did.
+ */
+void
+print_bytes(struct obuf *ob, const u_char *cur)
+{
+	for (size_t i = 0; i < *cur; i++) {
+		if (i % 10 == 0)
+			ob_str(ob, "\n\t ");
+		ob_str(ob, "0x");
+		ob_hex(ob, *(cur + i), 2);
+		ob_char(ob, ' ');
+	}
+	ob_str(ob, "\n");
+}
+
+void
+print_class(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	size_t i;
+
+	ob_str(ob, cur[1] == CS_ENDPT_DESC ? "\t \t cs_endpoint: " :
+	    "\t cs_interface: ");
+	ob_str(ob, ud->name);
+	ob_str(ob, ", ");
+	ob_str(ob, ud->subname);
+
+	switch (ud->kind) {
+	case USBDEVS_DESC_CDC_HEADER:
+		ob_str(ob, ", version: ");
+		print_bcd(ob, UGETW(cur + 3));
+		ob_char(ob, '\n');
+		break;
+	case USBDEVS_DESC_CDC_UNION:
+		ob_str(ob, ", control: ");
+		ob_dec(ob, cur[3], 2);
+		ob_str(ob, ", subordinate:");
+		for (i = 4; i < cur[0]; i++) {
+			ob_char(ob, ' ');
+			ob_dec(ob, cur[i], 2);
+		}
+		ob_char(ob, '\n');
+		break;
+	default:
+		print_bytes(ob, cur);
+		break;
+	}
+}
+
+void
+print_sscomp(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t \t ss_companion: max_burst: ");
+	ob_dec(ob, cur[2], 0);
+	ob_str(ob, ", attributes: 0x");
+	ob_hex(ob, cur[3], 2);
+	ob_str(ob, ", bytes_per_interval: ");
+	ob_dec(ob, UGETW(cur + 4), 0);
+	ob_char(ob, '\n');
+}
+
+void
+print_bos(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t bos: total_length: ");
+	ob_dec(ob, UGETW(cur + 2), 0);
+	ob_str(ob, ", num_caps: ");
+	ob_dec(ob, cur[4], 0);
+	ob_char(ob, '\n');
+}
+
+void
+print_devcap(struct obuf *ob, const u_char *cur, const struct usbdevs_desc *ud)
+{
+	size_t i;
+
+	ob_str(ob, "\t capability: ");
+	ob_str(ob, ud->subname);
+	if (cur[2] == DEVCAP_USB2EXT && cur[0] >= 7) {
+		ob_str(ob, ", attributes: 0x");
+		ob_hex(ob, UGETDW(cur + 3), 8);
+	} else if (cur[2] == DEVCAP_SS && cur[0] >= 10) {
+		ob_str(ob, ", attributes: 0x");
+		ob_hex(ob, cur[3], 2);
+		ob_str(ob, ", speeds: 0x");
+		ob_hex(ob, UGETW(cur + 4), 4);
+		ob_str(ob, ", functionality: ");
+		ob_dec(ob, cur[6], 0);
+		ob_str(ob, ", u1_exit: ");
+		ob_dec(ob, cur[7], 0);
+		ob_str(ob, ", u2_exit: ");
+		ob_dec(ob, UGETW(cur + 8), 0);
+	} else if (cur[2] == DEVCAP_CONTAINER && cur[0] >= 20) {
+		ob_str(ob, ", container_id: ");
+		for (i = 4; i < 20; i++)
+			ob_hex(ob, cur[i], 2);
+	} else {
+		print_bytes(ob, cur);
+		return;
+	}
+	ob_char(ob, '\n');
+}
+
+void
+print_unknown(struct obuf *ob, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	ob_str(ob, "\t unknown: ");
+	ob_dec(ob, *(cur + 1), 2);
+	print_bytes(ob, cur);
+}
+
+void
+print_full(struct obuf *ob, struct usb_snap *us, struct usb_snap_config *uc)
+{
+	const struct usbdevs_desc *ud;
+	size_t i;
+
+	snap_decode(us, uc);
+	ob_str(ob, "addr ");
+	ob_dec(ob, us->addr, 2);
+	ob_str(ob, ", ");
+	for (i = 0; i < uc->ndescs; i++) {
+		ud = &uc->descs[i];
+		desc_shows[ud->kind].text(ob, uc->data + ud->off, ud);
+	}
+}
+
+/*
+ * Machine-readable output.  -o json writes one JSON object per line
+ * for every controller, device, configuration, interface, endpoint
+ * and stats sample; -o bin writes the fixed-layout records described
+ * in usbrec.h.  Both carry every field regardless of -v.
+ */
+void
+json_string(struct obuf *ob, const char *s, size_t max)
+{
+	static const char digits[] = "0123456789abcdef";
+	const u_char *p = (const u_char *)s;
+	size_t i;
+
+	ob_char(ob, '"');
+	for (i = 0; i < max && p[i] != '\0'; i++) {
+		switch (p[i]) {
+		case '"':
+			ob_str(ob, "\\\"");
+			break;
+		case '\\':
+			ob_str(ob, "\\\\");
+			break;
+		default:
+			if (p[i] >= 0x20 && p[i] < 0x7f) {
+				ob_char(ob, p[i]);
+				break;
+			}
+			/* Anything else is passed on as Latin-1. */
+			ob_str(ob, "\\u00");
+			ob_char(ob, digits[p[i] >> 4]);
+			ob_char(ob, digits[p[i] & 0xf]);
+			break;
+		}
+	}
+	ob_char(ob, '"');
+}
+
+void
+json_key(struct obuf *ob, const char *key)
+{
+	ob_str(ob, ",\"");
+	ob_str(ob, key);
+	ob_str(ob, "\":");
+}
+
+void
+json_uint(struct obuf *ob, const char *key, unsigned long long v)
+{
+	json_key(ob, key);
+	ob_dec(ob, v, 0);
+}
+
+void
+json_bool(struct obuf *ob, const char *key, int v)
+{
+	json_key(ob, key);
+	ob_str(ob, v ? "true" : "false");
+}
+
+void
+json_str(struct obuf *ob, const char *key, const char *s, size_t max)
+{
+	json_key(ob, key);
+	json_string(ob, s, max);
+}
+
+void
+json_begin(struct controller *uc, const char *type, uint8_t addr)
+{
+	ob_str(&uc->ob, "{\"type\":\"");
+	ob_str(&uc->ob, type);
+	ob_str(&uc->ob, "\",\"controller\":");
+	json_string(&uc->ob, uc->path, sizeof(uc->path));
+	if (addr)
+		json_uint(&uc->ob, "addr", addr);
+}
+
+void
+json_end(struct controller *uc)
+{
+	ob_str(&uc->ob, "}\n");
+}
+
+void
+json_device(struct controller *uc, struct usb_device_info *di)
+{
+	struct obuf *ob = &uc->ob;
+	int i, port, nports;
+	uint16_t status, change;
+
+	json_begin(uc, "device", di->udi_addr);
+	json_uint(ob, "vendorNo", UGETW(&di->udi_vendorNo));
+	json_uint(ob, "productNo", UGETW(&di->udi_productNo));
+	json_str(ob, "vendor", di->udi_vendor, sizeof(di->udi_vendor));
+	json_str(ob, "product", di->udi_product, sizeof(di->udi_product));
+	json_uint(ob, "bus", di->udi_bus);
+	json_key(ob, "speed");
+	if (speed_name(di->udi_speed) != NULL)
+		json_string(ob, speed_name(di->udi_speed), SIZE_MAX);
+	else
+		ob_str(ob, "null");
+	json_uint(ob, "power", UGETDW(&di->udi_power));
+	json_bool(ob, "self_powered", di->udi_power == 0);
+	json_uint(ob, "config", di->udi_config);
+	json_str(ob, "release", di->udi_release, sizeof(di->udi_release));
+	json_uint(ob, "releaseNo", UGETW(&di->udi_releaseNo));
+	json_uint(ob, "class", di->udi_class);
+	json_uint(ob, "subclass", di->udi_subclass);
+	json_uint(ob, "protocol", di->udi_protocol);
+	json_str(ob, "serial", di->udi_serial, sizeof(di->udi_serial));
+
+	json_key(ob, "drivers");
+	ob_char(ob, '[');
+	for (i = 0, nports = 0; i < USB_MAX_DEVNAMES; i++) {
+		if (di->udi_devnames[i][0] == '\0')
+			continue;
+		if (nports++)
+			ob_char(ob, ',');
+		json_string(ob, di->udi_devnames[i],
+		    sizeof(di->udi_devnames[i]));
+	}
+	ob_char(ob, ']');
+
+	json_key(ob, "ports");
+	ob_char(ob, '[');
+	nports = MINIMUM(UGETDW(&di->udi_nports), nitems(di->udi_ports));
+	for (port = 0; port < nports; port++) {
+		status = UGETDW(&di->udi_ports[port]) & 0xffff;
+		change = UGETDW(&di->udi_ports[port]) >> 16;
+
+		if (port)
+			ob_char(ob, ',');
+		ob_str(ob, "{\"port\":");
+		ob_dec(ob, port + 1, 0);
+		json_uint(ob, "status", status);
+		json_uint(ob, "change", change);
+		json_bool(ob, "connect", status & UPS_CURRENT_CONNECT_STATUS);
+		json_bool(ob, "enabled", status & UPS_PORT_ENABLED);
+		json_bool(ob, "suspend", status & UPS_SUSPEND);
+		json_bool(ob, "overcurrent",
+		    status & UPS_OVERCURRENT_INDICATOR);
+		if (di->udi_speed < USB_SPEED_SUPER) {
+			json_bool(ob, "l1", status & UPS_PORT_L1);
+			json_bool(ob, "power", status & UPS_PORT_POWER);
+		} else {
+			json_bool(ob, "power", status & UPS_PORT_POWER_SS);
+			json_key(ob, "link_state");
+			if (link_state_name(UPS_PORT_LS_GET(status)) != NULL)
+				json_string(ob, link_state_name(
+				    UPS_PORT_LS_GET(status)), SIZE_MAX);
+			else
+				ob_str(ob, "null");
+		}
+		ob_char(ob, '}');
+	}
+	ob_char(ob, ']');
+	json_end(uc);
+}
+
+void
+json_ddesc(struct controller *uc, struct usb_snap *us)
+{
+	usb_device_descriptor_t *dd = &us->ddd.udd_desc;
+
+	json_begin(uc, "ddesc", us->addr);
+	json_uint(&uc->ob, "bcdUSB", UGETW(dd->bcdUSB));
+	json_uint(&uc->ob, "class", dd->bDeviceClass);
+	json_uint(&uc->ob, "subclass", dd->bDeviceSubClass);
+	json_uint(&uc->ob, "protocol", dd->bDeviceProtocol);
+	json_uint(&uc->ob, "max_packet", dd->bMaxPacketSize);
+	json_uint(&uc->ob, "vendorNo", UGETW(dd->idVendor));
+	json_uint(&uc->ob, "productNo", UGETW(dd->idProduct));
+	json_uint(&uc->ob, "releaseNo", UGETW(dd->bcdDevice));
+	json_uint(&uc->ob, "iManufacturer", dd->iManufacturer);
+	json_uint(&uc->ob, "iProduct", dd->iProduct);
+	json_uint(&uc->ob, "iSerialNumber", dd->iSerialNumber);
+	json_uint(&uc->ob, "num_configs", dd->bNumConfigurations);
+	json_end(uc);
+}
+
+void
+json_config(struct controller *uc, struct usb_snap *us,
+    usb_config_descriptor_t *cd)
+{
+	json_begin(uc, "config", us->addr);
+	json_uint(&uc->ob, "config", cd->bConfigurationValue);
+	json_uint(&uc->ob, "interfaces", cd->bNumInterfaces);
+	json_uint(&uc->ob, "max_power", cd->bMaxPower * UC_POWER_FACTOR);
+	json_uint(&uc->ob, "attributes", cd->bmAttributes);
+	json_bool(&uc->ob, "bus_powered", cd->bmAttributes & UC_BUS_POWERED);
+	json_bool(&uc->ob, "self_powered",
+	    cd->bmAttributes & UC_SELF_POWERED);
+	json_bool(&uc->ob, "remote_wakeup",
+	    cd->bmAttributes & UC_REMOTE_WAKEUP);
+	json_uint(&uc->ob, "total_length", UGETW(cd->wTotalLength));
+	json_end(uc);
+}
+
+/*
+ * Every descriptor record says which configuration it came from, and
+ * those inside an interface which interface and alternate setting.
+ */
+void
+json_desc_begin(struct controller *uc, struct usb_snap *us,
+    const struct usbdevs_desc *ud, const char *type)
+{
+	json_begin(uc, type, us->addr);
+	json_uint(&uc->ob, "config", ud->config);
+	if (ud->nested) {
+		json_uint(&uc->ob, "iface", ud->iface);
+		json_uint(&uc->ob, "altset", ud->altset);
+	}
+}
+
+void
+json_bytes(struct obuf *ob, const char *key, const u_char *p, size_t len)
+{
+	size_t i;
+
+	json_key(ob, key);
+	ob_char(ob, '"');
+	for (i = 0; i < len; i++)
+		ob_hex(ob, p[i], 2);
+	ob_char(ob, '"');
+}
+
+void
+json_bcd(struct obuf *ob, const char *key, uint16_t bcd)
+{
+	json_key(ob, key);
+	ob_char(ob, '"');
+	print_bcd(ob, bcd);
+	ob_char(ob, '"');
+}
+
+void
+json_fconfig(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	json_config(uc, us, (usb_config_descriptor_t *)cur);
+}
+
+void
+json_string_desc(struct controller *uc, struct usb_snap *us,
+    const u_char *cur, const struct usbdevs_desc *ud)
+{
+	char buf[USB_MAX_STRING_LEN];
+
+	desc_string(cur, buf, sizeof(buf));
+	json_desc_begin(uc, us, ud, "string");
+	json_str(&uc->ob, "string", buf, SIZE_MAX);
+	json_end(uc);
+}
+
+void
+json_iface(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+
+	json_begin(uc, "interface", us->addr);
+	json_uint(ob, "config", ud->config);
+	json_uint(ob, "iface", ud->iface);
+	json_uint(ob, "altset", ud->altset);
+	json_uint(ob, "numendpts", cur[4]);
+	json_uint(ob, "class", cur[5]);
+	json_uint(ob, "subclass", cur[6]);
+	json_uint(ob, "protocol", cur[7]);
+	json_end(uc);
+}
+
+void
+json_endpt(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+
+	json_begin(uc, "endpoint", us->addr);
+	json_uint(ob, "config", ud->config);
+	json_uint(ob, "iface", ud->iface);
+	json_uint(ob, "altset", ud->altset);
+	json_uint(ob, "endpt_addr", cur[2] & 0x0f);
+	json_str(ob, "dir", cur[2] & 0x80 ? "in" : "out", SIZE_MAX);
+	json_str(ob, "transfer", xfer_names[cur[3] & 0x3], SIZE_MAX);
+	if ((cur[3] & 0x3) == 1)
+		json_str(ob, "sync_type", sync_names[(cur[3] >> 2) & 0x3],
+		    SIZE_MAX);
+	json_uint(ob, "max_packet", UGETW(cur + 4));
+	json_uint(ob, "polling_interval", cur[6]);
+	json_end(uc);
+}
+
+void
+json_iad(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+
+	json_desc_begin(uc, us, ud, "iad");
+	json_uint(ob, "first_iface", cur[2]);
+	json_uint(ob, "iface_count", cur[3]);
+	json_uint(ob, "class", cur[4]);
+	json_uint(ob, "subclass", cur[5]);
+	json_uint(ob, "protocol", cur[6]);
+	json_end(uc);
+}
+
+void
+json_hid(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+	size_t i;
+
+	json_desc_begin(uc, us, ud, "hid");
+	json_bcd(ob, "version", UGETW(cur + 2));
+	json_uint(ob, "country", cur[4]);
+	for (i = 6; i < 6 + 3 * (size_t)cur[5] && i + 3 <= cur[0]; i += 3)
+		if (cur[i] == HID_REPORT_DESC) {
+			json_uint(ob, "report_len", UGETW(cur + i + 1));
+			break;
+		}
+	json_end(uc);
+}
+
+void
+json_class(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+	size_t i;
+
+	json_desc_begin(uc, us, ud, cur[1] == CS_ENDPT_DESC ?
+	    "cs_endpoint" : "cs_interface");
+	json_str(ob, "class", ud->name, SIZE_MAX);
+	json_uint(ob, "subtype", cur[2]);
+	json_str(ob, "name", ud->subname, SIZE_MAX);
+	switch (ud->kind) {
+	case USBDEVS_DESC_CDC_HEADER:
+		json_bcd(ob, "version", UGETW(cur + 3));
+		break;
+	case USBDEVS_DESC_CDC_UNION:
+		json_uint(ob, "control", cur[3]);
+		json_key(ob, "subordinate");
+		ob_char(ob, '[');
+		for (i = 4; i < cur[0]; i++) {
+			if (i > 4)
+				ob_char(ob, ',');
+			ob_dec(ob, cur[i], 0);
+		}
+		ob_char(ob, ']');
+		break;
+	}
+	json_bytes(ob, "data", cur, cur[0]);
+	json_end(uc);
+}
+
+void
+json_sscomp(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+
+	json_desc_begin(uc, us, ud, "ss_companion");
+	json_uint(ob, "max_burst", cur[2]);
+	json_uint(ob, "attributes", cur[3]);
+	json_uint(ob, "bytes_per_interval", UGETW(cur + 4));
+	json_end(uc);
+}
+
+void
+json_bos(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	json_desc_begin(uc, us, ud, "bos");
+	json_uint(&uc->ob, "total_length", UGETW(cur + 2));
+	json_uint(&uc->ob, "num_caps", cur[4]);
+	json_end(uc);
+}
+
+void
+json_devcap(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	struct obuf *ob = &uc->ob;
+
+	json_desc_begin(uc, us, ud, "capability");
+	json_uint(ob, "cap_type", cur[2]);
+	json_str(ob, "name", ud->subname, SIZE_MAX);
+	if (cur[2] == DEVCAP_USB2EXT && cur[0] >= 7) {
+		json_uint(ob, "attributes", UGETDW(cur + 3));
+		json_bool(ob, "lpm", UGETDW(cur + 3) & 0x2);
+	} else if (cur[2] == DEVCAP_SS && cur[0] >= 10) {
+		json_uint(ob, "attributes", cur[3]);
+		json_uint(ob, "speeds", UGETW(cur + 4));
+		json_uint(ob, "functionality", cur[6]);
+		json_uint(ob, "u1_exit", cur[7]);
+		json_uint(ob, "u2_exit", UGETW(cur + 8));
+	} else if (cur[2] == DEVCAP_CONTAINER && cur[0] >= 20)
+		json_bytes(ob, "container_id", cur + 4, 16);
+	json_bytes(ob, "data", cur, cur[0]);
+	json_end(uc);
+}
+
+void
+json_unknown(struct controller *uc, struct usb_snap *us, const u_char *cur,
+    const struct usbdevs_desc *ud)
+{
+	json_begin(uc, "descriptor", us->addr);
+	json_uint(&uc->ob, "config", ud->config);
+	json_uint(&uc->ob, "dtype", cur[1]);
+	json_bytes(&uc->ob, "data", cur, cur[0]);
+	json_end(uc);
+}
+
+void
+json_full(struct controller *uc, struct usb_snap *us,
+    struct usb_snap_config *sc)
+{
+	const struct usbdevs_desc *ud;
+	size_t i;
+
+	snap_decode(us, sc);
+	for (i = 0; i < sc->ndescs; i++) {
+		ud = &sc->descs[i];
+		desc_shows[ud->kind].json(uc, us, sc->data + ud->off, ud);
+	}
+}
+
+void
+json_stats(struct controller *uc, struct usb_device_stats *ds,
+    struct usb_device_stats *prev, double secs)
+{
+	size_t i;
+
+	json_begin(uc, prev ? "rates" : "stats", 0);
+	for (i = 0; i < nitems(ds->uds_requests); i++) {
+		if (prev == NULL) {
+			json_uint(&uc->ob, xfer_names[i], ds->uds_requests[i]);
+			continue;
+		}
+		json_key(&uc->ob, xfer_names[i]);
+		ob_printf(&uc->ob, "{\"delta\":%lu,\"rate\":%.1f}",
+		    ds->uds_requests[i] - prev->uds_requests[i],
+		    (ds->uds_requests[i] - prev->uds_requests[i]) / secs);
+	}
+	json_end(uc);
+}
+
+void
+bin_hdr(struct controller *uc, void *rec, size_t size, int type,
+    uint8_t addr)
+{
+	struct usbrec_hdr *hdr = rec;
+
+	memset(rec, 0, size);
+	hdr->type = type;
+	hdr->size = size;
+	hdr->ctlr = uc->unit;
+	hdr->addr = addr;
+}
+
+void
+bin_file(struct obuf *ob)
+{
+	struct usbrec_file rf;
+
+	memset(&rf, 0, sizeof(rf));
+	rf.magic = USBREC_MAGIC;
+	rf.version = USBREC_VERSION;
+	rf.size = sizeof(rf);
+	ob_write(ob, &rf, sizeof(rf));
+}
+
+void
+bin_device(struct controller *uc, struct usb_device_info *di)
+{
+	struct usbrec_device rd;
+	int i;
+
+	bin_hdr(uc, &rd, sizeof(rd), USBREC_DEVICE, di->udi_addr);
+	rd.vendorNo = UGETW(&di->udi_vendorNo);
+	rd.productNo = UGETW(&di->udi_productNo);
+	rd.releaseNo = UGETW(&di->udi_releaseNo);
+	rd.bus = di->udi_bus;
+	rd.class = di->udi_class;
+	rd.subclass = di->udi_subclass;
+	rd.protocol = di->udi_protocol;
+	rd.config = di->udi_config;
+	rd.speed = di->udi_speed;
+	rd.power = UGETDW(&di->udi_power);
+	rd.nports = MINIMUM(UGETDW(&di->udi_nports), USBREC_NPORTS);
+	for (i = 0; i < (int)rd.nports; i++)
+		rd.ports[i] = UGETDW(&di->udi_ports[i]);
+	strlcpy(rd.vendor, di->udi_vendor, sizeof(rd.vendor));
+	strlcpy(rd.product, di->udi_product, sizeof(rd.product));
+	strlcpy(rd.serial, di->udi_serial, sizeof(rd.serial));
+	strlcpy(rd.release, di->udi_release, sizeof(rd.release));
+	for (i = 0; i < USB_MAX_DEVNAMES && i < USBREC_NDEVNAMES; i++)
+		strlcpy(rd.devnames[i], di->udi_devnames[i],
+		    sizeof(rd.devnames[i]));
+	ob_write(&uc->ob, &rd, sizeof(rd));
+}
+
+void
+bin_full(struct controller *uc, struct usb_snap *us,
+    struct usb_snap_config *sc)
+{
+	struct usbrec_config rc;
+	struct usbrec_iface ri;
+	struct usbrec_endpt re;
+	struct usbrec_desc rx;
+	const struct usbdevs_desc *ud;
+	const u_char *cur;
+	size_t i;
+
+	snap_decode(us, sc);
+	for (i = 0; i < sc->ndescs; i++) {
+		ud = &sc->descs[i];
+		cur = sc->data + ud->off;
+		switch (ud->kind) {
+		case USBDEVS_DESC_CONFIG:
+			bin_hdr(uc, &rc, sizeof(rc), USBREC_CONFIG, us->addr);
+			memcpy(rc.desc, cur, sizeof(rc.desc));
+			ob_write(&uc->ob, &rc, sizeof(rc));
+			break;
+		case USBDEVS_DESC_IFACE:
+			bin_hdr(uc, &ri, sizeof(ri), USBREC_IFACE, us->addr);
+			ri.config = ud->config;
+			ri.iface = ud->iface;
+			ri.altset = ud->altset;
+			ri.numendpts = cur[4];
+			ri.class = cur[5];
+			ri.subclass = cur[6];
+			ri.protocol = cur[7];
+			ob_write(&uc->ob, &ri, sizeof(ri));
+			break;
+		case USBDEVS_DESC_ENDPT:
+			bin_hdr(uc, &re, sizeof(re), USBREC_ENDPT, us->addr);
+			re.config = ud->config;
+			re.iface = ud->iface;
+			re.altset = ud->altset;
+			re.address = cur[2];
+			re.attributes = cur[3];
+			re.maxpacket = UGETW(cur + 4);
+			re.interval = cur[6];
+			ob_write(&uc->ob, &re, sizeof(re));
+			break;
+		default:
+			bin_hdr(uc, &rx, sizeof(rx), USBREC_DESC, us->addr);
+			rx.config = ud->config;
+			rx.len = MINIMUM(cur[0], sizeof(rx.data));
+			memcpy(rx.data, cur, rx.len);
+			ob_write(&uc->ob, &rx, sizeof(rx));
+			break;
+		}
+	}
+}
+
+void
+bin_stats(struct controller *uc, struct usb_device_stats *ds, int64_t ns)
+{
+	struct usbrec_stats rs;
+	size_t i;
+
+	bin_hdr(uc, &rs, sizeof(rs), USBREC_STATS, 0);
+	rs.ns = ns;
+	for (i = 0; i < nitems(rs.requests); i++)
+		rs.requests[i] = ds->uds_requests[i];
+	ob_write(&uc->ob, &rs, sizeof(rs));
+}
+
+/*
+ * Start a controller's output: the header line, object or record.
+ */
+void
+render_controller(struct controller *uc)
+{
+	struct usbrec_controller rc;
+
+	switch (oformat) {
+	case OFMT_TEXT:
+		ob_str(&uc->ob, "Controller ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, ":\n");
+		break;
+	case OFMT_JSON:
+		json_begin(uc, "controller", 0);
+		json_end(uc);
+		break;
+	case OFMT_BIN:
+		bin_hdr(uc, &rc, sizeof(rc), USBREC_CONTROLLER, 0);
+		strlcpy(rc.path, uc->path, sizeof(rc.path));
+		ob_write(&uc->ob, &rc, sizeof(rc));
+		break;
+	}
+}
+
+/*
+ * Announce a hotplug change; the device itself follows.
+ */
+void
+render_event(struct controller *uc, int attach, struct usb_snap *us)
+{
+	struct usbrec_hdr rh;
+
+	switch (oformat) {
+	case OFMT_TEXT:
+		ob_str(&uc->ob, attach ? "attach " : "detach ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, ":\n");
+		break;
+	case OFMT_JSON:
+		json_begin(uc, attach ? "attach" : "detach", us->addr);
+		json_end(uc);
+		break;
+	case OFMT_BIN:
+		bin_hdr(uc, &rh, sizeof(rh),
+		    attach ? USBREC_ATTACH : USBREC_DETACH, us->addr);
+		ob_write(&uc->ob, &rh, sizeof(rh));
+		break;
+	}
+}
+
+void
+render_info(struct controller *uc, struct usb_device_info *di)
+{
+	switch (oformat) {
+	case OFMT_TEXT:
+		dump_device(&uc->ob, di);
+		break;
+	case OFMT_JSON:
+		json_device(uc, di);
+		break;
+	case OFMT_BIN:
+		bin_device(uc, di);
+		break;
+	}
+}
+
+/*
+ * Note that -t cut a device short, or with addr 0 the whole controller.
+ */
+void
+render_timeout(struct controller *uc, uint8_t addr)
+{
+	struct usbrec_hdr rh;
+
+	switch (oformat) {
+	case OFMT_TEXT:
+		if (addr) {
+			ob_str(&uc->ob, "addr ");
+			ob_dec(&uc->ob, addr, 2);
+			ob_str(&uc->ob, ": timed out\n");
+		} else
+			ob_str(&uc->ob, "deadline reached\n");
+		break;
+	case OFMT_JSON:
+		json_begin(uc, "timeout", addr);
+		json_end(uc);
+		break;
+	case OFMT_BIN:
+		bin_hdr(uc, &rh, sizeof(rh), USBREC_TIMEOUT, addr);
+		ob_write(&uc->ob, &rh, sizeof(rh));
+		break;
+	}
+}
+
+/*
+ * One field of a device that is not what the -x baseline says; old and
+ * new are NULL for descriptors that merely differ.
+ */
+void
+render_change(struct controller *uc, uint8_t addr, const char *field,
+    const char *old, const char *new)
+{
+	struct usbrec_change rc;
+	char vv[USBREC_STRLEN * 4];
+
+	switch (oformat) {
+	case OFMT_TEXT:
+		ob_str(&uc->ob, "change ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, " addr ");
+		ob_dec(&uc->ob, addr, 2);
+		ob_str(&uc->ob, ": ");
+		ob_str(&uc->ob, field);
+		if (old != NULL) {
+			strvis(vv, old, VIS_CSTYLE);
+			ob_char(&uc->ob, ' ');
+			ob_str(&uc->ob, vv);
+			strvis(vv, new, VIS_CSTYLE);
+			ob_str(&uc->ob, " -> ");
+			ob_str(&uc->ob, vv);
+		}
+		ob_char(&uc->ob, '\n');
+		break;
+	case OFMT_JSON:
+		json_begin(uc, "change", addr);
+		json_str(&uc->ob, "field", field, USBREC_NAMELEN);
+		if (old != NULL) {
+			json_str(&uc->ob, "old", old, USBREC_STRLEN);
+			json_str(&uc->ob, "new", new, USBREC_STRLEN);
+		}
+		json_end(uc);
+		break;
+	case OFMT_BIN:
+		bin_hdr(uc, &rc, sizeof(rc), USBREC_CHANGE, addr);
+		strlcpy(rc.field, field, sizeof(rc.field));
+		if (old != NULL) {
+			strlcpy(rc.old, old, sizeof(rc.old));
+			strlcpy(rc.new, new, sizeof(rc.new));
+		}
+		ob_write(&uc->ob, &rc, sizeof(rc));
+		break;
+	}
+}
+
+/*
+ * Render every requested view of a device from its snapshot, and
+ * whether that is all there is.
+ */
+void
+snap_render(struct controller *uc, struct usb_snap *us)
+{
+	struct dump_args *da = uc->da;
+	struct usb_snap_config *sc;
+	struct usbrec_ddesc rd;
+	int command = da->command, i;
+
+	if (us->flags & SNAP_SKIP)
+		return;
+	if ((command & COMM_INFO) && (us->flags & SNAP_INFO))
+		render_info(uc, &us->di);
+	if ((command & COMM_DDSC) && (us->flags & SNAP_DDESC)) {
+		if (oformat == OFMT_JSON)
+			json_ddesc(uc, us);
+		else if (oformat == OFMT_BIN) {
+			bin_hdr(uc, &rd, sizeof(rd), USBREC_DDESC, us->addr);
+			memcpy(rd.desc, &us->ddd.udd_desc, sizeof(rd.desc));
+			ob_write(&uc->ob, &rd, sizeof(rd));
+		} else
+			print_device(&uc->ob, us);
+	}
+	if (command & (COMM_CDSC | COMM_FDSC)) {
+		if (da->config != CONFIG_ALL) {
+			if ((sc = snap_find(us, da->config)) != NULL)
+				snap_render_config(uc, us, sc);
+		} else
+			for (i = 0; i < us->nconfigs; i++)
+				snap_render_config(uc, us,
+				    &us->configs[i]);
+	}
+	if (us->flags & SNAP_TIMEDOUT)
+		render_timeout(uc, us->addr);
+}
+
+void
+snap_render_config(struct controller *uc, struct usb_snap *us,
+    struct usb_snap_config *sc)
+{
+	struct usbrec_config rc;
+	int command = uc->da->command;
+
+	/* The full descriptor set starts with the configuration. */
+	if ((command & COMM_CDSC) && (sc->flags & SNAP_CDESC) &&
+	    (oformat == OFMT_TEXT || !(command & COMM_FDSC))) {
+		if (oformat == OFMT_JSON)
+			json_config(uc, us, &sc->cd.udc_desc);
+		else if (oformat == OFMT_BIN) {
+			bin_hdr(uc, &rc, sizeof(rc), USBREC_CONFIG, us->addr);
+			memcpy(rc.desc, &sc->cd.udc_desc, sizeof(rc.desc));
+			ob_write(&uc->ob, &rc, sizeof(rc));
+		} else
+			print_config(&uc->ob, us, sc);
+	}
+	if ((command & COMM_FDSC) && (sc->flags & SNAP_FDESC)) {
+		if (oformat == OFMT_JSON)
+			json_full(uc, us, sc);
+		else if (oformat == OFMT_BIN)
+			bin_full(uc, us, sc);
+		else
+			print_full(&uc->ob, us, sc);
+	}
+}
+
+struct usb_snap *
+snap_new(uint8_t addr)
+{
+	struct usb_snap *us;
+
+	if ((us = calloc(1, sizeof(*us))) == NULL)
+		err(trouble, NULL);
+	us->addr = addr;
+	return us;
+}
+
+/*
+ * Make us the controller's current snapshot of its address, replacing
+ * whatever was known about that address before.
+ */
+void
+snap_store(struct controller *uc, struct usb_snap *us)
+{
+	struct usb_snap *old = uc->devs[us->addr];
+
+	/* Table first, so a compaction carries the new snapshot along. */
+	uc->devs[us->addr] = us;
+	if (old != NULL)
+		devname_del(uc, old);
+	devname_add(uc, us);
+	if (old != NULL) {
+		snap_free(&uc->ar, old);
+		free(old);
+		snap_compact(uc);
+	}
+}
+
+void
+snap_drop(struct controller *uc, uint8_t addr)
+{
+	if (uc->devs[addr] == NULL)
+		return;
+	devname_del(uc, uc->devs[addr]);
+	snap_free(&uc->ar, uc->devs[addr]);
+	free(uc->devs[addr]);
+	uc->devs[addr] = NULL;
+	snap_compact(uc);
+}
+
+/*
+ * A fresh USB_DEVICEINFO for a device in the table.  Drivers come and
+ * go on a device that stays, so the names are indexed again whenever
+ * they changed.
+ */
+void
+snap_reinfo(struct controller *uc, struct usb_snap *us,
+    struct usb_device_info *di)
+{
+	if (memcmp(us->di.udi_devnames, di->udi_devnames,
+	    sizeof(di->udi_devnames)) == 0) {
+		us->di = *di;
+		return;
+	}
+	devname_del(uc, us);
+	us->di = *di;
+	devname_add(uc, us);
+}
+
+/*
+ * Every driver name of the snapshots in the table, hashed to its
+ * address, so that -D and hotplug(4) events find a device without
+ * looking at all of them.  Each controller has its own, touched only
+ * by whoever fills its table.
+ */
+u_int
+devname_hash(const char *name)
+{
+	u_int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < USB_MAX_DEVNAMELEN && name[i] != '\0'; i++)
+		h = (h ^ (u_char)name[i]) * 16777619U;
+	return h % DEVNAME_BUCKETS;
+}
+
+void
+devname_add(struct controller *uc, struct usb_snap *us)
+{
+	struct devname *dn;
+	const char *name;
+	u_int h;
+	int n;
+
+	if (!(us->flags & SNAP_INFO))
+		return;
+	for (n = 0; n < USB_MAX_DEVNAMES; n++) {
+		name = us->di.udi_devnames[n];
+		if (name[0] == '\0')
+			continue;
+		if ((dn = malloc(sizeof(*dn))) == NULL)
+			err(trouble, NULL);
+		dn->addr = us->addr;
+		memcpy(dn->name, name, sizeof(dn->name));
+		h = devname_hash(name);
+		dn->next = uc->names[h];
+		uc->names[h] = dn;
+	}
+}
+
+void
+devname_del(struct controller *uc, struct usb_snap *us)
+{
+	struct devname *dn, **dnp;
+	const char *name;
+	int n;
+
+	if (!(us->flags & SNAP_INFO))
+		return;
+	for (n = 0; n < USB_MAX_DEVNAMES; n++) {
+		name = us->di.udi_devnames[n];
+		if (name[0] == '\0')
+			continue;
+		for (dnp = &uc->names[devname_hash(name)]; (dn = *dnp) != NULL;
+		    dnp = &dn->next) {
+			if (dn->addr == us->addr &&
+			    strncmp(dn->name, name, sizeof(dn->name)) == 0) {
+				*dnp = dn->next;
+				free(dn);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Move every live descriptor into a fresh arena once more than a
+ * chunk's worth of the old one is garbage, as happens when devices
+ * keep coming and going under -H.
+ */
+void
+snap_compact(struct controller *uc)
+{
+	struct arena ar;
+	struct usb_snap *us;
+	struct usb_snap_config *sc;
+	u_char *p;
+	int addr, i;
+
+	if (uc->ar.used - uc->ar.live < ARENA_CHUNK)
+		return;
+
+	memset(&ar, 0, sizeof(ar));
+	ar.maxfetch = uc->ar.maxfetch;
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if ((us = uc->devs[addr]) == NULL)
+			continue;
+		for (i = 0; i < us->nconfigs; i++) {
+			sc = &us->configs[i];
+			if (sc->data == NULL)
+				continue;
+			p = arena_alloc(&ar, sc->len);
+			memcpy(p, sc->data, sc->len);
+			sc->data = p;
+		}
+	}
+	arena_free(&uc->ar);
+	uc->ar = ar;
+}
+
+void
+walk_snap(int fd, int addr, struct usb_device_info *di, void *arg)
+{
+	struct controller *uc = arg;
+	struct dump_args *da = uc->da;
+	struct usb_snap *us;
+
+	us = snap_new(addr);
+	if (di == NULL) {
+		warn("addr %u", addr);
+		us->flags = SNAP_UNREADABLE;
+		snap_store(uc, us);
+		return;
+	}
+	us->di = *di;
+	us->flags = SNAP_INFO;
+	snap_fill(fd, &uc->ar, us, da->command, da->config);
+	if (!da->quiet)
+		snap_render(uc, us);
+	snap_store(uc, us);
+	ob_check(&uc->ob);
+}
+
+int
+get_stats(char *name, int fd, struct usb_device_stats *ds)
+{
+	if (usbdevs_stats(fd, ds) == -1) {
+		if (errno != ENXIO)
+			warn("controller %s", name);
+		return -1;
+	}
+	return 0;
+}
+
+void
+print_stats(struct controller *uc)
+{
+	struct usb_device_stats ds;
+
+	if (get_stats(uc->path, uc->fd, &ds) == -1)
+		return;
+	render_stats(uc, &ds, mono_ns());
+}
+
+void
+render_stats(struct controller *uc, struct usb_device_stats *ds, int64_t ns)
+{
+	struct obuf *ob = &uc->ob;
+
+	if (oformat == OFMT_JSON) {
+		json_stats(uc, ds, NULL, 0);
+		return;
+	} else if (oformat == OFMT_BIN) {
+		bin_stats(uc, ds, ns);
+		return;
+	}
+
+	ob_str(ob, "\t Transfers completed:");
+	ob_str(ob, "\n\t Control: ");
+	ob_dec(ob, ds->uds_requests[0], 0);
+	ob_str(ob, "\n\t Isochronous: ");
+	ob_dec(ob, ds->uds_requests[1], 0);
+	ob_str(ob, "\n\t Bulk: ");
+	ob_dec(ob, ds->uds_requests[2], 0);
+	ob_str(ob, "\n\t Interrupt: ");
+	ob_dec(ob, ds->uds_requests[3], 0);
+	ob_char(ob, '\n');
+}
+
+int64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(trouble, "clock_gettime");
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Take one USB_DEVICESTATS sample and print what changed since the
+ * previous one, as counts and as transfers per second.
+ */
+void
+watch_sample(struct controller *uc)
+{
+	struct obuf *ob = &uc->ob;
+	struct usb_device_stats ds;
+	int64_t now;
+	double secs;
+	u_long delta;
+	size_t i;
+
+	if (get_stats(uc->path, uc->fd, &ds) == -1)
+		return;
+	now = mono_ns();
+
+	if (oformat == OFMT_BIN)
+		bin_stats(uc, &ds, now);
+	else if (uc->stats_ns != 0 && oformat == OFMT_JSON) {
+		secs = (double)(now - uc->stats_ns) / NSEC_PER_SEC;
+		json_stats(uc, &ds, &uc->stats, secs);
+	} else if (uc->stats_ns != 0) {
+		secs = (double)(now - uc->stats_ns) / NSEC_PER_SEC;
+		ob_str(ob, uc->path);
+		ob_char(ob, ':');
+		for (i = 0; i < nitems(ds.uds_requests); i++) {
+			delta = ds.uds_requests[i] - uc->stats.uds_requests[i];
+			ob_printf(ob, "%s %s %lu %.1f/s", i ? "," : "",
+			    xfer_names[i], delta, delta / secs);
+		}
+		ob_char(ob, '\n');
+	}
+
+	uc->stats = ds;
+	uc->stats_ns = now;
+}
+
+void
+watch_stats(struct controller *ctl, int ncont)
+{
+	struct kevent kev;
+	int64_t interval, start, next, now;
+	long long ticks;
+	int kq, i;
+
+	if (ncont == 0)
+		return;
+	interval = ctl[0].da->interval;
+
+	if ((kq = kqueue()) == -1)
+		err(trouble, "kqueue");
+
+	if (bursts) {
+		/* SIGINFO asks for the ring as it stands. */
+		signal(SIGINFO, SIG_IGN);
+		EV_SET(&kev, SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1)
+			err(trouble, "kevent");
+		for (i = 0; i < ncont; i++)
+			if ((ctl[i].ring = calloc(1, sizeof(*ctl[i].ring))) ==
+			    NULL)
+				err(trouble, NULL);
+	}
+
+	for (i = 0; i < ncont; i++) {
+		if (bursts)
+			burst_sample(&ctl[i]);
+		else
+			watch_sample(&ctl[i]);
+	}
+	start = mono_ns();
+
+	/*
+	 * Every deadline is start + n * interval instead of being relative
+	 * to the previous wakeup, so timer latency never accumulates into
+	 * drift.  Deadlines that were missed altogether are skipped.
+	 */
+	for (ticks = 1;; ticks++) {
+		now = mono_ns();
+		next = start + ticks * interval;
+		if (next <= now) {
+			ticks = (now - start) / interval + 1;
+			next = start + ticks * interval;
+		}
+
+		EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+		    (next - now + 999999) / 1000000, NULL);
+		if (kevent(kq, &kev, 1, &kev, 1, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "kevent");
+		}
+
+		if (kev.filter == EVFILT_SIGNAL) {
+			for (i = 0; i < ncont; i++) {
+				burst_dump(&ctl[i]);
+				ob_flush(&ctl[i].ob);
+			}
+			/* Not a tick; the same deadline is waited for again. */
+			ticks--;
+			continue;
+		}
+		for (i = 0; i < ncont; i++) {
+			if (bursts)
+				burst_sample(&ctl[i]);
+			else
+				watch_sample(&ctl[i]);
+			ob_flush(&ctl[i].ob);
+		}
+	}
+}
+
+/*
+ * -r keeps the last STATS_RING samples of each controller in a ring
+ * allocated up front, so that even at 1 kHz a sample costs one
+ * USB_DEVICESTATS and a comparison per type, and nothing is printed
+ * unless a burst begins or ends.  A burst is a run of samples whose
+ * rate since the one before is over the threshold of its type.  When
+ * one begins, its first rate is reported right away, followed by the
+ * percentiles of every type over the samples leading up to it; when it
+ * ends, how long it lasted and its peak, followed by the same over the
+ * lead and the burst together, which shows what else was busy at the
+ * same time.
+ * SIGINFO reports the whole ring the same way, along with the bursts
+ * still going on.
+ */
+double
+ring_rate(struct stats_ring *sr, uint64_t n, size_t type)
+{
+	struct stats_sample *cur = &sr->s[n % STATS_RING];
+	struct stats_sample *prev = &sr->s[(n - 1) % STATS_RING];
+
+	if (cur->ns <= prev->ns)
+		return 0;
+	return (double)(cur->ds.uds_requests[type] -
+	    prev->ds.uds_requests[type]) * NSEC_PER_SEC / (cur->ns - prev->ns);
+}
+
+/*
+ * The slot the next sample goes to is not counted: a failed ioctl may
+ * have left it half written.
+ */
+uint64_t
+ring_oldest(struct stats_ring *sr)
+{
+	return sr->n >= STATS_RING ? sr->n - STATS_RING + 1 : 0;
+}
+
+int
+rate_cmp(const void *a, const void *b)
+{
+	double ra = *(const double *)a, rb = *(const double *)b;
+
+	return ra < rb ? -1 : ra > rb;
+}
+
+void
+burst_sample(struct controller *uc)
+{
+	struct stats_ring *sr = uc->ring;
+	struct stats_sample *ss = &sr->s[sr->n % STATS_RING];
+	uint64_t n = sr->n, lo;
+	double rate;
+	size_t i;
+
+	if (get_stats(uc->path, uc->fd, &ss->ds) == -1)
+		return;
+	ss->ns = mono_ns();
+	if (sr->n++ == 0)
+		return;
+
+	for (i = 0; i < XFER_TYPES; i++) {
+		if (burst_rates[i] == 0)
+			continue;
+		rate = ring_rate(sr, n, i);
+		if (rate > burst_rates[i]) {
+			if (sr->from[i] == 0) {
+				sr->from[i] = n;
+				sr->since[i] = sr->s[(n - 1) % STATS_RING].ns;
+				sr->peak[i] = 0;
+				burst_begin(uc, i, rate);
+				lo = n - 1;
+				lo -= MINIMUM(lo, BURST_LEAD);
+				window_render(uc, MAXIMUM(lo, ring_oldest(sr)),
+				    n);
+			}
+			sr->peak[i] = MAXIMUM(sr->peak[i], rate);
+			continue;
+		}
+		if (sr->from[i] == 0)
+			continue;
+		burst_render(uc, i, n - 1, 0);
+		lo = sr->from[i] - 1;
+		lo -= MINIMUM(lo, BURST_LEAD);
+		window_render(uc, MAXIMUM(lo, ring_oldest(sr)), n);
+		sr->from[i] = 0;
+	}
+}
+
+void
+burst_dump(struct controller *uc)
+{
+	struct stats_ring *sr = uc->ring;
+	size_t i;
+
+	if (sr == NULL || sr->n < 2)
+		return;
+	for (i = 0; i < XFER_TYPES; i++)
+		if (sr->from[i] != 0)
+			burst_render(uc, i, sr->n - 1, 1);
+	window_render(uc, ring_oldest(sr), sr->n - 1);
+}
+
+/*
+ * A burst of one type that has just gone over its threshold at rate.
+ */
+void
+burst_begin(struct controller *uc, size_t type, double rate)
+{
+	struct obuf *ob = &uc->ob;
+
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, "burst_begin", 0);
+		json_str(ob, "transfer", xfer_names[type], SIZE_MAX);
+		json_key(ob, "rate");
+		ob_printf(ob, "%.1f", rate);
+		json_uint(ob, "threshold", burst_rates[type]);
+		json_end(uc);
+		return;
+	}
+	ob_printf(ob, "%s: %s burst begins, %.1f/s over %lld/s\n",
+	    uc->path, xfer_names[type], rate, burst_rates[type]);
+}
+
+/*
+ * A burst of one type whose last sample over the threshold is last.
+ */
+void
+burst_render(struct controller *uc, size_t type, uint64_t last, int ongoing)
+{
+	struct stats_ring *sr = uc->ring;
+	struct obuf *ob = &uc->ob;
+	double ms;
+
+	ms = (double)(sr->s[last % STATS_RING].ns - sr->since[type]) / 1000000;
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, "burst", 0);
+		json_str(ob, "transfer", xfer_names[type], SIZE_MAX);
+		json_key(ob, "ms");
+		ob_printf(ob, "%.1f", ms);
+		json_key(ob, "peak");
+		ob_printf(ob, "%.1f", sr->peak[type]);
+		json_uint(ob, "threshold", burst_rates[type]);
+		json_bool(ob, "ongoing", ongoing);
+		json_end(uc);
+		return;
+	}
+	ob_printf(ob, "%s: %s burst %.1f ms, peak %.1f/s over %lld/s%s\n",
+	    uc->path, xfer_names[type], ms, sr->peak[type], burst_rates[type],
+	    ongoing ? ", ongoing" : "");
+}
+
+/*
+ * The rate percentiles of every type over samples lo to hi.
+ */
+void
+window_render(struct controller *uc, uint64_t lo, uint64_t hi)
+{
+	static double rates[STATS_RING];
+	struct stats_ring *sr = uc->ring;
+	struct obuf *ob = &uc->ob;
+	double ms, p50, p90, p99;
+	uint64_t k;
+	size_t i, n;
+
+	ms = (double)(sr->s[hi % STATS_RING].ns -
+	    sr->s[lo % STATS_RING].ns) / 1000000;
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, "window", 0);
+		json_key(ob, "ms");
+		ob_printf(ob, "%.1f", ms);
+		json_uint(ob, "samples", hi - lo + 1);
+	} else
+		ob_printf(ob, "%s: window %.1f ms, %llu samples\n", uc->path,
+		    ms, (unsigned long long)(hi - lo + 1));
+
+	for (i = 0; i < XFER_TYPES; i++) {
+		for (n = 0, k = lo + 1; k <= hi; k++)
+			rates[n++] = ring_rate(sr, k, i);
+		qsort(rates, n, sizeof(*rates), rate_cmp);
+		p50 = rates[(n - 1) * 50 / 100];
+		p90 = rates[(n - 1) * 90 / 100];
+		p99 = rates[(n - 1) * 99 / 100];
+		if (oformat == OFMT_JSON) {
+			json_key(ob, xfer_names[i]);
+			ob_printf(ob, "{\"p50\":%.1f,\"p90\":%.1f,"
+			    "\"p99\":%.1f,\"peak\":%.1f}", p50, p90, p99,
+			    rates[n - 1]);
+		} else
+			ob_printf(ob, "\t %s p50 %.1f p90 %.1f p99 %.1f "
+			    "peak %.1f/s\n", xfer_names[i], p50, p90, p99,
+			    rates[n - 1]);
+	}
+	if (oformat == OFMT_JSON)
+		json_end(uc);
+}
+
+/*
+ * Per-device fetch pool (-j).  Workers take addresses in order from a
+ * shared counter and each fills the snapshot of its own; every worker
+ * fetches into an arena of its own, merged into the controller's once
+ * they are done.  The walk's early stop needs the hub ports of every
+ * address handed out so far, so once the count looks complete no new
+ * address goes out until the ones in flight have answered.  What the
+ * serial walk would not have reached is dropped again, and the table
+ * is rendered in address order, so the output is the same as without
+ * -j.
+ *
+ * Under -t the pool is watched as well.  A device that outlasts its
+ * budget is marked timed out and its worker is left to whatever ioctl
+ * it is stuck in, a new one taking its place; at the deadline the same
+ * happens to every device still being fetched and nothing more goes
+ * out.  An abandoned worker issues no further ioctl once it gets back,
+ * frees what it has and lets go of the pool, which goes with whoever
+ * lets go of it last.
+ */
+int
+fetch_next(struct fetch_worker *fw)
+{
+	struct fetch_pool *fp = fw->fp;
+	struct dump_args *da = fp->uc->da;
+	int addr;
+
+	pthread_mutex_lock(&fp->mtx);
+	for (;;) {
+		if (fp->stop || fp->next >= USB_MAX_DEVICES) {
+			addr = -1;
+			break;
+		}
+		if (da->naddrs) {
+			if (addr_selected(da, fp->uc->bus, fp->next)) {
+				addr = fp->next++;
+				break;
+			}
+			fp->next++;
+			continue;
+		}
+		if (sweep || fp->blind || fp->found < fp->expected) {
+			addr = fp->next++;
+			fp->inflight++;
+			break;
+		}
+		if (fp->inflight == 0) {
+			addr = -1;
+			break;
+		}
+		pthread_cond_wait(&fp->cond, &fp->mtx);
+	}
+	fw->addr = addr;
+	fw->info = 0;
+	if (addr != -1 && deadline) {
+		fw->until = MINIMUM(mono_ns() + budget, deadline);
+		pthread_cond_broadcast(&fp->cond);	/* for the watchdog */
+	}
+	pthread_mutex_unlock(&fp->mtx);
+	return addr;
+}
+
+/*
+ * Count a USB_DEVICEINFO answer, or the lack of a device, towards the
+ * early stop.  Returns -1 if the worker was abandoned meanwhile.
+ */
+int
+fetch_done(struct fetch_worker *fw, struct usb_device_info *di)
+{
+	struct fetch_pool *fp = fw->fp;
+	int ret = -1;
+
+	pthread_mutex_lock(&fp->mtx);
+	if (!fw->abandoned) {
+		fp->inflight--;
+		if (di != NULL) {
+			fp->found++;
+			fp->expected += usbdevs_connected(di);
+			fw->di = *di;
+			fw->info = 1;
+		} else
+			fw->addr = -1;
+		pthread_cond_broadcast(&fp->cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fp->mtx);
+	return ret;
+}
+
+/*
+ * Hand a snapshot over, unless the watchdog has put a timed out one in
+ * its place already.  Under -t what it points at comes from an arena
+ * of its own, which the worker's takes over now.
+ */
+int
+fetch_put(struct fetch_worker *fw, struct usb_snap *us, struct arena *ar)
+{
+	struct fetch_pool *fp = fw->fp;
+	int ret = -1;
+
+	pthread_mutex_lock(&fp->mtx);
+	if (!fw->abandoned) {
+		if (ar != &fw->ar)
+			arena_merge(&fw->ar, ar);
+		fp->snaps[fw->addr] = us;
+		fw->addr = -1;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fp->mtx);
+	return ret;
+}
+
+void *
+fetch_worker(void *arg)
+{
+	struct fetch_worker *fw = arg;
+	struct controller *uc = fw->fp->uc;
+	struct usb_snap *us;
+	struct arena dar, *ar = &fw->ar;
+	size_t maxfetch;
+	int addr, fd, command, config, naddrs;
+
+	/* An abandoned worker may outlive the controller. */
+	fetch_self = fw;
+	fd = uc->fd;
+	command = uc->da->command;
+	config = uc->da->config;
+	naddrs = uc->da->naddrs != 0;
+
+	/*
+	 * Under -t the watchdog may take the worker's arena over at any
+	 * time, so each device is fetched into one of its own first.
+	 */
+	memset(&dar, 0, sizeof(dar));
+	maxfetch = fw->ar.maxfetch;
+	if (deadline)
+		ar = &dar;
+
+	while ((addr = fetch_next(fw)) != -1) {
+		dar.maxfetch = maxfetch;
+		us = snap_new(addr);
+		us->deadline = fw->until;
+		if (!naddrs) {
+			if (snap_info(fd, us) == -1) {
+				/* What could not be read is kept for -x. */
+				if (!(us->flags & SNAP_UNREADABLE) ||
+				    fetch_put(fw, us, ar) == -1)
+					free(us);
+				if (fetch_done(fw, NULL) == -1)
+					break;
+				continue;
+			}
+			if (fetch_done(fw, &us->di) == -1) {
+				free(us);
+				break;
+			}
+		}
+		snap_fill(fd, ar, us, command, config);
+		maxfetch = dar.maxfetch;
+		if (fetch_put(fw, us, ar) == -1) {
+			snap_free(ar, us);
+			free(us);
+			break;
+		}
+	}
+	arena_free(&dar);
+	fetch_exit(fw);
+	return NULL;
+}
+
+/*
+ * Start one more worker; the pool's mutex is held.
+ */
+void
+fetch_spawn(struct fetch_pool *fp)
+{
+	struct fetch_worker *fw;
+	int error;
+
+	if ((fw = calloc(1, sizeof(*fw))) == NULL)
+		err(trouble, NULL);
+	fw->fp = fp;
+	fw->addr = -1;
+	fw->ar.maxfetch = fp->uc->ar.maxfetch;
+	fw->next = fp->pool;
+	fp->pool = fw;
+	fp->running++;
+	if ((error = pthread_create(&fw->thread, NULL, fetch_worker, fw)) != 0)
+		errc(trouble, error, "pthread_create");
+}
+
+/*
+ * Give up on the device a worker is fetching; the pool's mutex is held
+ * and the worker is off the list already.  A timed out snapshot takes
+ * the device's place, with what USB_DEVICEINFO said if it got that
+ * far.  If it did not, the hub ports behind it are not counted and the
+ * walk goes on to the last address.
+ */
+void
+fetch_abandon(struct fetch_pool *fp, struct fetch_worker *fw)
+{
+	struct usb_snap *us;
+	int error;
+
+	us = snap_new(fw->addr);
+	us->flags = SNAP_TIMEDOUT;
+	if (fw->info) {
+		us->di = fw->di;
+		us->flags |= SNAP_INFO;
+		if (filtering && !filter_match(&us->di))
+			us->flags |= SNAP_SKIP;
+	} else if (!fp->uc->da->naddrs) {
+		fp->inflight--;
+		fp->blind = 1;
+	}
+	fp->snaps[fw->addr] = us;
+	arena_merge(&fp->uc->ar, &fw->ar);	/* what it handed over */
+	fw->abandoned = 1;
+	fp->running--;
+	fp->refs++;
+	if ((error = pthread_detach(fw->thread)) != 0)
+		errc(trouble, error, "pthread_detach");
+	pthread_cond_broadcast(&fp->cond);
+}
+
+/*
+ * The -t watchdog: wait for the workers to run out of addresses while
+ * abandoning every one that overstays.
+ */
+void
+fetch_watch(struct fetch_pool *fp)
+{
+	struct fetch_worker *fw, **fwp;
+	struct timespec ts;
+	int64_t now, wake;
+
+	pthread_mutex_lock(&fp->mtx);
+	while (fp->running > 0) {
+		now = mono_ns();
+		if (now >= deadline && !fp->stop) {
+			fp->stop = 1;
+			pthread_cond_broadcast(&fp->cond);
+		}
+		wake = deadline;
+		for (fwp = &fp->pool; (fw = *fwp) != NULL; ) {
+			if (fw->addr == -1) {
+				fwp = &fw->next;
+				continue;
+			}
+			if (fp->stop || now >= fw->until) {
+				*fwp = fw->next;
+				fetch_abandon(fp, fw);
+				if (!fp->stop)
+					fetch_spawn(fp);
+				continue;
+			}
+			wake = MINIMUM(wake, fw->until);
+			fwp = &fw->next;
+		}
+		if (fp->running == 0)
+			break;
+		ts.tv_sec = wake / NSEC_PER_SEC;
+		ts.tv_nsec = wake % NSEC_PER_SEC;
+		pthread_cond_timedwait(&fp->cond, &fp->mtx, &ts);
+	}
+	pthread_mutex_unlock(&fp->mtx);
+}
+
+/*
+ * A worker has run out of addresses.  The ones still on the pool's list
+ * are joined by fetch_controller; an abandoned one cleans up itself.
+ */
+void
+fetch_exit(struct fetch_worker *fw)
+{
+	struct fetch_pool *fp = fw->fp;
+
+	pthread_mutex_lock(&fp->mtx);
+	if (!fw->abandoned) {
+		fp->running--;
+		pthread_cond_broadcast(&fp->cond);
+		pthread_mutex_unlock(&fp->mtx);
+		return;
+	}
+	pthread_mutex_unlock(&fp->mtx);
+	fetch_self = NULL;
+	free(fw);
+	fetch_release(fp);
+}
+
+/*
+ * Whether this thread is a worker the watchdog gave up on.  Whatever
+ * such a worker still gets back is neither recorded nor cached: the
+ * device went out as timed out, and the capture and the cache may be
+ * being written out by now.
+ */
+int
+fetch_gone(void)
+{
+	struct fetch_worker *fw = fetch_self;
+	int gone;
+
+	if (fw == NULL)
+		return 0;
+	pthread_mutex_lock(&fw->fp->mtx);
+	gone = fw->abandoned;
+	pthread_mutex_unlock(&fw->fp->mtx);
+	return gone;
+}
+
+void
+fetch_release(struct fetch_pool *fp)
+{
+	int last;
+
+	pthread_mutex_lock(&fp->mtx);
+	last = --fp->refs == 0;
+	pthread_mutex_unlock(&fp->mtx);
+	if (!last)
+		return;
+	pthread_cond_destroy(&fp->cond);
+	pthread_mutex_destroy(&fp->mtx);
+	free(fp);
+}
+
+void
+fetch_controller(struct controller *uc)
+{
+	struct fetch_pool *fp;
+	struct fetch_worker *fw;
+	struct usb_snap *us, *old;
+	pthread_condattr_t ca;
+	int i, addr, error, found = 0, expected = 1;
+
+	if ((fp = calloc(1, sizeof(*fp))) == NULL)
+		err(trouble, NULL);
+	fp->uc = uc;
+	fp->next = 1;
+	fp->expected = 1;
+	fp->refs = 1;
+	pthread_mutex_init(&fp->mtx, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&fp->cond, &ca);
+	pthread_condattr_destroy(&ca);
+	if (deadline && mono_ns() >= deadline)
+		fp->stop = 1;
+
+	pthread_mutex_lock(&fp->mtx);
+	for (i = 0; i < MINIMUM(workers, USB_MAX_DEVICES - 1); i++)
+		fetch_spawn(fp);
+	pthread_mutex_unlock(&fp->mtx);
+	if (deadline)
+		fetch_watch(fp);
+	while ((fw = fp->pool) != NULL) {
+		fp->pool = fw->next;
+		if ((error = pthread_join(fw->thread, NULL)) != 0)
+			errc(trouble, error, "pthread_join");
+		arena_merge(&uc->ar, &fw->ar);
+		free(fw);
+	}
+
+	/*
+	 * Replace the table entries in one go and compact once at the end:
+	 * a compaction halfway would leave the snapshots not yet stored
+	 * pointing into freed chunks.
+	 */
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if ((us = fp->snaps[addr]) == NULL)
+			continue;
+		if (!uc->da->naddrs && !sweep && !fp->blind &&
+		    found >= expected) {
+			snap_free(&uc->ar, us);
+			free(us);
+			fp->snaps[addr] = NULL;
+			continue;
+		}
+		if (!(us->flags & SNAP_UNREADABLE)) {
+			found++;
+			expected += usbdevs_connected(&us->di);
+		}
+		if ((old = uc->devs[addr]) != NULL) {
+			devname_del(uc, old);
+			snap_free(&uc->ar, old);
+			free(old);
+		}
+		uc->devs[addr] = us;
+		devname_add(uc, us);
+	}
+	snap_compact(uc);
+
+	for (addr = 1; addr < USB_MAX_DEVICES && !uc->da->quiet; addr++) {
+		if (fp->snaps[addr] == NULL)
+			continue;
+		snap_render(uc, fp->snaps[addr]);
+		ob_check(&uc->ob);
+	}
+	if ((uc->timedout = fp->stop) && !uc->da->quiet)
+		render_timeout(uc, 0);
+	fetch_release(fp);
+}
+
+void
+dump_controller(struct controller *uc)
+{
+	struct dump_args *da = uc->da;
+	struct usb_snap *us;
+	int addr;
+
+	if (da->command == COMM_STAT) {
+		render_controller(uc);
+		print_stats(uc);
+		ob_flush(&uc->ob);
+		return;
+	}
+
+	if (da->naddrs == 0 && !da->quiet)
+		render_controller(uc);
+	if (workers > 1 || deadline)
+		fetch_controller(uc);
+	else if (da->naddrs) {
+		/* Every selected address, in order, on the open fd. */
+		for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+			if (!addr_selected(da, uc->bus, addr))
+				continue;
+			us = snap_new(addr);
+			snap_fill(uc->fd, &uc->ar, us, da->command,
+			    da->config);
+			if (!da->quiet)
+				snap_render(uc, us);
+			snap_store(uc, us);
+			ob_check(&uc->ob);
+		}
+	} else
+		usbdevs_walk(uc->fd, sweep ? USBDEVS_SWEEP : 0, walk_snap,
+		    uc);
+	if (oformat == OFMT_TREE)
+		render_tree(uc);
+	else if (bandwidth)
+		render_bandwidth(uc);
+	else if (audit)
+		render_audit(uc);
+	else if (probes)
+		render_probe(uc);
+
+	if ((da->command & COMM_STAT) && !da->quiet &&
+	    !(deadline && mono_ns() >= deadline))
+		print_stats(uc);
+	ob_flush(&uc->ob);
+}
+
+/*
+ * Parallel mode: the worker's buffer has no descriptor, so the whole
+ * dump stays in memory until main writes the controllers out in order.
+ */
+void *
+dump_worker(void *arg)
+{
+	struct controller *uc = arg;
+
+	dump_controller(uc);
+	return NULL;
+}
+
+void
+dump_controllers(struct controller *ctl, int ncont)
+{
+	int i, error;
+
+	if (!parallel || ncont < 2) {
+		for (i = 0; i < ncont; i++)
+			dump_controller(&ctl[i]);
+		return;
+	}
+
+	for (i = 0; i < ncont; i++) {
+		ctl[i].ob.fd = -1;
+		if ((error = pthread_create(&ctl[i].thread, NULL, dump_worker,
+		    &ctl[i])) != 0)
+			errc(trouble, error, "pthread_create");
+	}
+
+	/*
+	 * Joining in controller order lets each controller's output go
+	 * out as soon as it and every controller before it are done,
+	 * while the text stays identical to the sequential mode.
+	 */
+	for (i = 0; i < ncont; i++) {
+		if ((error = pthread_join(ctl[i].thread, NULL)) != 0)
+			errc(trouble, error, "pthread_join");
+		ctl[i].ob.fd = STDOUT_FILENO;
+		ob_flush(&ctl[i].ob);
+	}
+}
+
+/*
+ * Tree view (-o tree).  The kernel does not say which device is on
+ * which hub port, only which ports are connected, but it hands out
+ * addresses as it explores: each pass goes over the connected ports of
+ * every hub it has, in order, and gives what is new the lowest free
+ * address, while a hub attached on the way is only explored on the
+ * next pass.  The tree is thus numbered breadth first, and replaying
+ * that over the table puts every device under its hub without another
+ * ioctl.  One that came later, on a replug that got it a recycled
+ * address, may land on the wrong port; whatever is left over goes on
+ * the top level.
+ */
+void
+render_tree(struct controller *uc)
+{
+	struct tree t;
+	struct usb_snap *us;
+	char prefix[4 * USB_MAX_DEVICES + 1];
+	int addr, root = 0;
+
+	memset(&t, 0, sizeof(t));
+	memset(t.keep, -1, sizeof(t.keep));
+	t.uc = uc;
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
+		if (tree_has(uc, addr)) {
+			root = addr;
+			break;
+		}
+	if (root != 0)
+		tree_link(&t, root);
+
+	ob_str(&uc->ob, "Controller ");
+	ob_str(&uc->ob, uc->path);
+	ob_str(&uc->ob, ":\n");
+	prefix[0] = '\0';
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if ((us = uc->devs[addr]) == NULL)
+			continue;
+		if (addr == root && tree_keep(&t, root))
+			tree_render(&t, root, prefix, 0, 0);
+		else if (!t.placed[addr] && (!(us->flags & SNAP_INFO) ||
+		    tree_keep(&t, addr))) {
+			tree_node(&uc->ob, us);
+			ob_str(&uc->ob, ", port unknown\n");
+		}
+		ob_check(&uc->ob);
+	}
+	if (uc->timedout)
+		ob_str(&uc->ob, "deadline reached\n");
+}
+
+int
+tree_has(struct controller *uc, int addr)
+{
+	return uc->devs[addr] != NULL && (uc->devs[addr]->flags & SNAP_INFO);
+}
+
+void
+tree_link(struct tree *t, int root)
+{
+	struct usb_device_info *di;
+	uint8_t queue[USB_MAX_DEVICES];
+	int head = 0, tail = 0, next = root + 1, hub, port, nports;
+
+	/* Every device is queued once, so the queue cannot overflow. */
+	t->placed[root] = 1;
+	queue[tail++] = root;
+	while (head < tail) {
+		hub = queue[head++];
+		di = &t->uc->devs[hub]->di;
+		nports = MINIMUM(UGETDW(&di->udi_nports), TREE_PORTS);
+		for (port = 0; port < nports; port++) {
+			if (!(UGETDW(&di->udi_ports[port]) &
+			    UPS_CURRENT_CONNECT_STATUS))
+				continue;
+			while (next < USB_MAX_DEVICES &&
+			    !tree_has(t->uc, next))
+				next++;
+			if (next == USB_MAX_DEVICES)
+				return;
+			t->child[hub][port] = next;
+			t->placed[next] = 1;
+			queue[tail++] = next++;
+		}
+	}
+}
+
+/*
+ * Whether a device is shown: under a filter, only those that match and
+ * the hubs leading to them are.
+ */
+int
+tree_keep(struct tree *t, int addr)
+{
+	int port, keep;
+
+	if (t->keep[addr] != -1)
+		return t->keep[addr];
+	keep = !(t->uc->devs[addr]->flags & SNAP_SKIP);
+	for (port = 0; port < TREE_PORTS; port++)
+		if (t->child[addr][port] != 0 &&
+		    tree_keep(t, t->child[addr][port]))
+			keep = 1;
+	return t->keep[addr] = keep;
+}
+
+void
+tree_render(struct tree *t, int addr, char *prefix, size_t len, int port)
+{
+	struct obuf *ob = &t->uc->ob;
+	struct usb_device_info *di = &t->uc->devs[addr]->di;
+	int ports[TREE_PORTS];
+	int i, n = 0, nports;
+
+	if (port != 0) {
+		ob_str(ob, "port ");
+		ob_dec(ob, port, 0);
+		ob_str(ob, ": ");
+	}
+	tree_node(ob, t->uc->devs[addr]);
+	ob_char(ob, '\n');
+
+	/* Connected ports, less those a filter has emptied. */
+	nports = MINIMUM(UGETDW(&di->udi_nports), TREE_PORTS);
+	for (i = 0; i < nports; i++) {
+		if (!(UGETDW(&di->udi_ports[i]) & UPS_CURRENT_CONNECT_STATUS))
+			continue;
+		if (t->child[addr][i] != 0 ? tree_keep(t, t->child[addr][i]) :
+		    !filtering)
+			ports[n++] = i;
+	}
+	for (i = 0; i < n; i++) {
+		ob_strn(ob, prefix, len);
+		ob_str(ob, i == n - 1 ? "`-- " : "|-- ");
+		memcpy(prefix + len, i == n - 1 ? "    " : "|   ", 4);
+		if (t->child[addr][ports[i]] != 0)
+			tree_render(t, t->child[addr][ports[i]], prefix,
+			    len + 4, ports[i] + 1);
+		else {
+			ob_str(ob, "port ");
+			ob_dec(ob, ports[i] + 1, 0);
+			ob_str(ob, ": no address\n");
+		}
+	}
+}
+
+/*
+ * One device of the tree: what -v says of it on one line.
+ */
+void
+tree_node(struct obuf *ob, struct usb_snap *us)
+{
+	struct usb_device_info *di = &us->di;
+	char vv[sizeof(di->udi_vendor) * 4], vp[sizeof(di->udi_product) * 4];
+
+	ob_str(ob, "addr ");
+	ob_dec(ob, us->addr, 2);
+	if (!(us->flags & SNAP_INFO)) {
+		ob_str(ob, ": timed out");
+		return;
+	}
+	strvis(vv, di->udi_vendor, VIS_CSTYLE);
+	strvis(vp, di->udi_product, VIS_CSTYLE);
+	ob_str(ob, ": ");
+	ob_hex(ob, UGETW(&di->udi_vendorNo), 4);
+	ob_char(ob, ':');
+	ob_hex(ob, UGETW(&di->udi_productNo), 4);
+	ob_char(ob, ' ');
+	ob_str(ob, vv);
+	ob_str(ob, ", ");
+	ob_str(ob, vp);
+	if (speed_name(di->udi_speed) != NULL) {
+		ob_str(ob, ", ");
+		ob_str(ob, speed_name(di->udi_speed));
+		ob_str(ob, " speed");
+	}
+	if (di->udi_power)
+		ob_printf(ob, ", power %d mA", UGETDW(&di->udi_power));
+	else
+		ob_str(ob, ", self powered");
+	if (us->flags & SNAP_TIMEDOUT)
+		ob_str(ob, ", timed out");
+}
+
+/*
+ * Bandwidth analysis (-B).  Every periodic endpoint of the current
+ * configuration reserves its packets once per service interval; of an
+ * interface only one alternate setting is active at a time and the
+ * kernel does not say which, so the most demanding one is counted.
+ * Laid over the tree of -o tree, each hub is held against the links
+ * below it: the superspeed and high speed ones, and for a high speed
+ * hub the full speed budget of its transaction translator.  The root
+ * hub stands for the controller and also carries whatever could not be
+ * placed.
+ */
+void
+render_bandwidth(struct controller *uc)
+{
+	struct tree t;
+	struct usb_snap *us;
+	uint64_t dev[USB_MAX_DEVICES], sum[BW_NLINKS];
+	int addr, root = 0, link;
+
+	memset(&t, 0, sizeof(t));
+	t.uc = uc;
+	memset(dev, 0, sizeof(dev));
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (!tree_has(uc, addr))
+			continue;
+		if (root == 0)
+			root = addr;
+		dev[addr] = bw_device(uc->devs[addr]);
+	}
+	if (root != 0)
+		tree_link(&t, root);
+
+	if (oformat == OFMT_TEXT) {
+		ob_str(&uc->ob, "Controller ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, ":\n");
+	}
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (!tree_has(uc, addr))
+			continue;
+		us = uc->devs[addr];
+		if (UGETDW(&us->di.udi_nports) == 0) {
+			if (dev[addr] != 0 || verbose)
+				bw_render(uc, us, -1, dev[addr], 0);
+			continue;
+		}
+		memset(sum, 0, sizeof(sum));
+		bw_sum(&t, dev, addr, sum);
+		if (addr == root) {
+			for (root = 1; root < USB_MAX_DEVICES; root++)
+				if (root != addr && tree_has(uc, root) &&
+				    !t.placed[root])
+					bw_sum(&t, dev, root, sum);
+			root = addr;
+		}
+		for (link = 0; link < BW_NLINKS; link++)
+			if (bw_links(us->di.udi_speed) & (1 << link))
+				bw_render(uc, us, link, sum[link],
+				    bw_limits[link]);
+		ob_check(&uc->ob);
+	}
+}
+
+/*
+ * Bytes per second an isochronous or interrupt endpoint reserves.
+ * Service intervals are counted in 125 us microframes.
+ */
+uint64_t
+bw_endpt(int speed, const u_char *ep, const u_char *comp)
+{
+	uint64_t bytes, period;
+	int type = ep[3] & 0x3, mps = UGETW(ep + 4);
+	int ival = MINIMUM(MAXIMUM(ep[6], 1), 16);
+
+	if (type != 1 && type != 3)
+		return 0;
+	bytes = mps & 0x7ff;
+	switch (speed) {
+	case USB_SPEED_LOW:
+	case USB_SPEED_FULL:
+		/* Frames, and only isochronous ones are a power of two. */
+		if (type == 1)
+			period = 8ULL << (ival - 1);
+		else
+			period = 8ULL * MAXIMUM(ep[6], 1);
+		break;
+	case USB_SPEED_HIGH:
+		bytes *= 1 + ((mps >> 11) & 0x3);
+		period = 1ULL << (ival - 1);
+		break;
+	case USB_SPEED_SUPER:
+		if (comp != NULL)
+			bytes = UGETW(comp + 4);
+		period = 1ULL << (ival - 1);
+		break;
+	default:
+		return 0;
+	}
+	return bytes * 8000 / period;
+}
+
+uint64_t
+bw_device(struct usb_snap *us)
+{
+	struct usb_snap_config *sc;
+	const struct usbdevs_desc *ud;
+	const u_char *comp;
+	uint64_t ifmax[256], alt = 0, total = 0;
+	size_t i;
+
+	sc = snap_find(us, USB_CURRENT_CONFIG_INDEX);
+	if (sc == NULL || !(sc->flags & SNAP_FDESC))
+		return 0;
+	snap_decode(us, sc);
+	memset(ifmax, 0, sizeof(ifmax));
+	for (i = 0; i < sc->ndescs; i++) {
+		ud = &sc->descs[i];
+		if (ud->kind == USBDEVS_DESC_IFACE) {
+			alt = 0;
+			continue;
+		}
+		if (ud->kind != USBDEVS_DESC_ENDPT)
+			continue;
+		comp = NULL;
+		if (i + 1 < sc->ndescs &&
+		    sc->descs[i + 1].kind == USBDEVS_DESC_SSCOMP)
+			comp = sc->data + sc->descs[i + 1].off;
+		alt += bw_endpt(us->di.udi_speed, sc->data + ud->off, comp);
+		ifmax[ud->iface] = MAXIMUM(ifmax[ud->iface], alt);
+	}
+	for (i = 0; i < nitems(ifmax); i++)
+		total += ifmax[i];
+	return total;
+}
+
+/*
+ * Add up a device and everything below it, by the links it loads:
+ * full and low speed traffic goes through the high speed side too.
+ */
+void
+bw_sum(struct tree *t, const uint64_t *dev, int addr, uint64_t *sum)
+{
+	int port;
+
+	switch (t->uc->devs[addr]->di.udi_speed) {
+	case USB_SPEED_SUPER:
+		sum[BW_SUPER] += dev[addr];
+		break;
+	case USB_SPEED_HIGH:
+		sum[BW_HIGH] += dev[addr];
+		break;
+	case USB_SPEED_LOW:
+	case USB_SPEED_FULL:
+		sum[BW_HIGH] += dev[addr];
+		sum[BW_FULL] += dev[addr];
+		break;
+	}
+	for (port = 0; port < TREE_PORTS; port++)
+		if (t->child[addr][port] != 0)
+			bw_sum(t, dev, t->child[addr][port], sum);
+}
+
+/*
+ * The links a hub of some speed has below it, as a mask.
+ */
+int
+bw_links(int speed)
+{
+	switch (speed) {
+	case USB_SPEED_SUPER:
+		return 1 << BW_SUPER | 1 << BW_HIGH;
+	case USB_SPEED_HIGH:
+		return 1 << BW_HIGH | 1 << BW_FULL;
+	case USB_SPEED_FULL:
+		return 1 << BW_FULL;
+	}
+	return 0;
+}
+
+/*
+ * One line of -B: what a device reserves if link is -1, else the load
+ * on one link of a hub against its limit.
+ */
+void
+bw_render(struct controller *uc, struct usb_snap *us, int link,
+    uint64_t bytes, uint64_t limit)
+{
+	struct obuf *ob = &uc->ob;
+	unsigned long long pct = 0;
+	const char *state = "ok";
+
+	if (link != -1) {
+		pct = bytes * 100 / limit;
+		if (bytes > limit)
+			state = "oversubscribed";
+		else if (pct >= BW_NEAR)
+			state = "near limit";
+	}
+
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, link == -1 ? "periodic" : "bandwidth",
+		    us->addr);
+		if (link != -1)
+			json_str(ob, "link", bw_link_names[link], SIZE_MAX);
+		json_uint(ob, "bytes_per_second", bytes);
+		if (link != -1) {
+			json_uint(ob, "limit", limit);
+			json_uint(ob, "percent", pct);
+			json_str(ob, "state", state, SIZE_MAX);
+		}
+		json_end(uc);
+		return;
+	}
+
+	ob_str(ob, "addr ");
+	ob_dec(ob, us->addr, 2);
+	if (link == -1) {
+		ob_printf(ob, ": %.1f kB/s periodic", bytes / 1000.0);
+		if (speed_name(us->di.udi_speed) != NULL)
+			ob_printf(ob, ", %s speed",
+			    speed_name(us->di.udi_speed));
+		ob_char(ob, '\n');
+		return;
+	}
+	ob_printf(ob, ": hub %s link: %.1f of %.1f kB/s, %llu%%",
+	    bw_link_names[link], bytes / 1000.0, limit / 1000.0, pct);
+	if (strcmp(state, "ok") != 0) {
+		ob_str(ob, ", ");
+		ob_str(ob, state);
+	}
+	ob_char(ob, '\n');
+}
+
+/*
+ * Link speed audit (-S): every device that runs slower than it could.
+ * What a device can do is not in the table: superspeed shows in the
+ * SuperSpeed capability of its BOS, and a high speed device that came
+ * up at full speed still answers for its device qualifier, which full
+ * speed only devices have none of.  Both are asked for with
+ * USB_REQUEST, and only of devices whose bcdUSB says they may have
+ * them and that are not at that speed already, so a healthy bus costs
+ * no more than a listing.  Each finding comes with the hub above the
+ * device and, on a superspeed hub, the link state of its port.
+ */
+void
+render_audit(struct controller *uc)
+{
+	struct tree t;
+	struct usb_snap *us, *hub;
+	const char *src;
+	int addr, cap, h, port, root = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.uc = uc;
+	for (addr = 1; addr < USB_MAX_DEVICES && root == 0; addr++)
+		if (tree_has(uc, addr))
+			root = addr;
+	if (root != 0)
+		tree_link(&t, root);
+
+	if (oformat == OFMT_TEXT) {
+		ob_str(&uc->ob, "Controller ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, ":\n");
+	}
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (!tree_has(uc, addr) || (uc->devs[addr]->flags & SNAP_SKIP))
+			continue;
+		us = uc->devs[addr];
+		cap = audit_capable(uc, us, &src);
+		if (cap <= us->di.udi_speed && !verbose)
+			continue;
+
+		hub = NULL;
+		port = 0;
+		for (h = 1; h < USB_MAX_DEVICES && hub == NULL; h++)
+			for (port = 0; port < TREE_PORTS; port++)
+				if (t.child[h][port] == addr) {
+					hub = uc->devs[h];
+					break;
+				}
+		audit_render(uc, us, cap, src, hub, port + 1);
+		ob_check(&uc->ob);
+	}
+}
+
+/*
+ * GET_DESCRIPTOR of the device at addr; the length received or -1.
+ */
+int
+audit_request(struct controller *uc, int addr, int type, u_char *buf,
+    size_t len)
+{
+	usb_device_request_t req;
+
+	req.bmRequestType = UT_READ_DEVICE;
+	req.bRequest = UR_GET_DESCRIPTOR;
+	USETW(req.wValue, type << 8);
+	USETW(req.wIndex, 0);
+	USETW(req.wLength, len);
+	return usbdevs_request(uc->fd, addr, &req, buf, USBD_SHORT_XFER_OK);
+}
+
+/*
+ * The fastest speed a device is capable of and what says so.  Short
+ * of an answer to USB_REQUEST, only a bcdUSB of 3.0 or later tells;
+ * otherwise it is taken to be the speed it runs at.
+ */
+int
+audit_capable(struct controller *uc, struct usb_snap *us, const char **src)
+{
+	u_char buf[1024];
+	const u_char *cur;
+	int speed = us->di.udi_speed, bcd, len;
+	size_t off;
+
+	*src = "negotiated";
+	if (!(us->flags & SNAP_DDESC))
+		return speed;
+	bcd = UGETW(us->ddd.udd_desc.bcdUSB);
+	if (bcd >= 0x0300 && speed < USB_SPEED_SUPER) {
+		*src = "bcdUSB";
+		return USB_SPEED_SUPER;
+	}
+
+	/* A BOS comes with 2.01 and later, 2.10 when running at 3.x. */
+	if (bcd >= 0x0201 && speed < USB_SPEED_SUPER &&
+	    (len = audit_request(uc, us->addr, UDESC_BOS, buf,
+	    sizeof(buf))) >= 5) {
+		len = MINIMUM(len, UGETW(buf + 2));
+		off = 0;
+		while ((cur = usbdevs_desc_next(buf, len, &off)) != NULL) {
+			if (cur[0] >= 3 && cur[1] == DEVCAP_DESC &&
+			    (cur[2] == DEVCAP_SS || cur[2] == DEVCAP_SSPLUS)) {
+				*src = "BOS";
+				return USB_SPEED_SUPER;
+			}
+		}
+	}
+
+	if (bcd >= 0x0200 && speed < USB_SPEED_HIGH &&
+	    audit_request(uc, us->addr, UDESC_DEVICE_QUALIFIER, buf,
+	    10) >= 10) {
+		*src = "device qualifier";
+		return USB_SPEED_HIGH;
+	}
+	return speed;
+}
+
+void
+audit_render(struct controller *uc, struct usb_snap *us, int cap,
+    const char *src, struct usb_snap *hub, int port)
+{
+	struct obuf *ob = &uc->ob;
+	struct usb_device_info *di = &us->di;
+	const char *link = NULL, *speed, *capable;
+	char vv[sizeof(di->udi_vendor) * 4], vp[sizeof(di->udi_product) * 4];
+
+	if (hub != NULL && hub->di.udi_speed == USB_SPEED_SUPER &&
+	    port <= UGETDW(&hub->di.udi_nports) && port <= TREE_PORTS)
+		link = link_state_name(UPS_PORT_LS_GET(
+		    UGETDW(&hub->di.udi_ports[port - 1])));
+	if ((speed = speed_name(di->udi_speed)) == NULL)
+		speed = "unknown";
+	if ((capable = speed_name(cap)) == NULL)
+		capable = "unknown";
+
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, "audit", us->addr);
+		json_str(ob, "speed", speed, SIZE_MAX);
+		json_str(ob, "capable", capable, SIZE_MAX);
+		json_str(ob, "source", src, SIZE_MAX);
+		json_bool(ob, "degraded", cap > di->udi_speed);
+		if (hub != NULL) {
+			json_uint(ob, "hub", hub->addr);
+			json_uint(ob, "port", port);
+			json_str(ob, "hub_speed", speed_name(hub->di.udi_speed)
+			    != NULL ? speed_name(hub->di.udi_speed) :
+			    "unknown", SIZE_MAX);
+		}
+		if (link != NULL)
+			json_str(ob, "link_state", link, SIZE_MAX);
+		json_end(uc);
+		return;
+	}
+
+	strvis(vv, di->udi_vendor, VIS_CSTYLE);
+	strvis(vp, di->udi_product, VIS_CSTYLE);
+	ob_str(ob, "addr ");
+	ob_dec(ob, us->addr, 2);
+	ob_str(ob, ": ");
+	ob_hex(ob, UGETW(&di->udi_vendorNo), 4);
+	ob_char(ob, ':');
+	ob_hex(ob, UGETW(&di->udi_productNo), 4);
+	ob_printf(ob, " %s, %s, %s speed", vv, vp, speed);
+	if (cap > di->udi_speed)
+		ob_printf(ob, ", capable of %s speed (%s)", capable, src);
+	else
+		ob_str(ob, ", ok");
+	if (hub != NULL) {
+		ob_printf(ob, ", hub addr %02d port %d", hub->addr, port);
+		if (speed_name(hub->di.udi_speed) != NULL)
+			ob_printf(ob, " %s speed",
+			    speed_name(hub->di.udi_speed));
+	}
+	if (link != NULL)
+		ob_printf(ob, ", link %s", link);
+	ob_char(ob, '\n');
+}
+
+/*
+ * Control latency probe (-P).  Every device is sent a standard device
+ * GET_STATUS, which reads two bytes and changes nothing, count times
+ * over, round robin so that each device's samples are spread over the
+ * whole run.  Requests on a bus are paced to one per gap, measured
+ * from when the run started so that slow answers do not stretch it,
+ * which bounds what the probe adds to a production bus whatever the
+ * count.  The tier of a device is its depth under the root hub, from
+ * the tree of -o tree, 0 for one that could not be placed.
+ */
+void
+render_probe(struct controller *uc)
+{
+	struct probe_stat *dev, tier[PROBE_TIERS];
+	struct timespec ts;
+	struct tree t;
+	uint8_t depth[USB_MAX_DEVICES], queue[USB_MAX_DEVICES];
+	int64_t next, now, start;
+	uint16_t status;
+	int addr, root = 0, head = 0, tail = 0, port, n, i;
+
+	memset(&t, 0, sizeof(t));
+	t.uc = uc;
+	for (addr = 1; addr < USB_MAX_DEVICES && root == 0; addr++)
+		if (tree_has(uc, addr))
+			root = addr;
+	memset(depth, 0, sizeof(depth));
+	if (root != 0) {
+		tree_link(&t, root);
+		depth[root] = 1;
+		queue[tail++] = root;
+	}
+	while (head < tail) {
+		addr = queue[head++];
+		for (port = 0; port < TREE_PORTS; port++) {
+			if ((n = t.child[addr][port]) == 0)
+				continue;
+			depth[n] = MINIMUM(depth[addr] + 1, PROBE_TIERS - 1);
+			queue[tail++] = n;
+		}
+	}
+
+	if ((dev = calloc(USB_MAX_DEVICES, sizeof(*dev))) == NULL)
+		err(trouble, NULL);
+	next = mono_ns();
+	for (i = 0; i < probes; i++)
+		for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+			if (!tree_has(uc, addr) ||
+			    (uc->devs[addr]->flags & SNAP_SKIP))
+				continue;
+			if ((now = mono_ns()) < next) {
+				ts.tv_sec = (next - now) / NSEC_PER_SEC;
+				ts.tv_nsec = (next - now) % NSEC_PER_SEC;
+				nanosleep(&ts, NULL);
+			}
+			next += probe_gap;
+
+			start = mono_ns();
+			if (usbdevs_status(uc->fd, addr, &status) == -1) {
+				/* Read-only, or no USB_REQUEST at all. */
+				if (errno == EBADF || errno == EPERM ||
+				    errno == ENOTTY) {
+					warn("%s: GET_STATUS", uc->path);
+					goto done;
+				}
+				dev[addr].failed++;
+				continue;
+			}
+			probe_add(&dev[addr], mono_ns() - start);
+		}
+
+ done:
+	if (oformat == OFMT_TEXT) {
+		ob_str(&uc->ob, "Controller ");
+		ob_str(&uc->ob, uc->path);
+		ob_str(&uc->ob, ":\n");
+	}
+	memset(tier, 0, sizeof(tier));
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (dev[addr].op.count == 0 && dev[addr].failed == 0)
+			continue;
+		probe_render(uc, addr, depth[addr], 1, &dev[addr]);
+		n = depth[addr];
+		for (i = 0; i < TRACE_BUCKETS; i++)
+			tier[n].op.hist[i] += dev[addr].op.hist[i];
+		if (dev[addr].op.count != 0 && (tier[n].op.count == 0 ||
+		    dev[addr].min < tier[n].min))
+			tier[n].min = dev[addr].min;
+		tier[n].max = MAXIMUM(tier[n].max, dev[addr].max);
+		tier[n].op.count += dev[addr].op.count;
+		tier[n].op.total += dev[addr].op.total;
+		tier[n].failed += dev[addr].failed;
+		ob_check(&uc->ob);
+	}
+	for (n = 0; n < PROBE_TIERS; n++)
+		if (tier[n].op.count != 0 || tier[n].failed != 0)
+			probe_render(uc, 0, n, 0, &tier[n]);
+	free(dev);
+}
+
+void
+probe_add(struct probe_stat *ps, int64_t ns)
+{
+	if (ps->op.count == 0 || (uint64_t)ns < ps->min)
+		ps->min = ns;
+	ps->max = MAXIMUM(ps->max, (uint64_t)ns);
+	ps->op.count++;
+	ps->op.total += ns;
+	ps->op.hist[trace_bucket(ns)]++;
+}
+
+/*
+ * One device's latencies, or with addr 0 those of a whole tier.
+ */
+void
+probe_render(struct controller *uc, int addr, int tier, int isdev,
+    struct probe_stat *ps)
+{
+	struct obuf *ob = &uc->ob;
+	uint64_t p50 = 0, p99 = 0;
+
+	if (ps->op.count != 0) {
+		p50 = trace_percentile(&ps->op, 50);
+		p99 = trace_percentile(&ps->op, 99);
+	}
+
+	if (oformat == OFMT_JSON) {
+		json_begin(uc, isdev ? "latency" : "latency_tier", addr);
+		json_uint(ob, "tier", tier);
+		json_uint(ob, "count", ps->op.count);
+		json_uint(ob, "failed", ps->failed);
+		if (ps->op.count != 0) {
+			json_uint(ob, "min_ns", ps->min);
+			json_uint(ob, "p50_ns", p50);
+			json_uint(ob, "p99_ns", p99);
+			json_uint(ob, "max_ns", ps->max);
+		}
+		json_end(uc);
+		return;
+	}
+
+	if (isdev) {
+		ob_str(ob, "addr ");
+		ob_dec(ob, addr, 2);
+		ob_str(ob, ": tier ");
+	} else
+		ob_str(ob, "tier ");
+	if (tier != 0)
+		ob_dec(ob, tier, 0);
+	else
+		ob_str(ob, "unknown");
+	ob_printf(ob, isdev ? ", %llu requests" : ": %llu requests",
+	    (unsigned long long)ps->op.count);
+	if (ps->failed)
+		ob_printf(ob, ", %u failed", ps->failed);
+	if (ps->op.count != 0)
+		ob_printf(ob, ", min %.3f p50 %.3f p99 %.3f max %.3f ms",
+		    ps->min / 1e6, p50 / 1e6, p99 / 1e6, ps->max / 1e6);
+	ob_char(ob, '\n');
+}
+
+/*
+ * Diff mode (-x).  The controllers are walked as for a dump, rendering
+ * nothing, and the table is then held against a capture written by -W
+ * earlier: a device is the same one if its address still holds the
+ * same vendor, product and serial number, and anything else there is
+ * reported as the old one going and the new one coming, in the words
+ * of -H.  Of the same device, every field that differs is a change;
+ * descriptors are compared as far as both sides have them.  Returns
+ * the number of differences, devices that timed out among them.  An
+ * address or a controller that could not be read is neither: it is
+ * counted in unread, for the exit status to say so.
+ */
+int
+diff_controllers(struct dump_args *da, struct controller *ctl, int ncont)
+{
+	struct controller *uc;
+	uint32_t i;
+	int c, n = 0;
+
+	dump_controllers(ctl, ncont);
+	for (c = 0; c < ncont; c++) {
+		n += diff_controller(&ctl[c],
+		    capture_path(capbase, ctl[c].path));
+		ob_flush(&ctl[c].ob);
+	}
+
+	/* What the baseline has and the host no longer does. */
+	for (i = 0; i < capbase->hdr->nctlrs; i++) {
+		for (c = 0; c < ncont; c++)
+			if (strncmp(ctl[c].path, capbase->ctlrs[i].path,
+			    USBCAP_PATHLEN) == 0)
+				break;
+		if (c < ncont || controller_unread(capbase->ctlrs[i].path))
+			continue;
+		if ((uc = calloc(1, sizeof(*uc))) == NULL)
+			err(trouble, NULL);
+		strlcpy(uc->path, capbase->ctlrs[i].path,
+		    MINIMUM(sizeof(uc->path), USBCAP_PATHLEN + 1));
+		uc->fd = -1;
+		uc->unit = ncont + i;
+		uc->bus = controller_bus(uc->path);
+		uc->da = da;
+		uc->ob.fd = STDOUT_FILENO;
+		n += diff_controller(uc, i);
+		ob_flush(&uc->ob);
+		free(uc->ob.buf);
+		free(uc);
+	}
+	return n;
+}
+
+int
+diff_controller(struct controller *uc, int ctlr)
+{
+	struct dump_args *da = uc->da;
+	struct usb_snap *us, gone;
+	const void *p;
+	int addr, n = 0;
+
+	/*
+	 * Past the deadline, what is missing may just not have been seen;
+	 * a device that did not answer is counted as changed all the same.
+	 */
+	if (uc->timedout) {
+		render_timeout(uc, 0);
+		n++;
+	}
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (da->naddrs && !addr_selected(da, uc->bus, addr))
+			continue;
+		memset(&gone, 0, sizeof(gone));
+		gone.addr = addr;
+		if (ctlr != -1 && (p = capture_find(capbase, ctlr,
+		    USBCAP_DEVICEINFO, addr, 0, NULL)) != NULL) {
+			memcpy(&gone.di, p, sizeof(gone.di));
+			if (!filtering || filter_match(&gone.di))
+				gone.flags = SNAP_INFO;
+		}
+		us = uc->devs[addr];
+		if (us != NULL && (us->flags & SNAP_UNREADABLE)) {
+			/* Neither the same nor gone, but trouble. */
+			unread++;
+			continue;
+		}
+		if (us != NULL && (us->flags & SNAP_TIMEDOUT)) {
+			/* Whatever it is, it cannot be told. */
+			render_timeout(uc, addr);
+			n++;
+			if (!(us->flags & SNAP_INFO))
+				continue;
+		}
+		if (us != NULL && (!(us->flags & SNAP_INFO) ||
+		    (us->flags & SNAP_SKIP)))
+			us = NULL;
+
+		if (us != NULL && (gone.flags & SNAP_INFO) &&
+		    diff_same(&us->di, &gone.di)) {
+			n += diff_device(uc, ctlr, us, &gone.di);
+			continue;
+		}
+		if ((gone.flags & SNAP_INFO) && !uc->timedout) {
+			render_event(uc, 0, &gone);
+			render_info(uc, &gone.di);
+			n++;
+		}
+		if (us != NULL) {
+			render_event(uc, 1, us);
+			snap_render(uc, us);
+			n++;
+		}
+		ob_check(&uc->ob);
+	}
+	return n;
+}
+
+int
+diff_same(struct usb_device_info *a, struct usb_device_info *b)
+{
+	return UGETW(&a->udi_vendorNo) == UGETW(&b->udi_vendorNo) &&
+	    UGETW(&a->udi_productNo) == UGETW(&b->udi_productNo) &&
+	    strncmp(a->udi_serial, b->udi_serial, sizeof(a->udi_serial)) == 0;
+}
+
+int
+diff_device(struct controller *uc, int ctlr, struct usb_snap *us,
+    struct usb_device_info *od)
+{
+	struct usb_device_info *nd = &us->di;
+	struct usb_snap_config *sc;
+	char field[16], ov[USBREC_STRLEN], nv[USBREC_STRLEN];
+	const void *p;
+	size_t len;
+	int addr = us->addr, n = 0, i, port, onports, nnports;
+
+	n += diff_str(uc, addr, "vendor", od->udi_vendor, nd->udi_vendor,
+	    sizeof(nd->udi_vendor));
+	n += diff_str(uc, addr, "product", od->udi_product, nd->udi_product,
+	    sizeof(nd->udi_product));
+	n += diff_str(uc, addr, "release", od->udi_release, nd->udi_release,
+	    sizeof(nd->udi_release));
+	n += diff_num(uc, addr, "class", od->udi_class, nd->udi_class);
+	n += diff_num(uc, addr, "subclass", od->udi_subclass,
+	    nd->udi_subclass);
+	n += diff_num(uc, addr, "protocol", od->udi_protocol,
+	    nd->udi_protocol);
+	n += diff_num(uc, addr, "config", od->udi_config, nd->udi_config);
+	if (od->udi_speed != nd->udi_speed) {
+		snprintf(ov, sizeof(ov), "%s", speed_name(od->udi_speed) ?
+		    speed_name(od->udi_speed) : "unknown");
+		snprintf(nv, sizeof(nv), "%s", speed_name(nd->udi_speed) ?
+		    speed_name(nd->udi_speed) : "unknown");
+		render_change(uc, addr, "speed", ov, nv);
+		n++;
+	}
+	n += diff_num(uc, addr, "power", UGETDW(&od->udi_power),
+	    UGETDW(&nd->udi_power));
+
+	ov[0] = nv[0] = '\0';
+	for (i = 0; i < USB_MAX_DEVNAMES; i++) {
+		diff_append(ov, sizeof(ov), od->udi_devnames[i],
+		    sizeof(od->udi_devnames[i]));
+		diff_append(nv, sizeof(nv), nd->udi_devnames[i],
+		    sizeof(nd->udi_devnames[i]));
+	}
+	n += diff_str(uc, addr, "driver", ov, nv, sizeof(nv));
+
+	onports = MINIMUM(UGETDW(&od->udi_nports), nitems(od->udi_ports));
+	nnports = MINIMUM(UGETDW(&nd->udi_nports), nitems(nd->udi_ports));
+	n += diff_num(uc, addr, "nports", onports, nnports);
+	for (port = 0; port < MINIMUM(onports, nnports); port++) {
+		if ((UGETDW(&od->udi_ports[port]) & 0xffff) ==
+		    (UGETDW(&nd->udi_ports[port]) & 0xffff))
+			continue;
+		port_words(od, UGETDW(&od->udi_ports[port]) & 0xffff, ov,
+		    sizeof(ov));
+		port_words(nd, UGETDW(&nd->udi_ports[port]) & 0xffff, nv,
+		    sizeof(nv));
+		snprintf(field, sizeof(field), "port %d", port + 1);
+		render_change(uc, addr, field, ov, nv);
+		n++;
+	}
+
+	if ((us->flags & SNAP_DDESC) && (p = capture_find(capbase, ctlr,
+	    USBCAP_DDESC, addr, 0, &len)) != NULL &&
+	    (len != sizeof(us->ddd) || memcmp(&((const struct usb_device_ddesc *)
+	    p)->udd_desc, &us->ddd.udd_desc, sizeof(us->ddd.udd_desc)) != 0)) {
+		render_change(uc, addr, "ddesc", NULL, NULL);
+		n++;
+	}
+	for (i = 0; i < us->nconfigs; i++) {
+		sc = &us->configs[i];
+		if (sc->flags & SNAP_CDESC && (p = capture_find(capbase, ctlr,
+		    USBCAP_CDESC, addr, sc->index, &len)) != NULL &&
+		    (len != sizeof(sc->cd) || memcmp(&((const struct
+		    usb_device_cdesc *)p)->udc_desc, &sc->cd.udc_desc,
+		    sizeof(sc->cd.udc_desc)) != 0)) {
+			diff_config(field, sizeof(field), "cdesc", sc->index);
+			render_change(uc, addr, field, NULL, NULL);
+			n++;
+		}
+		if (sc->flags & SNAP_FDESC && (p = capture_find(capbase, ctlr,
+		    USBCAP_FDESC, addr, sc->index, &len)) != NULL &&
+		    (len != sc->len || memcmp(p, sc->data, len) != 0)) {
+			diff_config(field, sizeof(field), "fdesc", sc->index);
+			snprintf(ov, sizeof(ov), "%zu bytes", len);
+			snprintf(nv, sizeof(nv), "%u bytes", sc->len);
+			if (len != sc->len)
+				render_change(uc, addr, field, ov, nv);
+			else
+				render_change(uc, addr, field, NULL, NULL);
+			n++;
+		}
+	}
+	return n;
+}
+
+int
+diff_str(struct controller *uc, uint8_t addr, const char *field,
+    const char *old, const char *new, size_t max)
+{
+	char ov[USBREC_STRLEN], nv[USBREC_STRLEN];
+
+	if (strncmp(old, new, max) == 0)
+		return 0;
+	/* As in the kernel's structures, they might not be terminated. */
+	memcpy(ov, old, MINIMUM(max, sizeof(ov) - 1));
+	ov[MINIMUM(max, sizeof(ov) - 1)] = '\0';
+	memcpy(nv, new, MINIMUM(max, sizeof(nv) - 1));
+	nv[MINIMUM(max, sizeof(nv) - 1)] = '\0';
+	render_change(uc, addr, field, ov, nv);
+	return 1;
+}
+
+int
+diff_num(struct controller *uc, uint8_t addr, const char *field,
+    unsigned int old, unsigned int new)
+{
+	char ov[16], nv[16];
+
+	if (old == new)
+		return 0;
+	snprintf(ov, sizeof(ov), "%u", old);
+	snprintf(nv, sizeof(nv), "%u", new);
+	render_change(uc, addr, field, ov, nv);
+	return 1;
+}
+
+void
+diff_append(char *buf, size_t size, const char *s, size_t max)
+{
+	size_t len = strlen(buf);
+
+	if (s[0] == '\0')
+		return;
+	if (len > 0)
+		strlcat(buf, ",", size);
+	len = strlen(buf);
+	if (len < size - 1)
+		strncat(buf, s, MINIMUM(max, size - len - 1));
+}
+
+void
+diff_config(char *buf, size_t size, const char *what, int index)
+{
+	if (index == USB_CURRENT_CONFIG_INDEX)
+		snprintf(buf, size, "%s", what);
+	else
+		snprintf(buf, size, "%s %d", what, index);
+}
+
+/*
+ * The state of a hub port in the words of -vv.
+ */
+void
+port_words(struct usb_device_info *di, uint16_t status, char *buf,
+    size_t size)
+{
+	buf[0] = '\0';
+	if (status & UPS_CURRENT_CONNECT_STATUS)
+		strlcat(buf, " connect", size);
+	if (status & UPS_PORT_ENABLED)
+		strlcat(buf, " enabled", size);
+	if (status & UPS_SUSPEND)
+		strlcat(buf, " suspend", size);
+	if (status & UPS_OVERCURRENT_INDICATOR)
+		strlcat(buf, " overcurrent", size);
+	if (di->udi_speed < USB_SPEED_SUPER) {
+		if (status & UPS_PORT_L1)
+			strlcat(buf, " l1", size);
+		if (status & UPS_PORT_POWER)
+			strlcat(buf, " power", size);
+	} else {
+		if (status & UPS_PORT_POWER_SS)
+			strlcat(buf, " power", size);
+		if (link_state_name(UPS_PORT_LS_GET(status)) != NULL) {
+			strlcat(buf, " ", size);
+			strlcat(buf, link_state_name(UPS_PORT_LS_GET(status)),
+			    size);
+		}
+	}
+	if (buf[0] == '\0')
+		strlcpy(buf, " off", size);
+	memmove(buf, buf + 1, strlen(buf));
+}
+
+/*
+ * Find the device a driver instance is attached to.
+ */
+struct usb_snap *
+find_devname(struct controller *ctl, int ncont, const char *name,
+    struct controller **ucp)
+{
+	struct devname *dn;
+	u_int h = devname_hash(name);
+	int i;
+
+	for (i = 0; i < ncont; i++) {
+		for (dn = ctl[i].names[h]; dn != NULL; dn = dn->next) {
+			if (strncmp(dn->name, name, sizeof(dn->name)) == 0) {
+				*ucp = &ctl[i];
+				return ctl[i].devs[dn->addr];
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * -D: the listing pass alone fills the index, and only the device
+ * that has the driver is then asked for the views requested.
+ */
+int
+dump_driver(struct dump_args *da, struct controller *ctl, int ncont)
+{
+	struct controller *uc;
+	struct usb_snap *us;
+	int command = da->command;
+
+	da->command = COMM_INFO;
+	dump_controllers(ctl, ncont);
+	if ((us = find_devname(ctl, ncont, lookup, &uc)) == NULL ||
+	    (us->flags & SNAP_SKIP)) {
+		warnx("%s: no such device", lookup);
+		return 1;
+	}
+	da->command = command;
+	da->quiet = 0;
+	snap_fill(uc->fd, &uc->ar, us, command, da->config);
+	snap_render(uc, us);
+	ob_flush(&uc->ob);
+	return 0;
+}
+
+/*
+ * Query one address that is not in the table yet and report it if a
+ * device answers.
+ */
+int
+hotplug_probe(struct controller *uc, uint8_t addr)
+{
+	struct dump_args *da = uc->da;
+	struct usb_device_info di;
+	struct usb_snap *us;
+
+	if (get_device_info(uc->fd, addr, &di) == -1)
+		return -1;
+
+	/* A device that was just plugged in is never taken from the cache. */
+	us = snap_new(addr);
+	us->di = di;
+	us->flags = SNAP_INFO | SNAP_REVALIDATE;
+	snap_fill(uc->fd, &uc->ar, us, da->command, da->config);
+	if (!(us->flags & SNAP_SKIP))
+		render_event(uc, 1, us);
+	snap_render(uc, us);
+	snap_store(uc, us);
+	return 0;
+}
+
+void
+hotplug_gone(struct controller *uc, uint8_t addr)
+{
+	if (!(uc->devs[addr]->flags & SNAP_SKIP)) {
+		render_event(uc, 0, uc->devs[addr]);
+		render_info(uc, &uc->devs[addr]->di);
+	}
+	snap_drop(uc, addr);
+}
+
+/*
+ * Check a controller against the table.  Re-reading the hubs tells
+ * how many devices should be there; only when that does not match
+ * the table is every address compared the slow way.
+ */
+void
+hotplug_rescan(struct controller *uc)
+{
+	struct usb_device_info di;
+	int addr, known = 0, expected = 1;
+
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (uc->devs[addr] == NULL)
+			continue;
+		known++;
+		if (UGETDW(&uc->devs[addr]->di.udi_nports) == 0)
+			continue;
+		if (get_device_info(uc->fd, addr, &di) == -1) {
+			expected = -1;
+			break;
+		}
+		snap_reinfo(uc, uc->devs[addr], &di);
+		expected += usbdevs_connected(&di);
+	}
+	if (known == expected)
+		return;
+
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if (uc->devs[addr] == NULL)
+			continue;
+		if (get_device_info(uc->fd, addr, &di) == -1)
+			hotplug_gone(uc, addr);
+	}
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
+		if (uc->devs[addr] == NULL)
+			hotplug_probe(uc, addr);
+}
+
+/*
+ * Whether the device answering at an address is still the one the
+ * snapshot was taken of.
+ */
+int
+snap_same(struct usb_snap *us, struct usb_device_info *di)
+{
+	return UGETW(&us->di.udi_vendorNo) == UGETW(&di->udi_vendorNo) &&
+	    UGETW(&us->di.udi_productNo) == UGETW(&di->udi_productNo) &&
+	    UGETW(&us->di.udi_releaseNo) == UGETW(&di->udi_releaseNo) &&
+	    strncmp(us->di.udi_serial, di->udi_serial,
+	    sizeof(di->udi_serial)) == 0;
+}
+
+/*
+ * One incremental pass over a controller (-H -w).  Only the hubs are
+ * re-read; a port whose connect or enable status flipped, or that has
+ * a connect, enable, overcurrent or link-state change pending, is
+ * dirty.  The kernel does not say which address sits behind a port, so
+ * devices remember the port they were seen appearing on: those behind
+ * a dirty port are asked first, the others only while the tree still
+ * holds more devices than the hubs account for.  New devices get the
+ * lowest free address, which is where they are looked for.  A hub
+ * that stopped answering takes an unknown subtree with it, and any
+ * count that still does not add up falls back to hotplug_rescan().
+ */
+void
+refresh_controller(struct controller *uc)
+{
+	struct usb_device_info di;
+	struct usb_snap *us;
+	uint16_t dirty[USB_MAX_DEVICES];
+	uint8_t seen[USB_MAX_DEVICES], ghub = 0, gport = 0;
+	uint32_t was, now;
+	int addr, port, nports, pass, have = 0, expected = 1;
+	int want, gone = 0, gained = 0, replugs = 0;
+
+	memset(dirty, 0, sizeof(dirty));
+	memset(seen, 0, sizeof(seen));
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+		if ((us = uc->devs[addr]) == NULL)
+			continue;
+		have++;
+		if (UGETDW(&us->di.udi_nports) == 0)
+			continue;
+		if (get_device_info(uc->fd, addr, &di) == -1) {
+			hotplug_rescan(uc);
+			return;
+		}
+		seen[addr] = 1;
+		nports = MINIMUM(UGETDW(&di.udi_nports), nitems(di.udi_ports));
+		for (port = 0; port < nports; port++) {
+			was = UGETDW(&us->di.udi_ports[port]);
+			now = UGETDW(&di.udi_ports[port]);
+			if (!((now >> 16) & PORT_CHANGES) &&
+			    !((was ^ now) & PORT_STATUS))
+				continue;
+			dirty[addr] |= 1 << port;
+			if ((was & now & UPS_CURRENT_CONNECT_STATUS) &&
+			    ((now >> 16) & UPS_C_CONNECT_STATUS))
+				replugs++;
+			if (now & UPS_CURRENT_CONNECT_STATUS) {
+				gained++;
+				ghub = addr;
+				gport = port + 1;
+			}
+		}
+		snap_reinfo(uc, us, &di);
+		expected += usbdevs_connected(&di);
+	}
+	if (have == expected && replugs == 0)
+		return;
+
+	/*
+	 * Look for what left: first behind the dirty ports, then anywhere
+	 * but in the hubs that just answered.  A device answering with
+	 * another identity was replaced under the same address.
+	 */
+	want = MAXIMUM(have - expected, replugs);
+	for (pass = 0; pass < 2 && gone < want; pass++) {
+		for (addr = 1; addr < USB_MAX_DEVICES && gone < want; addr++) {
+			if ((us = uc->devs[addr]) == NULL || seen[addr])
+				continue;
+			if ((pass == 0) != (us->port != 0 &&
+			    (dirty[us->parent] & (1 << (us->port - 1)))))
+				continue;
+			seen[addr] = 1;
+			if (get_device_info(uc->fd, addr, &di) == 0 &&
+			    snap_same(us, &di)) {
+				snap_reinfo(uc, us, &di);
+				continue;
+			}
+			hotplug_gone(uc, addr);
+			have--;
+			gone++;
+		}
+	}
+
+	for (addr = 1; addr < USB_MAX_DEVICES && have < expected; addr++) {
+		if (uc->devs[addr] != NULL)
+			continue;
+		if (hotplug_probe(uc, addr) == -1)
+			break;
+		have++;
+		if (gained == 1) {
+			uc->devs[addr]->parent = ghub;
+			uc->devs[addr]->port = gport;
+		}
+	}
+	if (have != expected)
+		hotplug_rescan(uc);
+}
+
+/*
+ * -H -w: print the current devices, then poll the hub ports every
+ * wait seconds instead of reading hotplug(4), which only one process
+ * can have open and hotplugd(8) usually does.
+ */
+void
+watch_refresh(struct dump_args *da, struct controller *ctl, int ncont)
+{
+	struct kevent kev;
+	int kq, i;
+
+	if ((kq = kqueue()) == -1)
+		err(trouble, "kqueue");
+	EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD, 0, da->interval / 1000000,
+	    NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1)
+		err(trouble, "kevent");
+
+	dump_controllers(ctl, ncont);
+
+	for (;;) {
+		if (kevent(kq, NULL, 0, &kev, 1, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "kevent");
+		}
+		for (i = 0; i < ncont; i++) {
+			if (ctl[i].fd == -1)
+				continue;
+			refresh_controller(&ctl[i]);
+			ob_flush(&ctl[i].ob);
+		}
+		cache_save();
+	}
+}
+
+/*
+ * Add a controller to the table, which grows as needed and so may
+ * move: pointers into it do not survive this call.
+ */
+struct controller *
+controller_open(struct controller **ctlp, int *ncont, const char *path)
+{
+	struct controller *uc;
+
+	if ((uc = reallocarray(*ctlp, *ncont + 1, sizeof(*uc))) == NULL)
+		err(trouble, NULL);
+	*ctlp = uc;
+	uc = &uc[*ncont];
+	memset(uc, 0, sizeof(*uc));
+	if (strlcpy(uc->path, path, sizeof(uc->path)) >= sizeof(uc->path)) {
+		warnc(ENAMETOOLONG, "%s", path);
+		controller_unopened(path);
+		return NULL;
+	}
+	if ((uc->fd = controller_fd(uc->path)) < 0) {
+		if (errno != ENOENT && errno != ENXIO) {
+			warn("%s", uc->path);
+			controller_unopened(path);
+		}
+		return NULL;
+	}
+	uc->ob.fd = serving ? -1 : STDOUT_FILENO;
+	uc->unit = *ncont;
+	uc->bus = controller_bus(path);
+	(*ncont)++;
+	return uc;
+}
+
+/*
+ * Open a controller, for writing as well if USB_REQUEST is to be sent;
+ * without the permission for that, what can be done read-only still is.
+ */
+int
+controller_fd(const char *path)
+{
+	int fd;
+
+	if (openmode == O_RDWR) {
+		if ((fd = usbdevs_open(path, O_RDWR)) >= 0 ||
+		    (errno != EACCES && errno != EPERM))
+			return fd;
+		warn("%s: no USB_REQUEST", path);
+	}
+	return usbdevs_open(path, O_RDONLY);
+}
+
+/*
+ * Under -x, a controller that is there but cannot be opened is not to
+ * be taken for gone, and neither is any when /dev cannot be listed.
+ */
+void
+controller_unopened(const char *path)
+{
+	char **p;
+
+	if (capbase == NULL)
+		return;
+	if ((p = reallocarray(unopened, nunopened + 1, sizeof(*p))) == NULL)
+		err(trouble, NULL);
+	unopened = p;
+	if ((unopened[nunopened++] = strdup(path)) == NULL)
+		err(trouble, NULL);
+	unread++;
+}
+
+int
+controller_unread(const char *path)
+{
+	size_t i;
+
+	if (unlisted)
+		return 1;
+	for (i = 0; i < nunopened; i++)
+		if (strncmp(unopened[i], path, USBCAP_PATHLEN) == 0)
+			return 1;
+	return 0;
+}
+
+void
+controller_found(const char *path, void *arg)
+{
+	struct controller_scan *cs = arg;
+
+	controller_open(cs->ctlp, cs->ncont, path);
+}
+
+void
+controller_close(struct controller *uc)
+{
+	int addr;
+
+	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
+		snap_drop(uc, addr);
+	arena_free(&uc->ar);
+	ob_flush(&uc->ob);
+	free(uc->ob.buf);
+	memset(&uc->ob, 0, sizeof(uc->ob));
+	usbdevs_close(uc->fd);
+	uc->fd = -1;
 }
 
 void
-print_device(int fd, uint8_t addr)
+hotplug_attach(struct dump_args *da, struct controller **ctlp, int *ncont,
+    const char *name)
 {
-	struct usb_device_ddesc ddd;
-	ddd.udd_addr = addr;
+	struct controller *ctl = *ctlp, *uc;
+	char path[PATH_MAX];
+	int i, addr, unit, found = 0;
 
-	if (ioctl(fd, USB_DEVICE_GET_DDESC, &ddd) == -1) {
-		if (errno != ENXIO)
-			warn("addr %u", addr);
+	if (find_devname(ctl, *ncont, name, &uc) != NULL)
+		return;
+
+	if (sscanf(name, "usb%d", &unit) == 1) {
+		snprintf(path, sizeof(path), "%s%d", USBDEV, unit);
+		for (i = 0; i < *ncont; i++)
+			if (ctl[i].fd != -1 && strcmp(ctl[i].path, path) == 0)
+				return;
+		if ((uc = controller_open(ctlp, ncont, path)) != NULL) {
+			uc->da = da;
+			dump_controller(uc);
+		}
 		return;
 	}
 
-	printf("addr %02u: max packet: %2u, num configs: %u, "
-	    "iManufacturer: %hhu\n",
-	    addr, ddd.udd_desc.bMaxPacketSize,
-	    ddd.udd_desc.bNumConfigurations,
-	    ddd.udd_desc.iManufacturer);
+	/*
+	 * The kernel hands a new device the lowest free address of its
+	 * bus, so looking there on each controller is usually all it
+	 * takes.  Secondary drivers of a device that is already known
+	 * were caught by find_devname above.
+	 */
+	for (i = 0; i < *ncont; i++) {
+		if (ctl[i].fd == -1)
+			continue;
+		for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+			if (ctl[i].devs[addr] != NULL)
+				continue;
+			if (hotplug_probe(&ctl[i], addr) == -1)
+				break;
+			found++;
+		}
+	}
+	if (found)
+		return;
+
+	/*
+	 * Either the event is not about a USB device (sd0 on top of umass0,
+	 * say) or addresses were reused behind our back; a rescan sorts
+	 * out the latter and finds nothing new for the former.
+	 */
+	for (i = 0; i < *ncont; i++)
+		if (ctl[i].fd != -1)
+			hotplug_rescan(&ctl[i]);
 }
 
-uint16_t
-print_config(int fd, uint8_t addr, int config, bool quiet)
+void
+hotplug_detach(struct controller *ctl, int ncont, const char *name)
 {
-	struct usb_device_cdesc cd;
-	cd.udc_addr = addr;
-	cd.udc_config_index = config;
+	struct controller *uc;
+	struct usb_device_info di;
+	struct usb_snap *us;
+	char path[PATH_MAX];
+	int i, unit;
 
-	if (ioctl(fd, USB_DEVICE_GET_CDESC, &cd) == -1) {
-		if (errno != ENXIO)
-			warn("addr %u", addr);
-		return 0;
+	if (sscanf(name, "usb%d", &unit) == 1) {
+		snprintf(path, sizeof(path), "%s%d", USBDEV, unit);
+		for (i = 0; i < ncont; i++)
+			if (ctl[i].fd != -1 && strcmp(ctl[i].path, path) == 0)
+				controller_close(&ctl[i]);
+		return;
 	}
 
-	if (quiet)
-		goto end;
-
-	printf("addr %02u, config %02u: interfaces: %u, "
-	    "max-power: %umA", addr, cd.udc_desc.bConfigurationValue,
-	    cd.udc_desc.bNumInterfaces,
-	    cd.udc_desc.bMaxPower * UC_POWER_FACTOR);
-	printf("\n\t attr 0x%02x:", cd.udc_desc.bmAttributes);
-	if (cd.udc_desc.bmAttributes & UC_BUS_POWERED)
-		printf(" bus-powered");
-	if (cd.udc_desc.bmAttributes & UC_SELF_POWERED)
-		printf(" self-powered");
-	if (cd.udc_desc.bmAttributes & UC_REMOTE_WAKEUP)
-		printf(" remote-wakeup");
+	if ((us = find_devname(ctl, ncont, name, &uc)) == NULL)
+		return;
 
-	puts("");
-end:
-	return UGETW(&cd.udc_desc.wTotalLength);
+	/*
+	 * A device with several drivers sends one event per driver; it is
+	 * only gone once its address stops answering.
+	 */
+	if (get_device_info(uc->fd, us->addr, &di) == -1)
+		hotplug_gone(uc, us->addr);
+	else
+		snap_reinfo(uc, us, &di);
 }
 
+/*
+ * Print the current devices, then follow hotplug(4) and report each
+ * device as it comes and goes, touching only the controllers and
+ * addresses an event can concern.
+ */
 void
-print_fconfig(u_char* cur)
+watch_hotplug(struct dump_args *da, struct controller **ctlp, int *ncont)
 {
-	printf("config %02u:\n", *(cur + 5));
-}
+	struct controller *ctl = *ctlp;
+	struct hotplug_event he;
+	ssize_t n;
+	int fd, i;
 
-void
-print_iface(u_char* cur)
-{
-	printf("\t iface: %02u, altset: %02u, numendpts: %02u, "
-	    "class: %02u, subclass: %02u, protocol: %02u\n",
-	    *(cur + 2), *(cur + 3), *(cur + 4), *(cur + 5),
-	    *(cur + 6), *(cur + 7));
-}
+	if ((fd = open(_PATH_HOTPLUG, O_RDONLY)) == -1)
+		err(trouble, "%s", _PATH_HOTPLUG);
 
-void
-print_endpt(u_char* cur)
-{
-	printf("\t \t endpt_addr: %02u, dir: %s, ",
-	    (*(cur + 2) & 0x3), *(cur + 2) & 0x7 ? "in" : "out");
+	dump_controllers(ctl, *ncont);
 
-	switch (*(cur +3) & 0x3) {
-	case 0:
-		printf("control, ");
-		break;
-	case 1:
-		printf("isochronous, ");
-		printf("sync_type: ");
-		switch (*(cur + 3) & 0xC) {
-		case 0:
-			printf("none, ");
-			break;
-		case 1:
-			printf("async, ");
+	for (;;) {
+		if ((n = read(fd, &he, sizeof(he))) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "%s", _PATH_HOTPLUG);
+		}
+		if (n == 0)
 			break;
-		case 2:
-			printf("adaptive, ");
+		if (n != sizeof(he)) {
+			warnx("%s: short read", _PATH_HOTPLUG);
+			continue;
+		}
+		he.he_devname[sizeof(he.he_devname) - 1] = '\0';
+
+		switch (he.he_type) {
+		case HOTPLUG_DEVAT:
+			hotplug_attach(da, ctlp, ncont, he.he_devname);
+			ctl = *ctlp;
 			break;
-		case 3:
-			printf("sync, ");
+		case HOTPLUG_DEVDT:
+			hotplug_detach(ctl, *ncont, he.he_devname);
 			break;
 		}
-		break;
-	case 2:
-		printf("bulk, ");
-		break;
-	case 3:
-		printf("interrupt, ");
-		break;
+		for (i = 0; i < *ncont; i++)
+			ob_flush(&ctl[i].ob);
+		/* Usually only stopped by a signal, so save as we go. */
+		cache_save();
 	}
+	close(fd);
+}
 
-	printf("max_packet: %u, polling_interval: %02u\n",
-	    UGETW(cur + 4), *(cur + 6));
+/*
+ * Daemon mode (-L socket).  The controllers stay open and every device is
+ * kept in the snapshot table with all of its descriptors, refreshed by
+ * hotplug(4) events, or by polling the hub ports when someone else has
+ * hotplug(4) open; USB_DEVICESTATS is sampled, and the ports polled, every
+ * -w interval.  A client connects, sends one request line and is sent the
+ * answer, rendered from memory without a single ioctl, before the
+ * connection is closed.  The line is made of words: "text", "json" or
+ * "bin" pick the format, "info", "ddesc", "cdesc", "fdesc" and "stats" the
+ * views, "verbose" is -v, "all" asks for every configuration and an
+ * address list as for -a for just those devices.  "driver" and a name such
+ * as umass0 is the one device that driver is attached to instead, found in
+ * the index hotplug(4) keeps current.  An empty line is the default device
+ * listing.
+ */
+int
+serve_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errc(trouble, ENAMETOOLONG, "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(trouble, "socket");
+	if (unlink(path) == -1 && errno != ENOENT)
+		err(trouble, "%s", path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(trouble, "%s", path);
+	if (listen(fd, SERVE_BACKLOG) == -1)
+		err(trouble, "listen");
+	return fd;
 }
 
-void
-print_unknown(u_char* cur)
+int
+serve_request(char *line, struct dump_args *qa, int *format, int *verb,
+    const char **driver)
 {
-	printf("\t unknown: %02u", *(cur + 1));
-	for (size_t i = 0; i < *cur; i++) {
-		if (i % 10 == 0)
-			printf("\n\t ");
-		printf("0x%02x ", *(cur + i));
+	char *word;
+
+	memset(qa, 0, sizeof(*qa));
+	qa->config = USB_CURRENT_CONFIG_INDEX;
+	*format = OFMT_TEXT;
+	*verb = 0;
+	*driver = NULL;
+	while ((word = strsep(&line, " \t\r")) != NULL) {
+		if (*word == '\0')
+			continue;
+		if (strcmp(word, "driver") == 0) {
+			while ((word = strsep(&line, " \t\r")) != NULL &&
+			    *word == '\0')
+				;
+			if (word == NULL || *driver != NULL)
+				return -1;
+			*driver = word;
+		} else if (strcmp(word, "text") == 0)
+			*format = OFMT_TEXT;
+		else if (strcmp(word, "json") == 0)
+			*format = OFMT_JSON;
+		else if (strcmp(word, "bin") == 0)
+			*format = OFMT_BIN;
+		else if (strcmp(word, "verbose") == 0)
+			*verb = 1;
+		else if (strcmp(word, "info") == 0)
+			qa->command |= COMM_INFO;
+		else if (strcmp(word, "ddesc") == 0)
+			qa->command |= COMM_DDSC;
+		else if (strcmp(word, "cdesc") == 0)
+			qa->command |= COMM_CDSC;
+		else if (strcmp(word, "fdesc") == 0)
+			qa->command |= COMM_FDSC;
+		else if (strcmp(word, "stats") == 0)
+			qa->command |= COMM_STAT;
+		else if (strcmp(word, "all") == 0)
+			qa->config = CONFIG_ALL;
+		else {
+			if (parse_addrs(word, qa) == -1)
+				return -1;
+		}
+	}
+	if (*driver != NULL && qa->naddrs)
+		return -1;
+	/* As on the command line, -v adds the listing to the other views. */
+	if (qa->command == 0 || (*verb && qa->command != COMM_STAT))
+		qa->command |= COMM_INFO;
+	return 0;
+}
+
+/*
+ * Write as much of an answer as the client takes without blocking: 1
+ * once it is all out, 0 if the rest has to wait for EVFILT_WRITE, -1
+ * if the client went away.  A client that is slow to read holds up no
+ * one else; it is only dropped once SERVE_TIMEOUT is up.
+ */
+int
+serve_send(struct serve_client *cl)
+{
+	ssize_t n;
+
+	while (cl->off < cl->out.len) {
+		if ((n = write(cl->fd, cl->out.buf + cl->off,
+		    cl->out.len - cl->off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		cl->off += n;
 	}
-	printf("\n");
+	return 1;
 }
 
+/*
+ * Answer one request the way dump_controller would have printed it,
+ * controller by controller, from the snapshot table, into ob.
+ */
 void
-print_full(int fd, uint8_t addr, int config, uint16_t wtotlen)
+serve_answer(struct obuf *ob, char *line, struct controller *ctl, int ncont)
 {
-	struct usb_device_fdesc dfd;
-	dfd.udf_addr = addr;
-	dfd.udf_config_index = config;
-	dfd.udf_size = wtotlen;
-	if ((dfd.udf_data = (u_char *)malloc(wtotlen)) == NULL)
-		errx(1, "malloc");
+	struct dump_args qa, *da;
+	struct controller *uc, *duc = NULL;
+	struct usb_snap *dus = NULL;
+	const char *driver;
+	int i, addr, format, verb, saved = oformat, savedverb = verbose;
 
-	if (ioctl(fd, USB_DEVICE_GET_FDESC, &dfd) == -1) {
-		if (errno != ENXIO)
-			warn("addr %u", addr);
+	if (serve_request(line, &qa, &format, &verb, &driver) == -1) {
+		ob_str(ob, "error: bad request\n");
+		free(qa.addrs);
+		return;
+	}
+	if (driver != NULL &&
+	    (dus = find_devname(ctl, ncont, driver, &duc)) == NULL) {
+		ob_str(ob, "error: no such device\n");
+		free(qa.addrs);
 		return;
 	}
 
-	printf("addr %02u, ", addr);
-	for (u_char* cur = dfd.udf_data; cur < dfd.udf_data + wtotlen;
-	    cur += *cur) {
-		switch (*(cur + 1)) {
-		case C_DESC:
-			print_fconfig(cur);
-			break;
-		case I_DESC:
-			print_iface(cur);
-			break;
-		case E_DESC:
-			print_endpt(cur);
-			break;
-		case S_DESC:			
-		default:
-			print_unknown(cur);
-			break;
+	oformat = format;
+	verbose = verb;
+	if (oformat == OFMT_BIN)
+		bin_file(ob);
+	for (i = 0; i < ncont; i++) {
+		if ((uc = &ctl[i])->fd == -1 || (duc != NULL && uc != duc))
+			continue;
+		da = uc->da;
+		uc->da = &qa;
+		if ((qa.naddrs == 0 && dus == NULL) || qa.command == COMM_STAT)
+			render_controller(uc);
+		if (qa.command != COMM_STAT && dus != NULL)
+			snap_render(uc, dus);
+		else if (qa.command != COMM_STAT) {
+			for (addr = 1; addr < USB_MAX_DEVICES; addr++)
+				if (uc->devs[addr] != NULL &&
+				    addr_selected(&qa, uc->bus, addr))
+					snap_render(uc, uc->devs[addr]);
 		}
+		if ((qa.command & COMM_STAT) && uc->stats_ns != 0)
+			render_stats(uc, &uc->stats, uc->stats_ns);
+		uc->da = da;
+		ob_write(ob, uc->ob.buf, uc->ob.len);
+		uc->ob.len = 0;
 	}
+	oformat = saved;
+	verbose = savedverb;
+	free(qa.addrs);
 }
 
 void
-dump_controller(char *name, int fd, uint8_t addr)
+serve_sample(struct controller *ctl, int ncont)
 {
-	memset(done, 0, sizeof(done));
+	int i;
 
-	if (addr) {
-		dump_device(fd, addr);
-		return;
+	for (i = 0; i < ncont; i++) {
+		if (ctl[i].fd == -1 ||
+		    get_stats(ctl[i].path, ctl[i].fd, &ctl[i].stats) == -1)
+			continue;
+		ctl[i].stats_ns = mono_ns();
 	}
+}
 
-	printf("Controller %s:\n", name);
-	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
-		if (!done[addr])
-			dump_device(fd, addr);
+/*
+ * Whatever filling the snapshots rendered on the way is of no use to
+ * anyone; only answers are written out.
+ */
+void
+serve_discard(struct controller *ctl, int ncont)
+{
+	int i;
+
+	for (i = 0; i < ncont; i++)
+		ctl[i].ob.len = 0;
 }
 
 void
-dump_stats(char *name, int fd)
+serve_refresh(struct controller *ctl, int ncont)
 {
-	struct usb_device_stats ds;
-	
-	printf("Controller %s:", name);
-	if (ioctl(fd, USB_DEVICESTATS, &ds) == -1) {
-		if (errno != ENXIO)
-			warn("controller %s", name);
-		return;
-	}
-	
-	printf("\n\t Transfers completed:");
-	printf("\n\t Control: %lu", ds.uds_requests[0]);
-	printf("\n\t Isochronous: %lu", ds.uds_requests[1]);
-	printf("\n\t Bulk: %lu", ds.uds_requests[2]);
-	printf("\n\t Interrupt: %lu\n", ds.uds_requests[3]);
+	int i;
+
+	for (i = 0; i < ncont; i++)
+		if (ctl[i].fd != -1)
+			refresh_controller(&ctl[i]);
+	serve_discard(ctl, ncont);
+	cache_save();
 }
 
 void
-dump_device_desc(char *name, int fd, uint8_t addr)
+serve_drop(int kq, struct serve_client *cl, int slot)
 {
-	if (addr) {
-		print_device(fd, addr);
-		return;
+	struct kevent kev;
+
+	EV_SET(&kev, cl->fd, cl->writing ? EVFILT_WRITE : EVFILT_READ,
+	    EV_DELETE, 0, 0, NULL);
+	kevent(kq, &kev, 1, NULL, 0, NULL);
+	EV_SET(&kev, SERVE_TIMER + 1 + slot, EVFILT_TIMER, EV_DELETE, 0, 0,
+	    NULL);
+	kevent(kq, &kev, 1, NULL, 0, NULL);
+	close(cl->fd);
+	cl->fd = -1;
+	free(cl->out.buf);
+	memset(&cl->out, 0, sizeof(cl->out));
+}
+
+void
+serve(const char *path, struct dump_args *da, struct controller **ctlp,
+    int *ncont)
+{
+	struct controller *ctl = *ctlp;
+	struct serve_client clients[SERVE_CLIENTS], *cl;
+	struct kevent kev[3 + 2 * SERVE_CLIENTS], ev[2];
+	struct hotplug_event he;
+	char *nl;
+	ssize_t n;
+	int kq, lfd, hfd = -1, cfd, i, nev;
+
+	/* Everything a request can ask for, current configuration too. */
+	da->command = COMM_INFO | COMM_DDSC | COMM_FDSC;
+	da->config = CONFIG_ALL;
+	for (i = 0; i < *ncont; i++) {
+		ctl[i].ob.fd = -1;
+		if (ctl[i].fd == -1)
+			continue;
+		if (workers > 1)
+			fetch_controller(&ctl[i]);
+		else
+			usbdevs_walk(ctl[i].fd, sweep ? USBDEVS_SWEEP : 0,
+			    walk_snap, &ctl[i]);
 	}
+	serve_discard(ctl, *ncont);
+	serve_sample(ctl, *ncont);
+	if (metrics != NULL)
+		metrics_write(metrics, ctl, *ncont);
+	cache_save();
 
-	printf("Controller %s:\n", name);
-	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
-		print_device(fd, addr);
+	memset(clients, 0, sizeof(clients));
+	for (i = 0; i < SERVE_CLIENTS; i++)
+		clients[i].fd = -1;
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		err(trouble, "signal");
+	if ((kq = kqueue()) == -1)
+		err(trouble, "kqueue");
+	lfd = serve_listen(path);
+	EV_SET(&kev[0], lfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	EV_SET(&kev[1], SERVE_TIMER, EVFILT_TIMER, EV_ADD, 0,
+	    da->interval / 1000000, NULL);
+	if (kevent(kq, kev, 2, NULL, 0, NULL) == -1)
+		err(trouble, "kevent");
+
+	/* A replay has no hotplug events to follow. */
+	if (capin == NULL) {
+		if ((hfd = open(_PATH_HOTPLUG, O_RDONLY)) == -1) {
+			if (errno != EBUSY)
+				err(trouble, "%s", _PATH_HOTPLUG);
+			warn("%s: polling hub ports instead", _PATH_HOTPLUG);
+		} else {
+			EV_SET(&ev[0], hfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+			if (kevent(kq, ev, 1, NULL, 0, NULL) == -1)
+				err(trouble, "kevent");
+		}
+	}
+
+	for (;;) {
+		if ((nev = kevent(kq, NULL, 0, kev, nitems(kev), NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "kevent");
+		}
+		for (i = 0; i < nev; i++) {
+			if (kev[i].filter == EVFILT_TIMER &&
+			    kev[i].ident != SERVE_TIMER) {
+				/* Out of time for this client. */
+				cl = kev[i].udata;
+				if (cl->fd != -1)
+					serve_drop(kq, cl, cl - clients);
+				continue;
+			}
+			if (kev[i].filter == EVFILT_TIMER) {
+				serve_sample(ctl, *ncont);
+				if (hfd == -1 && capin == NULL)
+					serve_refresh(ctl, *ncont);
+				if (metrics != NULL)
+					metrics_write(metrics, ctl, *ncont);
+				continue;
+			}
+			if ((int)kev[i].ident == lfd) {
+				if ((cfd = accept(lfd, NULL, NULL)) == -1) {
+					if (errno != EINTR &&
+					    errno != ECONNABORTED)
+						warn("accept");
+					continue;
+				}
+				for (cl = clients; cl < clients +
+				    SERVE_CLIENTS && cl->fd != -1; cl++)
+					;
+				/*
+				 * From now on the client has SERVE_TIMEOUT
+				 * to ask and to read the answer.
+				 */
+				EV_SET(&ev[0], cfd, EVFILT_READ, EV_ADD, 0, 0,
+				    cl);
+				EV_SET(&ev[1], SERVE_TIMER + 1 + (cl - clients),
+				    EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+				    SERVE_TIMEOUT * 1000, cl);
+				if (cl == clients + SERVE_CLIENTS ||
+				    fcntl(cfd, F_SETFL, O_NONBLOCK) == -1 ||
+				    kevent(kq, ev, 2, NULL, 0, NULL) == -1) {
+					close(cfd);
+					continue;
+				}
+				cl->fd = cfd;
+				cl->len = 0;
+				cl->off = 0;
+				cl->writing = 0;
+				continue;
+			}
+			if ((int)kev[i].ident == hfd) {
+				if ((n = read(hfd, &he, sizeof(he))) == -1) {
+					if (errno == EINTR)
+						continue;
+					err(trouble, "%s", _PATH_HOTPLUG);
+				}
+				if (n == 0) {
+					/* Keep serving what is known. */
+					warnx("%s: end of file", _PATH_HOTPLUG);
+					EV_SET(&ev[0], hfd, EVFILT_READ,
+					    EV_DELETE, 0, 0, NULL);
+					kevent(kq, ev, 1, NULL, 0, NULL);
+					close(hfd);
+					hfd = -1;
+					continue;
+				}
+				if (n != sizeof(he))
+					continue;
+				he.he_devname[sizeof(he.he_devname) - 1] = '\0';
+				if (he.he_type == HOTPLUG_DEVAT) {
+					hotplug_attach(da, ctlp, ncont,
+					    he.he_devname);
+					ctl = *ctlp;
+				} else if (he.he_type == HOTPLUG_DEVDT)
+					hotplug_detach(ctl, *ncont,
+					    he.he_devname);
+				serve_discard(ctl, *ncont);
+				cache_save();
+				continue;
+			}
+
+			cl = kev[i].udata;
+			if (cl < clients || cl >= clients + SERVE_CLIENTS ||
+			    cl->fd != (int)kev[i].ident)
+				continue;
+			if (kev[i].filter == EVFILT_WRITE) {
+				if (serve_send(cl) != 0)
+					serve_drop(kq, cl, cl - clients);
+				continue;
+			}
+			n = read(cl->fd, cl->buf + cl->len,
+			    sizeof(cl->buf) - 1 - cl->len);
+			if (n == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (n <= 0) {
+				serve_drop(kq, cl, cl - clients);
+				continue;
+			}
+			cl->len += n;
+			cl->buf[cl->len] = '\0';
+			if ((nl = strchr(cl->buf, '\n')) == NULL &&
+			    cl->len < sizeof(cl->buf) - 1)
+				continue;
+			if (nl != NULL)
+				*nl = '\0';
+			cl->out.fd = -1;
+			serve_answer(&cl->out, cl->buf, ctl, *ncont);
+			if (serve_send(cl) != 0) {
+				serve_drop(kq, cl, cl - clients);
+				continue;
+			}
+			/* The rest as the client makes room for it. */
+			EV_SET(&ev[0], cl->fd, EVFILT_READ, EV_DELETE, 0, 0,
+			    NULL);
+			EV_SET(&ev[1], cl->fd, EVFILT_WRITE, EV_ADD, 0, 0, cl);
+			if (kevent(kq, ev, 2, NULL, 0, NULL) == -1) {
+				serve_drop(kq, cl, cl - clients);
+				continue;
+			}
+			cl->writing = 1;
+		}
+	}
+}
+
+/*
+ * A label value, with the escapes the exposition format wants.
+ */
+void
+metrics_label(struct obuf *ob, const char *s)
+{
+	ob_char(ob, '"');
+	for (; *s != '\0'; s++) {
+		if (*s == '\\' || *s == '"')
+			ob_char(ob, '\\');
+		if (*s == '\n')
+			ob_str(ob, "\\n");
+		else
+			ob_char(ob, *s);
+	}
+	ob_char(ob, '"');
 }
 
+/*
+ * -M: replace the textfile with the transfer counters of the last
+ * sample and the devices attached, by speed, in the OpenMetrics text
+ * format.  It is written next to the target and renamed over it, so a
+ * scrape never sees half of one.
+ */
 void
-dump_config(char *name, int fd, uint8_t addr, int config)
+metrics_write(const char *path, struct controller *ctl, int ncont)
 {
-	if (addr) {
-		print_config(fd, addr, config, false);
+	struct obuf ob;
+	struct usb_snap *us;
+	char tmp[PATH_MAX];
+	int count[nitems(speed_names)];
+	int fd, i, t, addr, speed;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		warnc(ENAMETOOLONG, "%s", path);
+		return;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
 		return;
 	}
+	memset(&ob, 0, sizeof(ob));
+	ob.fd = -1;
 
-	printf("Controller %s:\n", name);
-	for (addr = 1; addr < USB_MAX_DEVICES; addr++)
-		print_config(fd, addr, config, false);
+	ob_str(&ob, "# TYPE usb_transfers counter\n"
+	    "# HELP usb_transfers Transfers completed by the controller.\n");
+	for (i = 0; i < ncont; i++) {
+		if (ctl[i].fd == -1 || ctl[i].stats_ns == 0)
+			continue;
+		for (t = 0; t < (int)nitems(xfer_names); t++) {
+			ob_str(&ob, "usb_transfers_total{controller=");
+			metrics_label(&ob, ctl[i].path);
+			ob_str(&ob, ",type=\"");
+			ob_str(&ob, xfer_names[t]);
+			ob_str(&ob, "\"} ");
+			ob_dec(&ob, ctl[i].stats.uds_requests[t], 0);
+			ob_char(&ob, '\n');
+		}
+	}
+
+	ob_str(&ob, "# TYPE usb_devices gauge\n"
+	    "# HELP usb_devices Devices attached, by speed.\n");
+	for (i = 0; i < ncont; i++) {
+		if (ctl[i].fd == -1)
+			continue;
+		memset(count, 0, sizeof(count));
+		for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
+			us = ctl[i].devs[addr];
+			if (us == NULL || !(us->flags & SNAP_INFO) ||
+			    (us->flags & SNAP_SKIP))
+				continue;
+			speed = us->di.udi_speed;
+			if (speed_name(speed) == NULL)
+				speed = 0;
+			count[speed]++;
+		}
+		for (speed = 0; speed < (int)nitems(speed_names); speed++) {
+			ob_str(&ob, "usb_devices{controller=");
+			metrics_label(&ob, ctl[i].path);
+			ob_str(&ob, ",speed=\"");
+			ob_str(&ob, speed_name(speed) != NULL ?
+			    speed_name(speed) : "unknown");
+			ob_str(&ob, "\"} ");
+			ob_dec(&ob, count[speed], 0);
+			ob_char(&ob, '\n');
+		}
+	}
+	ob_str(&ob, "# EOF\n");
+
+	/* Readable by whichever user the collector runs as. */
+	if (fchmod(fd, 0644) == -1 ||
+	    write(fd, ob.buf, ob.len) != (ssize_t)ob.len) {
+		warn("%s", tmp);
+		free(ob.buf);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	free(ob.buf);
+	if (close(fd) == -1) {
+		warn("%s", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, path) == -1) {
+		warn("rename %s", path);
+		unlink(tmp);
+	}
 }
 
+/*
+ * -M without -L: fill the tables once, then every wait seconds poll
+ * the hub ports as -H -w does, take one USB_DEVICESTATS sample per
+ * controller and rewrite the textfile.  Without -w it is written once.
+ */
 void
-full_dump(char *name, int fd, uint8_t addr, int config)
+watch_metrics(struct dump_args *da, struct controller *ctl, int ncont)
 {
-	uint16_t wtotlen;
-	if (addr) {
-		wtotlen = print_config(fd, addr, config, true);
-		print_full(fd, addr, config, wtotlen);
+	struct kevent kev;
+	int kq, i;
+
+	for (i = 0; i < ncont; i++)
+		ctl[i].ob.fd = -1;
+	dump_controllers(ctl, ncont);
+	serve_discard(ctl, ncont);
+	serve_sample(ctl, ncont);
+	metrics_write(metrics, ctl, ncont);
+	if (da->interval == 0)
 		return;
-	}
 
-	printf("Controller %s:\n", name);
-	for (addr = 1; addr < USB_MAX_DEVICES; addr++) {
-		wtotlen = print_config(fd, addr, config, true);
-		print_full(fd, addr, config, wtotlen);
+	if ((kq = kqueue()) == -1)
+		err(trouble, "kqueue");
+	EV_SET(&kev, 1, EVFILT_TIMER, EV_ADD, 0, da->interval / 1000000,
+	    NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1)
+		err(trouble, "kevent");
+
+	for (;;) {
+		if (kevent(kq, NULL, 0, &kev, 1, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(trouble, "kevent");
+		}
+		serve_refresh(ctl, ncont);
+		serve_sample(ctl, ncont);
+		metrics_write(metrics, ctl, ncont);
 	}
 }
-	
 
 int
 main(int argc, char **argv)
 {
-	int ch, fd;
-	int cfgnum = USB_CURRENT_CONFIG_INDEX;
-	int command = COMM_INFO;
-	char *controller = NULL;
-	uint8_t addr = 0;
+	struct controller *ctl = NULL;
+	struct dump_args da;
+	int ch, i, ncont = 0;
+	char *controller = NULL, *cachefile = NULL;
+	char *capture_in = NULL, *capture_out = NULL, *sockpath = NULL;
+	char *baseline = NULL;
+	int tracing = 0, status = 0;
 	const char *errstr;
+	const char *opts =
+	    "ABa:b:C:c::D:d:ef::Hi:j:k:L:M:n:o:P:pR:r:Sst:TvW:w:x:?";
 
-	while ((ch = getopt(argc, argv, "a:c::d:ef::sv?")) != -1) {
+	memset(&da, 0, sizeof(da));
+	da.config = USB_CURRENT_CONFIG_INDEX;
+
+	/*
+	 * Like diff(1), -x exits 2 on trouble, so it is looked for before
+	 * any other option can fail.
+	 */
+	opterr = 0;
+	while ((ch = getopt(argc, argv, opts)) != -1)
+		if (ch == 'x')
+			trouble = 2;
+	opterr = 1;
+	optreset = optind = 1;
+
+	while ((ch = getopt(argc, argv, opts)) != -1) {
 		switch (ch) {
+		case 'A':
+			sweep = 1;
+			break;
+		case 'B':
+			bandwidth = 1;
+			break;
 		case 'a':
-			addr = strtonum(optarg, 1, USB_MAX_DEVICES-1, &errstr);
+			if (parse_addrs(optarg, &da) == -1)
+				errx(trouble, "addr %s: invalid", optarg);
+			break;
+		case 'b':
+			filter.bus = strtonum(optarg, 0, 255, &errstr);
 			if (errstr)
-				errx(1, "addr %s", errstr);
+				errx(trouble, "bus %s", errstr);
+			filtering = 1;
+			break;
+		case 'C':
+			cachefile = optarg;
 			break;
 		case 'c':
-			command = COMM_CDSC;
-			if (optarg) {
-				cfgnum = strtonum(optarg, 1,
-				    USB_MAX_CONFIGS, &errstr) - 1;
-				if (errstr)
-					errx(1, "config %s", errstr);
-			}				
+			da.command |= COMM_CDSC;
+			if (optarg)
+				da.config = parse_config(optarg);
+			else if (optind < argc &&
+			    strcmp(argv[optind], "all") == 0) {
+				/* Optional arguments must be attached. */
+				da.config = CONFIG_ALL;
+				optind++;
+			}
+			break;
+		case 'D':
+			lookup = optarg;
 			break;
 		case 'd':
 			controller = optarg;
 			break;
 		case 'e':
-			command = COMM_DDSC;
+			da.command |= COMM_DDSC;
 			break;
 		case 'f':
-			command = COMM_FDSC;
-			if (optarg) {
-				cfgnum = strtonum(optarg, 1,
-				    USB_MAX_CONFIGS, &errstr) - 1;
-				if (errstr)
-					errx(1, "config %s", errstr);
+			da.command |= COMM_FDSC;
+			if (optarg)
+				da.config = parse_config(optarg);
+			else if (optind < argc &&
+			    strcmp(argv[optind], "all") == 0) {
+				/* Optional arguments must be attached. */
+				da.config = CONFIG_ALL;
+				optind++;
 			}
 			break;
+		case 'H':
+			hotplug = 1;
+			break;
+		case 'i':
+			parse_ids(optarg);
+			filtering = 1;
+			break;
+		case 'j':
+			workers = strtonum(optarg, 1, USB_MAX_DEVICES - 1,
+			    &errstr);
+			if (errstr)
+				errx(trouble, "workers %s", errstr);
+			break;
+		case 'k':
+			filter.class = strtonum(optarg, 0, 255, &errstr);
+			if (errstr)
+				errx(trouble, "class %s", errstr);
+			filtering = 1;
+			break;
+		case 'L':
+			sockpath = optarg;
+			serving = 1;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'n':
+			filter.driver = optarg;
+			filtering = 1;
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				oformat = OFMT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				oformat = OFMT_JSON;
+			else if (strcmp(optarg, "bin") == 0)
+				oformat = OFMT_BIN;
+			else if (strcmp(optarg, "tree") == 0)
+				oformat = OFMT_TREE;
+			else
+				errx(trouble, "output format %s: unknown", optarg);
+			break;
+		case 'P':
+			parse_probe(optarg);
+			break;
+		case 'p':
+			parallel = 1;
+			break;
+		case 'R':
+			capture_in = optarg;
+			break;
+		case 'r':
+			parse_bursts(optarg);
+			break;
+		case 'S':
+			audit = 1;
+			break;
 		case 's':
-			command = COMM_STAT;
+			da.command |= COMM_STAT;
+			break;
+		case 't':
+			parse_deadline(optarg);
+			break;
+		case 'T':
+			tracing = 1;
 			break;
 		case 'v':
 			verbose++;
 			break;
+		case 'W':
+			capture_out = optarg;
+			break;
+		case 'w':
+			da.interval = parse_interval(optarg);
+			break;
+		case 'x':
+			baseline = optarg;
+			da.quiet = 1;
+			break;
 		default:
 			usage();
 		}
@@ -527,73 +7203,207 @@ main(int argc, char **argv)
 
 	if (argc != 0)
 		usage();
+	if (bursts) {
+		/* -s into the ring, at 1 kHz unless -w says otherwise. */
+		if (da.command != COMM_STAT || da.quiet || hotplug || serving ||
+		    metrics != NULL || capture_out != NULL ||
+		    oformat == OFMT_BIN || oformat == OFMT_TREE)
+			usage();
+		if (da.interval == 0)
+			da.interval = NSEC_PER_SEC / 1000;
+	}
+	if (da.interval && da.command != COMM_STAT && !serving && !hotplug &&
+	    metrics == NULL)
+		usage();
+	if (hotplug && (da.naddrs || (da.command & COMM_STAT)))
+		usage();
+	if (hotplug && (capture_in != NULL || capture_out != NULL))
+		usage();
+	if (da.interval && capture_out != NULL)
+		usage();
+	if (serving && (hotplug || da.naddrs || capture_out != NULL))
+		usage();
+	if ((deadline || da.quiet) && (da.interval || hotplug || serving))
+		usage();
+	if (oformat == OFMT_TREE) {
+		/* A view of the listing, built once the walk is done. */
+		if (da.command || da.naddrs || da.quiet || hotplug || serving)
+			usage();
+		da.quiet = 1;
+	}
+	if (bandwidth) {
+		/* Every device counts against its bus, filtered or not. */
+		if (da.command || da.naddrs || da.quiet || deadline ||
+		    filtering || hotplug || serving || metrics != NULL ||
+		    oformat == OFMT_BIN)
+			usage();
+		da.command = COMM_INFO | COMM_FDSC;
+		da.quiet = 1;
+	}
+	if (audit) {
+		/* Device requests need the controller open for writing. */
+		if (da.command || da.naddrs || da.quiet || deadline ||
+		    hotplug || serving || metrics != NULL || oformat == OFMT_BIN)
+			usage();
+		da.command = COMM_INFO | COMM_DDSC;
+		da.quiet = 1;
+		openmode = O_RDWR;
+	}
+	if (probes) {
+		if (da.command || da.naddrs || da.quiet || deadline ||
+		    hotplug || serving || metrics != NULL || oformat == OFMT_BIN)
+			usage();
+		da.command = COMM_INFO;
+		da.quiet = 1;
+		openmode = O_RDWR;
+	}
+	if (metrics != NULL && !serving) {
+		/* The textfile is the only output. */
+		if (da.command || da.naddrs || da.quiet || deadline ||
+		    hotplug || oformat != OFMT_TEXT)
+			usage();
+		da.quiet = 1;
+	}
+	if (lookup != NULL) {
+		/* Without a view, everything the device has to describe it. */
+		if (da.naddrs || da.quiet || da.interval || hotplug ||
+		    serving || (da.command & COMM_STAT))
+			usage();
+		if (da.command == 0)
+			da.command = COMM_DDSC | COMM_FDSC;
+		da.quiet = 1;
+	}
+	if (serving && da.interval == 0)
+		da.interval = NSEC_PER_SEC;
 
-	if (unveil("/dev", "r") == -1)
-		err(1, "unveil");
-	if (unveil(NULL, NULL) == -1)
-		err(1, "unveil");
+	/*
+	 * The device listing is the default view; asking for another one
+	 * drops it unless -v is given as well.
+	 */
+	if (da.command == 0 || (verbose && da.command != COMM_STAT))
+		da.command |= COMM_INFO;
+	/* -x tells devices apart by what USB_DEVICEINFO says, -a or not. */
+	if (baseline != NULL)
+		da.command |= COMM_INFO;
 
-	if (controller == NULL) {
-		int i;
-		int ncont = 0;
+	/*
+	 * A replay answers from the capture alone; recording and tracing
+	 * wrap whichever backend is left, in that order.
+	 */
+	if (capture_in != NULL) {
+		if ((capin = capture_map(capture_in)) == NULL)
+			errx(trouble, "%s: cannot replay", capture_in);
+		usbdevs_backend = &replay_backend;
+	} else if (unveil("/dev", openmode == O_RDWR ? "rw" : "r") == -1)
+		err(trouble, "unveil");
+	if (baseline != NULL && (capbase = capture_map(baseline)) == NULL)
+		errx(trouble, "%s: cannot diff", baseline);
+	if (capture_out != NULL) {
+		char dir[PATH_MAX];
 
-		for (i = 0; i < 10; i++) {
-			char path[PATH_MAX];
+		/* The capture too is replaced by renaming. */
+		if (strlcpy(dir, capture_out, sizeof(dir)) >= sizeof(dir))
+			errc(trouble, ENAMETOOLONG, "%s", capture_out);
+		capture_start(capture_out);
+		if (unveil(dirname(dir), "rwc") == -1)
+			err(trouble, "unveil");
+		recorded = usbdevs_backend;
+		usbdevs_backend = &record_backend;
+	}
+	if (tracing) {
+		traced = usbdevs_backend;
+		usbdevs_backend = &trace_backend;
+	}
+	if (sockpath != NULL && unveil(sockpath, "rwc") == -1)
+		err(trouble, "unveil");
+	if (cachefile != NULL) {
+		char dir[PATH_MAX];
 
-			snprintf(path, sizeof(path), "%s%d", USBDEV, i);
-			if ((fd = open(path, O_RDONLY)) < 0) {
-				if (errno != ENOENT && errno != ENXIO)
-					warn("%s", path);
-				continue;
-			}
+		/* The cache is replaced by renaming a file next to it. */
+		if (strlcpy(dir, cachefile, sizeof(dir)) >= sizeof(dir))
+			errc(trouble, ENAMETOOLONG, "%s", cachefile);
+		if (unveil(dirname(dir), "rwc") == -1)
+			err(trouble, "unveil");
+		cache_load(cachefile);
+	}
+	if (metrics != NULL) {
+		char dir[PATH_MAX];
 
-			switch (command) {
-			case COMM_INFO:
-				dump_controller(path, fd, addr);
-				break;
-			case COMM_CDSC:
-				dump_config(path, fd, addr, cfgnum);
-				break;
-			case COMM_DDSC:
-				dump_device_desc(path, fd, addr);
-				break;
-			case COMM_FDSC:
-				full_dump(path, fd, addr, cfgnum);
-				break;
-			case COMM_STAT:
-				dump_stats(path, fd);
-				break;
-			}
-			close(fd);
-			ncont++;
+		/* So is the textfile, for the collector to see it whole. */
+		if (strlcpy(dir, metrics, sizeof(dir)) >= sizeof(dir))
+			errc(trouble, ENAMETOOLONG, "%s", metrics);
+		if (unveil(dirname(dir), "rwc") == -1)
+			err(trouble, "unveil");
+	}
+	if (unveil(NULL, NULL) == -1)
+		err(trouble, "unveil");
+
+	if (controller == NULL) {
+		struct controller_scan cs = { &ctl, &ncont };
+
+		if (usbdevs_scan(controller_found, &cs) == -1) {
+			warn("%s", USBDEV_DIR);
+			unlisted = 1;
+			unread++;
 		}
-		if (verbose && ncont == 0)
+		if (verbose && ncont == 0 &&
+		    (oformat == OFMT_TEXT || oformat == OFMT_TREE)) {
 			printf("%s: no USB controllers found\n",
 			    __progname);
+			fflush(stdout);
+		}
 	} else {
-		if ((fd = open(controller, O_RDONLY)) < 0)
-			err(1, "%s", controller);
+		if ((ctl = calloc(1, sizeof(*ctl))) == NULL)
+			err(trouble, NULL);
+		if (strlcpy(ctl[0].path, controller, sizeof(ctl[0].path)) >=
+		    sizeof(ctl[0].path))
+			errc(trouble, ENAMETOOLONG, "%s", controller);
+		if ((ctl[0].fd = controller_fd(controller)) < 0)
+			err(trouble, "%s", controller);
+		ctl[0].ob.fd = STDOUT_FILENO;
+		ctl[0].bus = controller_bus(controller);
+		ncont = 1;
+	}
+	for (i = 0; i < ncont; i++)
+		ctl[i].da = &da;
 
-		switch (command) {
-		case COMM_INFO:
-			dump_controller(controller, fd, addr);
-			break;
-		case COMM_CDSC:
-			dump_config(controller, fd, addr, cfgnum);
-			break;
-		case COMM_DDSC:
-			dump_device_desc(controller, fd, addr);
-			break;
-		case COMM_FDSC:
-			full_dump(controller, fd, addr, cfgnum);
-			break;
-		case COMM_STAT:
-			dump_stats(controller, fd);
-			break;
-		}
-		
-		close(fd);
+	if (oformat == OFMT_BIN) {
+		struct obuf ob = { .fd = STDOUT_FILENO };
+
+		bin_file(&ob);
+		ob_flush(&ob);
+		free(ob.buf);
 	}
 
-	return 0;
+	if (serving)
+		serve(sockpath, &da, &ctl, &ncont);
+	else if (metrics != NULL)
+		watch_metrics(&da, ctl, ncont);
+	else if (hotplug && da.interval)
+		watch_refresh(&da, ctl, ncont);
+	else if (da.interval)
+		watch_stats(ctl, ncont);
+	else if (hotplug)
+		watch_hotplug(&da, &ctl, &ncont);
+	else if (capbase != NULL) {
+		status = diff_controllers(&da, ctl, ncont) != 0;
+		if (unread)
+			status = trouble;
+	}
+	else if (lookup != NULL)
+		status = dump_driver(&da, ctl, ncont);
+	else
+		dump_controllers(ctl, ncont);
+
+	for (i = 0; i < ncont; i++)
+		if (ctl[i].fd != -1)
+			controller_close(&ctl[i]);
+	free(ctl);
+	cache_save();
+	capture_write();
+	if (traced != NULL)
+		trace_report();
+
+	/* Like diff(1), 1 if anything changed and 2 on trouble. */
+	return status;
 }
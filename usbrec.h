@@ -0,0 +1,134 @@
+/*
+ * Record stream written by "myusbdevs -o bin".
+ *
+ * The stream is a struct usbrec_file followed by records.  Every
+ * record starts with a struct usbrec_hdr whose size covers the whole
+ * record, so readers can skip types they do not know; the layout of
+ * each known type is fixed and a multiple of 8 bytes, so a file of
+ * records can be mmap'd and walked in place.  All integers are in
+ * host byte order; a reader on another host can tell from the magic.
+ */
+
+#ifndef USBREC_H
+#define USBREC_H
+
+#include <stdint.h>
+
+#define USBREC_MAGIC		0x52425355	/* "USBR" */
+#define USBREC_VERSION		1
+
+#define USBREC_CONTROLLER	1
+#define USBREC_DEVICE		2
+#define USBREC_DDESC		3
+#define USBREC_CONFIG		4
+#define USBREC_IFACE		5
+#define USBREC_ENDPT		6
+#define USBREC_DESC		7	/* any other descriptor */
+#define USBREC_STATS		8
+#define USBREC_ATTACH		9
+#define USBREC_DETACH		10
+#define USBREC_TIMEOUT		11	/* a struct usbrec_hdr alone */
+#define USBREC_CHANGE		12
+
+#define USBREC_STRLEN		128
+#define USBREC_NAMELEN		16
+#define USBREC_NDEVNAMES	4
+#define USBREC_NPORTS		16
+
+struct usbrec_file {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	size;		/* of this header */
+};
+
+struct usbrec_hdr {
+	uint16_t	type;
+	uint16_t	size;		/* of the record, header included */
+	uint16_t	ctlr;		/* index of the USBREC_CONTROLLER */
+	uint8_t		addr;		/* 0 for controller-wide records */
+	uint8_t		pad;
+};
+
+struct usbrec_controller {
+	struct usbrec_hdr hdr;
+	char		path[64];
+};
+
+struct usbrec_device {
+	struct usbrec_hdr hdr;
+	uint16_t	vendorNo;
+	uint16_t	productNo;
+	uint16_t	releaseNo;
+	uint8_t		bus;
+	uint8_t		class;
+	uint8_t		subclass;
+	uint8_t		protocol;
+	uint8_t		config;
+	uint8_t		speed;		/* USB_SPEED_* */
+	uint32_t	power;		/* mA, 0 if self powered */
+	uint32_t	nports;
+	uint32_t	ports[USBREC_NPORTS];	/* change << 16 | status */
+	char		vendor[USBREC_STRLEN];
+	char		product[USBREC_STRLEN];
+	char		serial[USBREC_STRLEN];
+	char		release[8];
+	char		devnames[USBREC_NDEVNAMES][USBREC_NAMELEN];
+	uint32_t	pad;
+};
+
+struct usbrec_ddesc {
+	struct usbrec_hdr hdr;
+	uint8_t		desc[18];	/* usb_device_descriptor_t */
+	uint8_t		pad[6];
+};
+
+struct usbrec_config {
+	struct usbrec_hdr hdr;
+	uint8_t		desc[9];	/* usb_config_descriptor_t */
+	uint8_t		pad[7];
+};
+
+struct usbrec_iface {
+	struct usbrec_hdr hdr;
+	uint8_t		config;		/* bConfigurationValue */
+	uint8_t		iface;
+	uint8_t		altset;
+	uint8_t		numendpts;
+	uint8_t		class;
+	uint8_t		subclass;
+	uint8_t		protocol;
+	uint8_t		pad;
+};
+
+struct usbrec_endpt {
+	struct usbrec_hdr hdr;
+	uint8_t		config;
+	uint8_t		iface;
+	uint8_t		altset;
+	uint8_t		address;	/* bEndpointAddress */
+	uint8_t		attributes;	/* bmAttributes */
+	uint8_t		interval;	/* bInterval */
+	uint16_t	maxpacket;	/* wMaxPacketSize */
+};
+
+struct usbrec_desc {
+	struct usbrec_hdr hdr;
+	uint8_t		config;
+	uint8_t		len;		/* bLength of data */
+	uint8_t		data[254];
+};
+
+struct usbrec_stats {
+	struct usbrec_hdr hdr;
+	uint64_t	ns;		/* CLOCK_MONOTONIC of the sample */
+	uint64_t	requests[4];	/* control, isoc, bulk, interrupt */
+};
+
+struct usbrec_change {
+	struct usbrec_hdr hdr;
+	char		field[USBREC_NAMELEN];
+	char		old[USBREC_STRLEN];	/* empty for descriptors */
+	char		new[USBREC_STRLEN];
+};
+
+#endif /* USBREC_H */